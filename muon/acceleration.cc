@@ -1,47 +1,266 @@
 #include "muon/acceleration.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <limits>
+#include <thread>
+#include <utility>
+
+#include "muon/morton.h"
+#include "muon/parallel.h"
+#include "muon/transform.h"
+#include "muon/types.h"
 
 namespace muon {
 namespace acceleration {
 
+Workspace *Workspace::Nested(const Structure &structure) {
+  std::unique_ptr<Workspace> &nested = nested_[&structure];
+  if (!nested) {
+    nested = structure.CreateWorkspace();
+  }
+  return nested.get();
+}
+
 void Structure::AddPrimitive(std::unique_ptr<Primitive> obj) {
+  obj->order = primitives_.size();
   primitives_.push_back(std::move(obj));
 }
 
-absl::optional<Intersection> Linear::Intersect(Workspace *workspace,
-                                               const Ray &ray) const {
-  float min_dist = std::numeric_limits<float>::infinity();
-  absl::optional<Intersection> hit;
+void Structure::AddInstance(std::unique_ptr<Instance> instance) {
+  const Structure &structure = instance->structure();
+  bool first_instance = instanced_structures_.insert(&structure).second;
+  build_stats_.AddInstance(structure.build_stats(), first_instance);
+  AddPrimitive(std::move(instance));
+}
+
+void Structure::Refit() {
+  auto start_time = std::chrono::steady_clock::now();
+  Init();
+  build_stats_.AddRefit(std::chrono::steady_clock::now() - start_time,
+                        /*rebuilt=*/true);
+}
+
+void Structure::AddToCacheKey(CacheKey &key) const {
+  key.Add(uint64_t(primitives_.size()));
+  for (const auto &obj : primitives_) {
+    obj->AddToCacheKey(key);
+  }
+}
 
+void Structure::PreTransformPrimitives() {
   for (const auto &obj : primitives_) {
+    obj->PreTransform();
+  }
+}
+
+absl::optional<Intersection> Structure::Intersect(Workspace *workspace,
+                                                  const Ray &ray) const {
+  HitRecord hit;
+  if (!IntersectClosest(workspace, ray, hit)) {
+    return absl::nullopt;
+  }
+  return ResolveClosestHit(ray, hit);
+}
+
+void Structure::IntersectClosestPacket(Workspace *workspace, const Ray *rays,
+                                       int num_rays, HitRecord *hits) const {
+  for (int i = 0; i < num_rays; ++i) {
+    IntersectClosest(workspace, rays[i], hits[i]);
+  }
+}
+
+bool Structure::HasIntersection(Workspace *workspace, const Ray &ray,
+                                const float max_distance) const {
+  workspace->stats.IncrementOcclusionTests();
+  if (workspace->occluder.primitive != nullptr) {
     workspace->stats.IncrementObjectTests();
-    absl::optional<Intersection> intersection = obj->Intersect(ray);
-    if (!intersection) {
-      continue;
+    if (workspace->occluder.HasIntersection(workspace, ray, max_distance)) {
+      workspace->stats.IncrementObjectHits();
+      workspace->stats.IncrementOccluderCacheHits();
+      return true;
     }
-    workspace->stats.IncrementObjectHits();
+  }
+  PrimitiveRef occluder = FindOccluder(workspace, ray, max_distance);
+  if (occluder.primitive == nullptr) {
+    return false;
+  }
+  workspace->occluder = occluder;
+  return true;
+}
 
-    // Check that object is in front of the ray's origin, and closer than
-    // anything else we've found.
-    if (intersection->distance > 0.0f && intersection->distance < min_dist) {
-      min_dist = intersection->distance;
-      hit = intersection;
+std::vector<PrimitiveRef> Structure::GatherPrimitiveRefs() const {
+  size_t num_refs = 0;
+  for (const auto &obj : primitives_) {
+    num_refs += obj->num_parts();
+  }
+  std::vector<PrimitiveRef> refs;
+  refs.reserve(num_refs);
+  for (const auto &obj : primitives_) {
+    PrimitiveType type = obj->type();
+    for (uint32_t part = 0; part < obj->num_parts(); ++part) {
+      refs.push_back(PrimitiveRef{obj.get(), part, type});
     }
   }
-  return hit;
+  return refs;
 }
 
-bool Linear::HasIntersection(Workspace *workspace, const Ray &ray,
-                             const float max_distance) const {
+Bounds Structure::WorldBounds() const {
+  Bounds bounds;
   for (const auto &obj : primitives_) {
-    if (obj->HasIntersection(ray, max_distance)) {
-      return true;
+    bounds = Bounds::Union(bounds, obj->WorldBounds());
+  }
+  return bounds;
+}
+
+Instance::Instance(std::shared_ptr<const Structure> structure)
+    : structure_(std::move(structure)),
+      object_bounds_(structure_->WorldBounds()) {}
+
+Bounds Instance::ObjectBounds() const { return object_bounds_; }
+
+absl::optional<Intersection> Instance::Intersect(const Ray &ray) {
+  std::unique_ptr<Workspace> workspace = structure_->CreateWorkspace();
+  return Intersect(workspace.get(), ray);
+}
+
+bool Instance::HasIntersection(const Ray &ray, const float max_distance) {
+  std::unique_ptr<Workspace> workspace = structure_->CreateWorkspace();
+  return HasIntersection(workspace.get(), ray, 0, max_distance);
+}
+
+absl::optional<Intersection> Instance::Intersect(Workspace *workspace,
+                                                 const Ray &ray) {
+  HitRecord hit;
+  if (!IntersectClosest(workspace, ray, 0, hit)) {
+    return absl::nullopt;
+  }
+  return ResolveHit(ray, hit);
+}
+
+bool Instance::IntersectClosest(Workspace *workspace, const Ray &ray,
+                                uint32_t part, HitRecord &hit) {
+  float distance_scale;
+  Ray object_ray = ToObjectSpace(ray, distance_scale);
+  Workspace *nested = workspace->Nested(*structure_);
+  // Only look for hits closer than the closest so far, in object space
+  // distances. Whether the hit is closer is decided by its world distance.
+  HitRecord object_hit;
+  object_hit.distance = ObjectSpaceBound(hit.distance, distance_scale);
+  bool found = structure_->IntersectClosest(nested, object_ray, object_hit);
+  // Fold the bottom-level traversal's stats into the caller's.
+  workspace->stats += nested->stats;
+  nested->stats = TraceStats();
+  float distance = object_hit.distance / distance_scale;
+  if (!found || !IsCloserHit(distance, this, 0, hit)) {
+    return false;
+  }
+  hit = object_hit;
+  hit.distance = distance;
+  hit.instance = this;
+  return true;
+}
+
+Intersection Instance::ResolveHit(const Ray &ray, const HitRecord &hit) {
+  float distance_scale;
+  Ray object_ray = ToObjectSpace(ray, distance_scale);
+  HitRecord object_hit = hit;
+  object_hit.distance = hit.distance * distance_scale;
+  object_hit.instance = nullptr;
+  Intersection intersection = ResolveClosestHit(object_ray, object_hit);
+  // Bring the intersection point and normal back to world coordinates, as in
+  // Primitive::Intersect().
+  intersection.pos = TransformPosition(*transform, intersection.pos);
+  intersection.normal =
+      TransformDirection(*inv_transpose_transform, intersection.normal);
+  intersection.distance = hit.distance;
+  intersection.obj = this;
+  return intersection;
+}
+
+bool Instance::HasIntersection(Workspace *workspace, const Ray &ray,
+                               uint32_t part, const float max_distance) {
+  float distance_scale;
+  Ray object_ray = ToObjectSpace(ray, distance_scale);
+  Workspace *nested = workspace->Nested(*structure_);
+  bool hit = structure_->HasIntersection(nested, object_ray,
+                                         max_distance * distance_scale);
+  workspace->stats += nested->stats;
+  nested->stats = TraceStats();
+  return hit;
+}
+
+absl::optional<Intersection> Instance::IntersectObjectSpace(const Ray &ray,
+                                                            float t_min,
+                                                            float t_max) {
+  std::unique_ptr<Workspace> workspace = structure_->CreateWorkspace();
+  // Structures only bound the far end of the range, so a hit closer than t_min
+  // hides any farther ones.
+  HitRecord hit;
+  hit.distance = t_max;
+  if (!structure_->IntersectClosest(workspace.get(), ray, hit) ||
+      hit.distance <= t_min) {
+    return absl::nullopt;
+  }
+  Intersection intersection = ResolveClosestHit(ray, hit);
+  intersection.obj = this;
+  return intersection;
+}
+
+void Linear::Init() {
+  refs_ = GatherPrimitiveRefs();
+  build_stats_.SetNumPrimitives(refs_.size());
+  // Cache the world bounds of each primitive, which allows cheaply skipping
+  // most primitives before running their full intersection tests.
+  bounds_.clear();
+  bounds_.reserve(refs_.size());
+  for (const PrimitiveRef &ref : refs_) {
+    bounds_.push_back(ref.WorldBounds());
+  }
+}
+
+bool Linear::IntersectClosest(Workspace *workspace, const Ray &ray,
+                              HitRecord &hit) const {
+  TraversalRay traversal_ray(ray);
+  bool found = false;
+  for (size_t i = 0; i < refs_.size(); ++i) {
+    workspace->stats.IncrementBoundsTests();
+    if (!bounds_[i].HasIntersection(traversal_ray,
+                                    hit.distance * kDistanceBoundScale)) {
+      continue;
+    }
+    workspace->stats.IncrementBoundsHits();
+
+    // The primitive only records hits in front of the ray's origin, and closer
+    // than anything else we've found.
+    workspace->stats.IncrementObjectTests();
+    if (refs_[i].IntersectClosest(workspace, ray, hit)) {
+      workspace->stats.IncrementObjectHits();
+      found = true;
     }
   }
-  return false;
+  return found;
+}
+
+PrimitiveRef Linear::FindOccluder(Workspace *workspace, const Ray &ray,
+                                  const float max_distance) const {
+  TraversalRay traversal_ray(ray);
+  const float cull_distance = max_distance * kDistanceBoundScale;
+  for (size_t i = 0; i < refs_.size(); ++i) {
+    workspace->stats.IncrementBoundsTests();
+    if (!bounds_[i].HasIntersection(traversal_ray, cull_distance)) {
+      continue;
+    }
+    workspace->stats.IncrementBoundsHits();
+    workspace->stats.IncrementObjectTests();
+    if (refs_[i].HasIntersection(workspace, ray, max_distance)) {
+      workspace->stats.IncrementObjectHits();
+      return refs_[i];
+    }
+  }
+  return PrimitiveRef();
 }
 
 PrimitiveInfo::PrimitiveInfo(size_t original_index, const Bounds &bounds)
@@ -55,16 +274,18 @@ PrimitiveInfo::PrimitiveInfo(size_t original_index, const Bounds &bounds)
 BVHNode::BVHNode(size_t num_primitives, size_t start, const Bounds &bounds)
     : num_primitives(num_primitives), start(start), bounds(bounds) {}
 
-BVHNode::BVHNode(std::unique_ptr<BVHNode> left, std::unique_ptr<BVHNode> right,
-                 int axis)
+BVHNode::BVHNode(BVHNode *left, BVHNode *right, int axis)
     : num_primitives(0),
       axis(axis),
-      children{std::move(left), std::move(right)},
+      children{left, right},
       bounds(Bounds::Union(children[0]->bounds, children[1]->bounds)) {}
 
-absl::optional<Intersection> BVH::Intersect(Workspace *workspace,
-                                            const Ray &ray) const {
-  std::vector<BVHNode *> &frontier =
+bool BVH::IntersectClosest(Workspace *workspace, const Ray &ray,
+                           HitRecord &hit) const {
+  if (nodes_.empty()) {
+    return false;
+  }
+  std::vector<uint32_t> &frontier =
       static_cast<BVHWorkspace *>(workspace)->frontier_;
   // Precompute the child order that we will check for each of the potential
   // split axes based on the sign of the ray in the split axis. If the sign is
@@ -74,158 +295,864 @@ absl::optional<Intersection> BVH::Intersect(Workspace *workspace,
   // assumption is that they will generally originate from "outside" the
   // scene's geometry, and so checking the closer child should allow us to not
   // check too deep into the BVH tree if we've already found a closer match.
-  glm::vec3 ray_dir = ray.direction();
-  size_t child_to_visit_first[3] = {
-      ray_dir.x < 0,
-      ray_dir.y < 0,
-      ray_dir.z < 0,
-  };
+  // The traversal ray caches the ray's inverse direction and direction signs,
+  // which are needed for every bounds test.
+  TraversalRay traversal_ray(ray);
+  const int *dir_is_negative = traversal_ray.dir_is_negative;
+  TriangleRay triangle_ray(ray);
 
   // We perform an iterative depth-first search down the BVH tree, maintaing a
-  // stack of nodes to visit and the closest intersection we've seen so far.
-  float min_dist = std::numeric_limits<float>::infinity();
-  absl::optional<Intersection> hit;
-  BVHNode *node = root_.get();
+  // stack of nodes to visit and the closest hit we've seen so far. Only the
+  // hit's compact record is kept up to date during the search; it's resolved
+  // into a full intersection by the caller.
+  const float max_distance = hit.distance;
+  uint32_t node_index = 0;
 
   while (true) {
+    const LinearBVHNode &node = nodes_[node_index];
     // Skip the current node if we don't intersect with its bounds.
     workspace->stats.IncrementBoundsTests();
-    if (!node->bounds.HasIntersection(ray, min_dist)) {
+    if (!node.bounds.HasIntersection(traversal_ray,
+                                     hit.distance * kDistanceBoundScale)) {
       if (frontier.empty()) {
         break;
       }
-      node = frontier.back();
+      node_index = frontier.back();
       frontier.pop_back();
       continue;
     }
     workspace->stats.IncrementBoundsHits();
 
     // If this is a leaf node, intersect with the primitives directly.
-    if (node->num_primitives > 0) {
-      // TODO: De-duplicate this kind of iteration logic.
-      for (size_t i = node->start; i < node->start + node->num_primitives;
-           ++i) {
-        workspace->stats.IncrementObjectTests();
-        absl::optional<Intersection> intersection =
-            primitives_[i]->Intersect(ray);
-        if (!intersection) {
-          continue;
-        }
-        workspace->stats.IncrementObjectHits();
-
-        // Check that the object is in front of the ray's origin, and closer
-        // than anything else we've found.
-        // TODO: Do we need to check this here? If we add the min_dist argument
-        // to the primitives' Intersect method, we could just rely on that.
-        if (intersection->distance > 0.0f &&
-            intersection->distance < min_dist) {
-          min_dist = intersection->distance;
-          hit = intersection;
-        }
-      }
+    if (node.num_primitives > 0) {
+      IntersectLeaf(workspace, ray, triangle_ray, node.primitives_offset,
+                    node.num_primitives, hit);
       if (frontier.empty()) {
         break;
       }
-      node = frontier.back();
+      node_index = frontier.back();
       frontier.pop_back();
       continue;
     }
 
-    // If we reach here, then we're dealing with an internal node.
-    size_t c = child_to_visit_first[node->axis];
-    // Save the farther child for later.
-    frontier.push_back(node->children[1 - c].get());
-    node = node->children[c].get();
+    // If we reach here, then we're dealing with an internal node. The first
+    // child is always stored directly after its parent.
+    if (dir_is_negative[node.axis]) {
+      // Save the farther child for later.
+      frontier.push_back(node_index + 1);
+      node_index = node.second_child_offset;
+    } else {
+      frontier.push_back(node.second_child_offset);
+      node_index = node_index + 1;
+    }
   }
 
-  return hit;
+  return hit.distance < max_distance;
 }
 
-bool BVH::HasIntersection(Workspace *workspace, const Ray &ray,
-                          const float max_distance) const {
-  std::vector<BVHNode *> &frontier =
+void BVH::IntersectClosestPacket(Workspace *workspace, const Ray *rays,
+                                 int num_rays, HitRecord *hits) const {
+  RayPacket packet(rays, num_rays);
+  // Rays whose directions differ in sign would want to visit the children of
+  // some nodes in different orders, so they're traced individually instead.
+  if (nodes_.empty() || num_rays == 1 || !packet.coherent) {
+    Structure::IntersectClosestPacket(workspace, rays, num_rays, hits);
+    return;
+  }
+  std::vector<BVHPacketStackEntry> &frontier =
+      static_cast<BVHWorkspace *>(workspace)->packet_frontier_;
+  TriangleRay triangle_rays[kMaxRayPacketSize];
+  // The closest hit distance of each ray so far, widened like
+  // IntersectClosest()'s, which bounds its tests.
+  float max_distance[kMaxRayPacketSize] = {};
+  for (int i = 0; i < num_rays; ++i) {
+    triangle_rays[i] = TriangleRay(rays[i]);
+    max_distance[i] = hits[i].distance * kDistanceBoundScale;
+  }
+
+  // This follows IntersectClosest(), except that each node is visited with the
+  // bitmask of the rays that are still active in it. Since all rays visit the
+  // children in the same order, and each ray's hit only changes in the leaves
+  // that it reaches, each ray ends up with the same hit as it would alone.
+  frontier.push_back({0, (1u << num_rays) - 1});
+  while (!frontier.empty()) {
+    const BVHPacketStackEntry entry = frontier.back();
+    frontier.pop_back();
+    const LinearBVHNode &node = nodes_[entry.index];
+
+    // Skip the node without testing each ray if the packet's interval bounds
+    // miss it.
+    float packet_max_distance = 0.0f;
+    for (int i = 0; i < num_rays; ++i) {
+      if (entry.active & (1u << i)) {
+        packet_max_distance = std::max(packet_max_distance, max_distance[i]);
+      }
+    }
+    workspace->stats.IncrementBoundsTests(__builtin_popcount(entry.active));
+    if (PacketMissesBounds(node.bounds, packet, packet_max_distance)) {
+      continue;
+    }
+    uint32_t active =
+        IntersectPacketBounds(node.bounds, packet, max_distance, entry.active);
+    if (active == 0) {
+      continue;
+    }
+    workspace->stats.IncrementBoundsHits(__builtin_popcount(active));
+
+    if (node.num_primitives > 0) {
+      for (int i = 0; i < num_rays; ++i) {
+        if (!(active & (1u << i))) {
+          continue;
+        }
+        IntersectLeaf(workspace, rays[i], triangle_rays[i],
+                      node.primitives_offset, node.num_primitives, hits[i]);
+        max_distance[i] = hits[i].distance * kDistanceBoundScale;
+      }
+      continue;
+    }
+
+    // Push the farther child first, so that the nearer one is visited next.
+    if (packet.dir_is_negative[node.axis]) {
+      frontier.push_back({entry.index + 1, active});
+      frontier.push_back({node.second_child_offset, active});
+    } else {
+      frontier.push_back({node.second_child_offset, active});
+      frontier.push_back({entry.index + 1, active});
+    }
+  }
+}
+
+PrimitiveRef BVH::FindOccluder(Workspace *workspace, const Ray &ray,
+                               const float max_distance) const {
+  if (nodes_.empty()) {
+    return PrimitiveRef();
+  }
+  std::vector<uint32_t> &frontier =
       static_cast<BVHWorkspace *>(workspace)->frontier_;
-  // See Intersect() for details on how the intersection logic works. The main
-  // difference here is that we use HasIntersection with the primitives, and
-  // return immediately if true.
-  glm::vec3 ray_dir = ray.direction();
-  size_t child_to_visit_first[3] = {
-      ray_dir.x < 0,
-      ray_dir.y < 0,
-      ray_dir.z < 0,
-  };
+  // See IntersectClosest() for details on how the intersection logic works.
+  // The main difference here is that we use HasIntersection with the
+  // primitives, and return immediately if true. Children are visited in the
+  // same order, which only depends on the direction's signs and so is free to
+  // compute.
+  TraversalRay traversal_ray(ray);
+  const int *dir_is_negative = traversal_ray.dir_is_negative;
+  TriangleRay triangle_ray(ray);
+  const float cull_distance = max_distance * kDistanceBoundScale;
 
-  BVHNode *node = root_.get();
+  uint32_t node_index = 0;
 
   while (true) {
+    const LinearBVHNode &node = nodes_[node_index];
     // Skip the current node if we don't intersect with its bounds.
     workspace->stats.IncrementBoundsTests();
-    if (!node->bounds.HasIntersection(ray, max_distance)) {
+    if (!node.bounds.HasIntersection(traversal_ray, cull_distance)) {
       if (frontier.empty()) {
         break;
       }
-      node = frontier.back();
+      node_index = frontier.back();
       frontier.pop_back();
       continue;
     }
     workspace->stats.IncrementBoundsHits();
 
     // If this is a leaf node, intersect with the primitives directly.
-    if (node->num_primitives > 0) {
-      for (size_t i = node->start; i < node->start + node->num_primitives;
-           ++i) {
-        workspace->stats.IncrementObjectTests();
-        if (primitives_[i]->HasIntersection(ray, max_distance)) {
-          workspace->stats.IncrementObjectHits();
-          // Clear the frontier since we're exiting before searching it
-          // completely.
-          frontier.clear();
-          return true;
-        }
+    if (node.num_primitives > 0) {
+      PrimitiveRef occluder =
+          FindLeafOccluder(workspace, ray, triangle_ray, node.primitives_offset,
+                           node.num_primitives, max_distance);
+      if (occluder.primitive != nullptr) {
+        // Clear the frontier since we're exiting before searching it
+        // completely.
+        frontier.clear();
+        return occluder;
       }
       if (frontier.empty()) {
         break;
       }
-      node = frontier.back();
+      node_index = frontier.back();
       frontier.pop_back();
       continue;
     }
 
     // If we reach here, then we're dealing with an internal node.
-    size_t c = child_to_visit_first[node->axis];
-    // Save the farther child for later.
-    frontier.push_back(node->children[1 - c].get());
-    node = node->children[c].get();
+    if (dir_is_negative[node.axis]) {
+      // Save the farther child for later.
+      frontier.push_back(node_index + 1);
+      node_index = node.second_child_offset;
+    } else {
+      frontier.push_back(node.second_child_offset);
+      node_index = node_index + 1;
+    }
+  }
+
+  return PrimitiveRef();
+}
+
+namespace {
+
+// The classes of the primitive types that leaves dispatch to directly. Their
+// kernels are final and defined inline, so calling them through the class
+// skips the virtual call and lets them be inlined into the leaf loops. Other
+// primitives go through Primitive's virtual interface.
+template <PrimitiveType kType>
+struct PrimitiveClass {
+  using type = Primitive;
+};
+template <>
+struct PrimitiveClass<PrimitiveType::kTriangle> {
+  using type = Mesh;
+};
+template <>
+struct PrimitiveClass<PrimitiveType::kSphere> {
+  using type = Sphere;
+};
+
+// Intersects the ray with the run of references of the given type that starts
+// at refs[i] and ends before refs[end] at the latest, and updates `hit` if any
+// of them are hit closer than it. Returns the index after the run.
+template <PrimitiveType kType>
+uint32_t IntersectRun(Workspace *workspace, const Ray &ray,
+                      const PrimitiveRef *refs, uint32_t i, uint32_t end,
+                      HitRecord &hit) {
+  using Class = typename PrimitiveClass<kType>::type;
+  for (; i < end && refs[i].type == kType; ++i) {
+    workspace->stats.IncrementObjectTests();
+    if (static_cast<Class *>(refs[i].primitive)
+            ->IntersectClosest(workspace, ray, refs[i].part, hit)) {
+      workspace->stats.IncrementObjectHits();
+    }
   }
+  return i;
+}
 
+// Same as IntersectRun(), but stops at the first reference that's hit within a
+// distance along the ray. Returns whether there was one, in which case `i` is
+// its index; otherwise, `i` is the index after the run.
+template <PrimitiveType kType>
+bool FindRunOccluder(Workspace *workspace, const Ray &ray,
+                     const PrimitiveRef *refs, uint32_t &i, uint32_t end,
+                     const float max_distance) {
+  using Class = typename PrimitiveClass<kType>::type;
+  for (; i < end && refs[i].type == kType; ++i) {
+    workspace->stats.IncrementObjectTests();
+    if (static_cast<Class *>(refs[i].primitive)
+            ->HasIntersection(workspace, ray, refs[i].part, max_distance)) {
+      workspace->stats.IncrementObjectHits();
+      return true;
+    }
+  }
   return false;
 }
 
+// Returns the position of a reference within its leaf: pre-transformed tris
+// come first, since they're packed, and the rest are grouped by type.
+int LeafOrder(const PrimitiveRef &ref) {
+  if (ref.type == PrimitiveType::kTriangle &&
+      static_cast<Mesh *>(ref.primitive)->pretransformed()) {
+    return 0;
+  }
+  return 1 + static_cast<int>(ref.type);
+}
+
+// Orders references within a leaf by LeafOrder(), and then by primitive order
+// and part, as IsCloserHit() does.
+bool LeafLess(const PrimitiveRef &a, const PrimitiveRef &b) {
+  int a_order = LeafOrder(a);
+  int b_order = LeafOrder(b);
+  if (a_order != b_order) {
+    return a_order < b_order;
+  }
+  if (a.primitive->order != b.primitive->order) {
+    return a.primitive->order < b.primitive->order;
+  }
+  return a.part < b.part;
+}
+
+}  // namespace
+
+void BVH::IntersectLeaf(Workspace *workspace, const Ray &ray,
+                        const TriangleRay &triangle_ray, uint32_t start,
+                        uint32_t num_primitives, HitRecord &hit) const {
+  const uint32_t end = start + num_primitives;
+  // Test the packed tris first.
+  if (!leaf_triangles_.empty()) {
+    const LeafTriangles &leaf = leaf_triangles_[start];
+    for (uint32_t i = 0; i < leaf.num_triangles; i += kTrianglePacketWidth) {
+      const TrianglePacket &packet =
+          triangle_packets_[leaf.first_packet + i / kTrianglePacketWidth];
+      workspace->stats.IncrementObjectTests(packet.num_triangles);
+      // Match Mesh::IntersectClosest(). The packet's tris are sorted by
+      // IsCloserHit()'s order, so of several equally close ones, the first
+      // lane's is the one to record.
+      TriangleHit tri_hit;
+      int lane = IntersectTrianglePacket(
+          triangle_ray, packet,
+          hit.distance * kDistanceBoundScale / triangle_ray.length, tri_hit);
+      if (lane < 0) {
+        continue;
+      }
+      const PrimitiveRef &ref = leaf_primitives_[start + i + lane];
+      float distance = tri_hit.t * triangle_ray.length;
+      if (!IsCloserHit(distance, ref.primitive, ref.part, hit)) {
+        continue;
+      }
+      workspace->stats.IncrementObjectHits();
+      hit.distance = distance;
+      hit.t = tri_hit.t;
+      hit.weights = tri_hit.weights;
+      hit.primitive = ref.primitive;
+      hit.part = ref.part;
+      hit.instance = nullptr;
+    }
+    start += leaf.num_triangles;
+  }
+
+  // The primitives only record hits in front of the ray's origin, and closer
+  // than anything else we've found. Leaves are sorted by type, so this
+  // usually dispatches once per type.
+  const PrimitiveRef *refs = leaf_primitives_.data();
+  for (uint32_t i = start; i < end;) {
+    switch (refs[i].type) {
+      case PrimitiveType::kTriangle:
+        i = IntersectRun<PrimitiveType::kTriangle>(workspace, ray, refs, i, end,
+                                                   hit);
+        break;
+      case PrimitiveType::kSphere:
+        i = IntersectRun<PrimitiveType::kSphere>(workspace, ray, refs, i, end,
+                                                 hit);
+        break;
+      case PrimitiveType::kGeneric:
+        i = IntersectRun<PrimitiveType::kGeneric>(workspace, ray, refs, i, end,
+                                                  hit);
+        break;
+    }
+  }
+}
+
+PrimitiveRef BVH::FindLeafOccluder(Workspace *workspace, const Ray &ray,
+                                   const TriangleRay &triangle_ray,
+                                   uint32_t start, uint32_t num_primitives,
+                                   const float max_distance) const {
+  const uint32_t end = start + num_primitives;
+  if (!leaf_triangles_.empty()) {
+    const LeafTriangles &leaf = leaf_triangles_[start];
+    for (uint32_t i = 0; i < leaf.num_triangles; i += kTrianglePacketWidth) {
+      const TrianglePacket &packet =
+          triangle_packets_[leaf.first_packet + i / kTrianglePacketWidth];
+      workspace->stats.IncrementObjectTests(packet.num_triangles);
+      TriangleHit tri_hit;
+      int lane = IntersectTrianglePacket(
+          triangle_ray, packet, max_distance / triangle_ray.length, tri_hit);
+      if (lane >= 0) {
+        workspace->stats.IncrementObjectHits();
+        return leaf_primitives_[start + i + lane];
+      }
+    }
+    start += leaf.num_triangles;
+  }
+
+  const PrimitiveRef *refs = leaf_primitives_.data();
+  for (uint32_t i = start; i < end;) {
+    bool found = false;
+    switch (refs[i].type) {
+      case PrimitiveType::kTriangle:
+        found = FindRunOccluder<PrimitiveType::kTriangle>(workspace, ray, refs,
+                                                          i, end, max_distance);
+        break;
+      case PrimitiveType::kSphere:
+        found = FindRunOccluder<PrimitiveType::kSphere>(workspace, ray, refs, i,
+                                                        end, max_distance);
+        break;
+      case PrimitiveType::kGeneric:
+        found = FindRunOccluder<PrimitiveType::kGeneric>(workspace, ray, refs,
+                                                         i, end, max_distance);
+        break;
+    }
+    if (found) {
+      return refs[i];
+    }
+  }
+  return PrimitiveRef();
+}
+
+void BVH::RecordTreeQuality(const BVHNode &root) {
+  float root_area = root.bounds.SurfaceArea();
+  if (!(root_area > 0.0f)) {
+    return;
+  }
+  // The SAH cost sums the cost of each node weighed by the probability that a
+  // ray hitting the root also hits the node, i.e. by its relative area.
+  double sah_cost = 0.0;
+  double overlap_sum = 0.0;
+  size_t num_internal = 0;
+  std::vector<const BVHNode *> stack = {&root};
+  while (!stack.empty()) {
+    const BVHNode &node = *stack.back();
+    stack.pop_back();
+    float area = node.bounds.SurfaceArea();
+    if (node.num_primitives > 0) {
+      sah_cost += area / root_area * options_.intersection_cost *
+                  node.num_primitives;
+      continue;
+    }
+    sah_cost += area / root_area * options_.traversal_cost;
+    // Rays that hit the overlap of the children need to visit both of them.
+    Bounds overlap =
+        Bounds::Overlap(node.children[0]->bounds, node.children[1]->bounds);
+    if (!overlap.IsEmpty() && area > 0.0f) {
+      overlap_sum += overlap.SurfaceArea() / area;
+    }
+    ++num_internal;
+    stack.push_back(node.children[0]);
+    stack.push_back(node.children[1]);
+  }
+  build_stats_.SetTreeQuality(
+      sah_cost, num_internal > 0 ? overlap_sum / num_internal : 0.0);
+}
+
+void BVH::PackTriangles(const BVHNode &root) {
+  leaf_triangles_.assign(leaf_primitives_.size(), LeafTriangles{0, 0});
+  triangle_packets_.clear();
+  size_t num_packed = 0;
+  std::vector<const BVHNode *> stack = {&root};
+  while (!stack.empty()) {
+    const BVHNode &node = *stack.back();
+    stack.pop_back();
+    if (node.num_primitives == 0) {
+      stack.push_back(node.children[0]);
+      stack.push_back(node.children[1]);
+      continue;
+    }
+
+    // Move the leaf's pre-transformed tris to the front of its range, and
+    // group the rest by type, so that they're intersected in homogeneous runs.
+    // Within each group, references are sorted by IsCloserHit()'s order, which
+    // the packets rely on to resolve ties. Leaves are small, so this uses an
+    // insertion sort, which unlike std::sort() doesn't allocate.
+    auto begin = leaf_primitives_.begin() + node.start;
+    auto end = begin + node.num_primitives;
+    for (auto it = begin + 1; it < end; ++it) {
+      PrimitiveRef ref = *it;
+      auto hole = it;
+      for (; hole != begin && LeafLess(ref, *(hole - 1)); --hole) {
+        *hole = *(hole - 1);
+      }
+      *hole = ref;
+    }
+    auto tris_end = std::find_if(begin, end, [](const PrimitiveRef &ref) {
+      return LeafOrder(ref) != 0;
+    });
+    LeafTriangles &leaf = leaf_triangles_[node.start];
+    leaf.first_packet = triangle_packets_.size();
+    leaf.num_triangles = tris_end - begin;
+    num_packed += leaf.num_triangles;
+
+    for (uint32_t i = 0; i < leaf.num_triangles; i += kTrianglePacketWidth) {
+      TrianglePacket packet = {};
+      packet.num_triangles =
+          std::min<uint32_t>(kTrianglePacketWidth, leaf.num_triangles - i);
+      for (int lane = 0; lane < packet.num_triangles; ++lane) {
+        const PrimitiveRef &ref = *(begin + i + lane);
+        const Mesh &mesh = *static_cast<Mesh *>(ref.primitive);
+        for (int vertex = 0; vertex < 3; ++vertex) {
+          for (int axis = 0; axis < 3; ++axis) {
+            packet.pos[vertex][axis][lane] =
+                mesh.world_position(ref.part, vertex)[axis];
+          }
+        }
+      }
+      triangle_packets_.push_back(packet);
+    }
+  }
+
+  if (triangle_packets_.empty()) {
+    leaf_triangles_.clear();
+  }
+  RecordLeafData(num_packed);
+}
+
+void BVH::RecordLeafData(size_t num_packed_triangles) {
+  build_stats_.SetTrianglePackets(triangle_packets_.size(),
+                                  num_packed_triangles);
+  build_stats_.SetLeafDataBytes(
+      leaf_primitives_.size() * sizeof(PrimitiveRef) +
+      leaf_triangles_.size() * sizeof(LeafTriangles) +
+      triangle_packets_.size() * sizeof(TrianglePacket));
+}
+
+void BVH::SaveLeafData(CacheWriter &writer) const {
+  // Each reference is stored as its index in GatherPrimitiveRefs(), i.e. the
+  // index of the primitive's first part, plus the part.
+  std::unordered_map<const Primitive *, uint32_t> first_indices;
+  first_indices.reserve(primitives_.size());
+  uint32_t num_refs = 0;
+  for (const auto &obj : primitives_) {
+    first_indices[obj.get()] = num_refs;
+    num_refs += obj->num_parts();
+  }
+  std::vector<uint32_t> leaf_indices;
+  leaf_indices.reserve(leaf_primitives_.size());
+  for (const PrimitiveRef &ref : leaf_primitives_) {
+    leaf_indices.push_back(first_indices.at(ref.primitive) + ref.part);
+  }
+  writer.Write(uint64_t(num_refs));
+  writer.WriteVector(leaf_indices);
+  writer.WriteVector(leaf_triangles_);
+  // The packet width depends on the instruction set muon is built for.
+  writer.Write(uint32_t(sizeof(TrianglePacket)));
+  writer.WriteVector(triangle_packets_);
+  writer.Write(build_stats_.sah_cost());
+  writer.Write(build_stats_.node_overlap());
+}
+
+bool BVH::LoadLeafData(CacheReader &reader) {
+  std::vector<PrimitiveRef> refs = GatherPrimitiveRefs();
+  uint64_t num_refs;
+  std::vector<uint32_t> leaf_indices;
+  std::vector<LeafTriangles> leaf_triangles;
+  uint32_t packet_size;
+  std::vector<TrianglePacket> triangle_packets;
+  double sah_cost, node_overlap;
+  if (!reader.Read(num_refs) || num_refs != refs.size() ||
+      !reader.ReadVector(leaf_indices) || !reader.ReadVector(leaf_triangles) ||
+      !reader.Read(packet_size) || packet_size != sizeof(TrianglePacket) ||
+      !reader.ReadVector(triangle_packets) || !reader.Read(sah_cost) ||
+      !reader.Read(node_overlap) ||
+      (!leaf_triangles.empty() &&
+       leaf_triangles.size() != leaf_indices.size())) {
+    return false;
+  }
+  size_t num_packed = 0;
+  for (const LeafTriangles &leaf : leaf_triangles) {
+    if (leaf.num_triangles > 0 &&
+        (leaf.first_packet >= triangle_packets.size() ||
+         (leaf.num_triangles - 1) / kTrianglePacketWidth >=
+             triangle_packets.size() - leaf.first_packet)) {
+      return false;
+    }
+    // Traversal trusts each packet's number of tris to stay within its leaf.
+    for (uint32_t i = 0; i < leaf.num_triangles; i += kTrianglePacketWidth) {
+      const TrianglePacket &packet =
+          triangle_packets[leaf.first_packet + i / kTrianglePacketWidth];
+      if (uint32_t(packet.num_triangles) !=
+          std::min<uint32_t>(kTrianglePacketWidth, leaf.num_triangles - i)) {
+        return false;
+      }
+    }
+    num_packed += leaf.num_triangles;
+  }
+  std::vector<PrimitiveRef> leaf_primitives;
+  leaf_primitives.reserve(leaf_indices.size());
+  for (uint32_t index : leaf_indices) {
+    if (index >= refs.size()) {
+      return false;
+    }
+    leaf_primitives.push_back(refs[index]);
+  }
+
+  leaf_primitives_ = std::move(leaf_primitives);
+  leaf_triangles_ = std::move(leaf_triangles);
+  triangle_packets_ = std::move(triangle_packets);
+  build_stats_.SetNumPrimitives(refs.size());
+  build_stats_.SetTreeQuality(sah_cost, node_overlap);
+  RecordLeafData(num_packed);
+  return true;
+}
+
+bool BVH::IsValidCachedLeaf(uint32_t start, uint32_t num_primitives) const {
+  if (uint64_t(start) + num_primitives > leaf_primitives_.size()) {
+    return false;
+  }
+  if (leaf_triangles_.empty()) {
+    return true;
+  }
+  // The leaf's packed tris must be its first primitives, which are then
+  // treated as pre-transformed tris.
+  const LeafTriangles &leaf = leaf_triangles_[start];
+  if (leaf.num_triangles > num_primitives) {
+    return false;
+  }
+  for (uint32_t i = 0; i < leaf.num_triangles; ++i) {
+    if (LeafOrder(leaf_primitives_[start + i]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Shared state used while building a BVH tree, possibly from multiple threads.
+// Concurrent builds only ever touch disjoint ranges of primitive_info.
+struct BVHBuildState {
+  BVHBuildState(const std::vector<PrimitiveRef> &refs,
+                std::vector<PrimitiveInfo> &primitive_info,
+                const BVHBuildOptions &options, Arena &arena)
+      : refs(refs),
+        primitive_info(primitive_info),
+        options(options),
+        arena(arena),
+        available_threads(std::max<int>(options.parallelism, 1) - 1) {}
+
+  // Reserves up to `n` additional threads, returning the number reserved.
+  int AcquireThreads(int n) {
+    int available = available_threads.load();
+    int acquired;
+    do {
+      acquired = std::min(n, available);
+      if (acquired <= 0) {
+        return 0;
+      }
+    } while (!available_threads.compare_exchange_weak(available,
+                                                      available - acquired));
+    return acquired;
+  }
+
+  // Returns `n` previously reserved threads.
+  void ReleaseThreads(int n) { available_threads += n; }
+
+  // The primitive references being built over, which PrimitiveInfo's
+  // original_index refers to.
+  const std::vector<PrimitiveRef> &refs;
+  std::vector<PrimitiveInfo> &primitive_info;
+  const BVHBuildOptions &options;
+  // The arena that the tree's nodes are allocated in.
+  Arena &arena;
+  // The number of threads, in addition to the calling thread, that may still
+  // be used.
+  std::atomic<int> available_threads;
+};
+
 void BVH::Init() {
+  std::vector<PrimitiveRef> refs = GatherPrimitiveRefs();
+  build_stats_.SetNumPrimitives(refs.size());
+  if (refs.empty()) {
+    return;
+  }
+  auto start_time = std::chrono::steady_clock::now();
+
+  // The tree's nodes are all freed at once when the arena goes out of scope.
+  Arena arena;
+  size_t num_nodes = 0;
+  BVHNode *root = BuildTree(refs, arena, num_nodes);
+  RecordTreeQuality(*root);
+  PackTriangles(*root);
+
+  // Flatten the tree into its linear representation. The tree itself is no
+  // longer needed afterwards.
+  nodes_.clear();
+  nodes_.reserve(num_nodes);
+  build_stats_.ClearLeaves();
+  Flatten(*root, 0);
+  built_cost_ = RefitNodes(/*update=*/false);
+
+  build_stats_.SetNumNodes(num_nodes);
+  build_stats_.SetTreeNodeBytes(num_nodes * sizeof(BVHNode));
+  build_stats_.SetLinearNodeBytes(nodes_.size() * sizeof(LinearBVHNode));
+  build_stats_.SetBuildAllocations(arena.num_allocations(),
+                                   arena.num_blocks());
+  build_stats_.SetBuildTime(std::chrono::steady_clock::now() - start_time);
+}
+
+void BVH::Refit() {
   if (primitives_.empty()) {
     return;
   }
+  auto start_time = std::chrono::steady_clock::now();
+  double cost = RefitNodes(/*update=*/true);
+  bool rebuild = !(cost <= options_.refit_rebuild_threshold * built_cost_);
+  if (rebuild) {
+    // Keep reporting the time of the original build; the rebuild counts
+    // towards the refit time.
+    auto build_time = build_stats_.build_time();
+    Init();
+    build_stats_.SetBuildTime(build_time);
+  } else {
+    RefitTrianglePackets();
+  }
+  build_stats_.AddRefit(std::chrono::steady_clock::now() - start_time,
+                        rebuild);
+}
+
+double BVH::RefitNodes(bool update) {
+  // Children always come after their parents, so a reverse pass visits them
+  // first.
+  std::vector<Bounds> bounds(nodes_.size());
+  double cost = 0.0;
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    const LinearBVHNode &node = nodes_[i];
+    if (node.num_primitives > 0) {
+      for (uint32_t j = node.primitives_offset;
+           j < node.primitives_offset + node.num_primitives; ++j) {
+        bounds[i] =
+            Bounds::Union(bounds[i], leaf_primitives_[j].WorldBounds());
+      }
+      cost += bounds[i].SurfaceArea() * options_.intersection_cost *
+              node.num_primitives;
+    } else {
+      bounds[i] =
+          Bounds::Union(bounds[i + 1], bounds[node.second_child_offset]);
+      cost += bounds[i].SurfaceArea() * options_.traversal_cost;
+    }
+  }
+  if (update) {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      nodes_[i].bounds = bounds[i];
+    }
+  }
+  float root_area = bounds.empty() ? 0.0f : bounds[0].SurfaceArea();
+  return root_area > 0.0f ? cost / root_area : 0.0;
+}
+
+void BVH::RefitTrianglePackets() {
+  // Only the leaf starts have any packed tris.
+  for (size_t start = 0; start < leaf_triangles_.size(); ++start) {
+    const LeafTriangles &leaf = leaf_triangles_[start];
+    for (uint32_t i = 0; i < leaf.num_triangles; ++i) {
+      const PrimitiveRef &ref = leaf_primitives_[start + i];
+      const Mesh &mesh = *static_cast<Mesh *>(ref.primitive);
+      TrianglePacket &packet =
+          triangle_packets_[leaf.first_packet + i / kTrianglePacketWidth];
+      int lane = i % kTrianglePacketWidth;
+      for (int vertex = 0; vertex < 3; ++vertex) {
+        for (int axis = 0; axis < 3; ++axis) {
+          packet.pos[vertex][axis][lane] =
+              mesh.world_position(ref.part, vertex)[axis];
+        }
+      }
+    }
+  }
+}
+
+bool BVH::SaveToCache(CacheWriter &writer) const {
+  writer.Write(uint32_t(sizeof(LinearBVHNode)));
+  writer.WriteVector(nodes_);
+  SaveLeafData(writer);
+  return true;
+}
+
+bool BVH::LoadFromCache(CacheReader &reader) {
+  auto start_time = std::chrono::steady_clock::now();
+  uint32_t node_size;
+  std::vector<LinearBVHNode> nodes;
+  if (!reader.Read(node_size) || node_size != sizeof(LinearBVHNode) ||
+      !reader.ReadVector(nodes) || !LoadLeafData(reader)) {
+    return false;
+  }
+  // Check that the nodes refer to each other and to the leaf data within
+  // bounds. Children always come after their parent, which also ensures that
+  // walking the tree terminates.
+  for (uint32_t index = 0; index < nodes.size(); ++index) {
+    const LinearBVHNode &node = nodes[index];
+    if (node.num_primitives > 0) {
+      if (!IsValidCachedLeaf(node.primitives_offset, node.num_primitives)) {
+        return false;
+      }
+    } else if (node.axis > 2 || index + 1 >= nodes.size() ||
+               node.second_child_offset <= index + 1 ||
+               node.second_child_offset >= nodes.size()) {
+      return false;
+    }
+  }
+  nodes_ = std::move(nodes);
+
+  // Recover the leaf stats by walking the flattened tree.
+  std::vector<std::pair<uint32_t, uint32_t>> stack;
+  if (!nodes_.empty()) {
+    stack.emplace_back(0, 0);
+  }
+  while (!stack.empty()) {
+    uint32_t index = stack.back().first;
+    uint32_t depth = stack.back().second;
+    stack.pop_back();
+    const LinearBVHNode &node = nodes_[index];
+    if (node.num_primitives > 0) {
+      build_stats_.AddLeaf(node.num_primitives, depth);
+    } else {
+      stack.emplace_back(node.second_child_offset, depth + 1);
+      stack.emplace_back(index + 1, depth + 1);
+    }
+  }
 
+  built_cost_ = RefitNodes(/*update=*/false);
+
+  build_stats_.SetNumNodes(nodes_.size());
+  build_stats_.SetLinearNodeBytes(nodes_.size() * sizeof(LinearBVHNode));
+  build_stats_.SetBuildTime(std::chrono::steady_clock::now() - start_time);
+  return true;
+}
+
+BVHNode *BVH::BuildTree(const std::vector<PrimitiveRef> &refs, Arena &arena,
+                        size_t &num_nodes) {
   // Collect object bounds and centroids.
   std::vector<PrimitiveInfo> primitive_info;
-  primitive_info.reserve(primitives_.size());
-  for (size_t i = 0; i < primitives_.size(); ++i) {
-    primitive_info.push_back(PrimitiveInfo(i, primitives_[i]->WorldBounds()));
+  primitive_info.reserve(refs.size());
+  for (size_t i = 0; i < refs.size(); ++i) {
+    primitive_info.push_back(PrimitiveInfo(i, refs[i].WorldBounds()));
   }
 
-  // Recursively build the BVH tree.
-  root_ = Build(0, primitives_.size(), primitive_info);
+  // Recursively build the BVH tree, using up to the configured number of
+  // threads.
+  BVHBuildState state(refs, primitive_info, options_, arena);
+  BVHNode *root;
+  if (partition_strategy_ == PartitionStrategy::kSBVH) {
+    float root_surface = 0.0f;
+    {
+      Bounds bounds;
+      for (const PrimitiveInfo &info : primitive_info) {
+        bounds = Bounds::Union(bounds, info.bounds);
+      }
+      root_surface = bounds.SurfaceArea();
+    }
+    size_t budget = static_cast<size_t>(
+        std::max(options_.sbvh_duplication_budget, 0.0f) *
+        primitive_info.size());
+    // The references start out as the primitives themselves.
+    std::vector<PrimitiveInfo> references;
+    references.swap(primitive_info);
+    std::vector<PrimitiveInfo> leaf_references;
+    root = BuildSpatial(references, budget, root_surface, state,
+                        leaf_references, num_nodes);
+    primitive_info.swap(leaf_references);
+  } else if (partition_strategy_ == PartitionStrategy::kMorton ||
+             partition_strategy_ == PartitionStrategy::kHLBVH) {
+    root = BuildLBVH(state, num_nodes);
+  } else {
+    root = Build(0, refs.size(), state, num_nodes);
+  }
 
-  // Now we must re-order the primitives vector to match the resulting tree's
-  // build order, which we can infer from the re-ordered primitive_info vector.
-  // We need to do this in order to allow BVHNodes to refer to contiguous
-  // blocks of primitives.
-  std::vector<std::unique_ptr<Primitive>> sorted_primitives;
-  sorted_primitives.reserve(primitives_.size());
+  // The primitive_info vector is now ordered to match the resulting tree's
+  // build order, with BVHNodes referring to contiguous blocks of it. Record
+  // the primitive referenced by each entry.
+  leaf_primitives_.clear();
+  leaf_primitives_.reserve(primitive_info.size());
   for (const auto &info : primitive_info) {
-    sorted_primitives.push_back(std::move(primitives_[info.original_index]));
+    leaf_primitives_.push_back(refs[info.original_index]);
+  }
+  return root;
+}
+
+uint32_t BVH::Flatten(const BVHNode &node, uint32_t depth) {
+  uint32_t index = nodes_.size();
+  nodes_.emplace_back();
+  LinearBVHNode &linear_node = nodes_.back();
+  linear_node.bounds = node.bounds;
+  linear_node.padding = 0;
+  if (node.num_primitives > 0) {
+    assert(node.num_primitives <= kMaxLeafPrimitives);
+    linear_node.primitives_offset = node.start;
+    linear_node.num_primitives = node.num_primitives;
+    linear_node.axis = 0;
+    build_stats_.AddLeaf(node.num_primitives, depth);
+    return index;
   }
-  primitives_.swap(sorted_primitives);
+  linear_node.num_primitives = 0;
+  linear_node.axis = node.axis;
+  // Note that we can't hold on to the linear_node reference here, since the
+  // recursion may cause the nodes vector to reallocate (if it hasn't been
+  // reserved up front).
+  Flatten(*node.children[0], depth + 1);
+  uint32_t second_child_offset = Flatten(*node.children[1], depth + 1);
+  nodes_[index].second_child_offset = second_child_offset;
+  return index;
 }
 
 // Working info on bucket boundaries while splitting via the surface area
@@ -237,11 +1164,197 @@ struct SAHBucketInfo {
   Bounds bounds;
 };
 constexpr size_t kNumSAHBuckets = 12;
+using SAHBuckets = std::array<SAHBucketInfo, kNumSAHBuckets>;
+
+// Nodes with at least this many primitives build their two subtrees in
+// parallel, if there are threads available. Smaller subtrees are cheap enough
+// that the cost of spawning a thread outweighs the benefit.
+constexpr size_t kParallelBuildThreshold = 4096;
+// Nodes with at least this many primitives fill their SAH buckets in
+// parallel, if there are threads available. This mostly helps near the root
+// of the tree, where there isn't yet much subtree parallelism to exploit.
+constexpr size_t kParallelBinningThreshold = 65536;
+
+namespace {
+
+// Returns the SAH bucket that a centroid falls into along the given axis.
+size_t SAHBucketIndex(const glm::vec3 &centroid, int axis,
+                      const Bounds &centroid_bounds,
+                      const glm::vec3 &centroid_space) {
+  // Compute the relative offset of the given primitive's centroid within the
+  // space that we're considering splitting. This should always be a number
+  // between 0.0 and 1.0.
+  // We also need to be careful to avoid division by zero in case primitives
+  // are very close together (e.g. have identical centroids).
+  float offset =
+      centroid_space[axis] == 0.0f
+          ? 0.0f
+          : (centroid[axis] - centroid_bounds.min_pos[axis]) /
+                centroid_space[axis];
+  size_t bucket_index = static_cast<size_t>(offset * kNumSAHBuckets);
+  // Handle edge case for primitive that is at the edge of the centroid_space,
+  // in which case we should consider it part of the final bucket.
+  if (bucket_index == kNumSAHBuckets) {
+    bucket_index = kNumSAHBuckets - 1;
+  }
+  assert(bucket_index < kNumSAHBuckets);
+  return bucket_index;
+}
 
-std::unique_ptr<BVHNode> BVH::Build(
-    size_t start, size_t end,
-    std::vector<PrimitiveInfo> &primitive_info) const {
+// Fills SAH buckets with the primitives in the given range, for each axis that
+// is enabled in `axes`.
+void FillSAHBuckets(const std::vector<PrimitiveInfo> &primitive_info,
+                    size_t start, size_t end, const Bounds &centroid_bounds,
+                    const bool axes[3], std::array<SAHBuckets, 3> &buckets) {
+  glm::vec3 centroid_space = centroid_bounds.Dimensions();
+  for (size_t i = start; i < end; ++i) {
+    const PrimitiveInfo &info = primitive_info[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      if (!axes[axis]) {
+        continue;
+      }
+      SAHBucketInfo &bucket = buckets[axis][SAHBucketIndex(
+          info.centroid, axis, centroid_bounds, centroid_space)];
+      bucket.size++;
+      bucket.bounds = Bounds::Union(bucket.bounds, info.bounds);
+    }
+  }
+}
+
+// Like FillSAHBuckets, but splits the range across any available threads,
+// each of which fills its own set of buckets. The per-thread buckets are then
+// merged, which gives the same result as filling them serially since bucket
+// sizes and bounds unions are order-independent.
+void ParallelFillSAHBuckets(BVHBuildState &state, size_t start, size_t end,
+                            const Bounds &centroid_bounds, const bool axes[3],
+                            std::array<SAHBuckets, 3> &buckets) {
+  int extra_threads = 0;
+  if (end - start >= kParallelBinningThreshold) {
+    extra_threads = state.AcquireThreads(
+        static_cast<int>((end - start) / kParallelBinningThreshold));
+  }
+  if (extra_threads == 0) {
+    FillSAHBuckets(state.primitive_info, start, end, centroid_bounds, axes,
+                   buckets);
+    return;
+  }
+
+  std::vector<std::array<SAHBuckets, 3>> chunk_buckets(extra_threads + 1);
+  ParallelForChunks(end - start, extra_threads + 1,
+                    [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                      FillSAHBuckets(state.primitive_info, start + chunk_start,
+                                     start + chunk_end, centroid_bounds, axes,
+                                     chunk_buckets[chunk]);
+                    });
+  state.ReleaseThreads(extra_threads);
+
+  for (const auto &chunk : chunk_buckets) {
+    for (int axis = 0; axis < 3; ++axis) {
+      for (size_t i = 0; i < kNumSAHBuckets; ++i) {
+        buckets[axis][i].size += chunk[axis][i].size;
+        buckets[axis][i].bounds =
+            Bounds::Union(buckets[axis][i].bounds, chunk[axis][i].bounds);
+      }
+    }
+  }
+}
+
+// Builds the two subtrees of a node with `num_primitives` primitives, via
+// functions that take the node counter to increment. For large nodes, the left
+// subtree is handed off to another thread if one is available, and the right
+// one is built on this thread. The subtrees must cover disjoint ranges of
+// primitive_info, so that they can be built independently.
+template <typename LeftFn, typename RightFn>
+void BuildSubtrees(BVHBuildState &state, size_t num_primitives,
+                   size_t &num_nodes, LeftFn build_left, RightFn build_right,
+                   BVHNode *&left, BVHNode *&right) {
+  if (num_primitives >= kParallelBuildThreshold && state.AcquireThreads(1)) {
+    size_t left_num_nodes = 0;
+    std::thread left_thread([&] {
+      left = build_left(left_num_nodes);
+      state.ReleaseThreads(1);
+    });
+    right = build_right(num_nodes);
+    left_thread.join();
+    num_nodes += left_num_nodes;
+  } else {
+    left = build_left(num_nodes);
+    right = build_right(num_nodes);
+  }
+}
+
+// Finds the lowest cost split between the given buckets, outputting the index
+// of the last bucket in the left branch. Returns the cost of the split.
+float FindSAHSplit(const SAHBuckets &buckets, float total_surface,
+                   const BVHBuildOptions &options, size_t &split_bucket) {
+  // Compute the heuristic costs for splitting in between each of the buckets.
+  // We don't consider splitting after the last bucket, which wouldn't actually
+  // split anything.
+  // We compute the cost based on the cost of intersecting with each branch of
+  // a split (i.e. the number of primitives times the primitive intersection
+  // cost), times the probability of hitting that branch, which is equivalent
+  // to the ratio of the surface area of the branch's bounds divided by the
+  // surface area of the parent bounds.
+  constexpr int kNumSAHSplitPoints = kNumSAHBuckets - 1;
+  float split_costs[kNumSAHSplitPoints];
+
+  // We compute the costs in three passes - first, we compute the partial costs
+  // for the left and right branches, and then the final cost while
+  // simultaneously determining the min cost.
+  {
+    size_t combined_size = 0;
+    Bounds combined_bounds;
+    for (size_t i = 0; i < kNumSAHSplitPoints; ++i) {
+      combined_size += buckets[i].size;
+      if (combined_size == 0) {
+        continue;
+      }
+      combined_bounds = Bounds::Union(combined_bounds, buckets[i].bounds);
+      split_costs[i] = combined_size * combined_bounds.SurfaceArea();
+    }
+  }
+  {
+    size_t combined_size = 0;
+    Bounds combined_bounds;
+    // Need to use a signed integer index since it goes below zero.
+    for (int i = kNumSAHSplitPoints - 1; i >= 0; --i) {
+      // Use i+1 for the bucket index since we are considering the right
+      // branch.
+      combined_size += buckets[i + 1].size;
+      if (combined_size == 0) {
+        continue;
+      }
+      combined_bounds = Bounds::Union(combined_bounds, buckets[i + 1].bounds);
+      // TODO: This can sometimes result in a NaN if combined_size is 0 and the
+      // surface area is inf.
+      split_costs[i] += combined_size * combined_bounds.SurfaceArea();
+    }
+  }
+
+  // Now we compute the final costs and keep track of the minimum cost we have
+  // seen.
+  float min_cost = std::numeric_limits<float>::infinity();
+  for (size_t i = 0; i < kNumSAHSplitPoints; ++i) {
+    // The final cost is partial cost normalized by the total surface of the
+    // combined bounds, plus the cost of traversing the node (i.e. testing its
+    // children's bounding boxes) during rendering.
+    float cost = options.traversal_cost +
+                 options.intersection_cost * (split_costs[i] / total_surface);
+    if (cost < min_cost) {
+      min_cost = cost;
+      split_bucket = i;
+    }
+  }
+  return min_cost;
+}
+
+}  // namespace
+
+BVHNode *BVH::Build(size_t start, size_t end, BVHBuildState &state,
+                    size_t &num_nodes) const {
   assert(start >= 0 && end >= 0);
+  std::vector<PrimitiveInfo> &primitive_info = state.primitive_info;
+  ++num_nodes;
   size_t num_primitives = end - start;
   // Check for base case.
   if (num_primitives == 1) {
@@ -250,8 +1363,8 @@ std::unique_ptr<BVHNode> BVH::Build(
     // on the final sort order of primitive_info. This allows us to place
     // primitives in any given BVHNode contiguously in the final primitives
     // vector, which allows us to reference them via a simple index range.
-    return absl::make_unique<BVHNode>(num_primitives, start,
-                                      primitive_info[start].bounds);
+    return state.arena.Create<BVHNode>(num_primitives, start,
+                                       primitive_info[start].bounds);
   }
 
   // First we figure out the bounds of the centroids in order to choose the
@@ -261,9 +1374,6 @@ std::unique_ptr<BVHNode> BVH::Build(
     centroid_bounds =
         Bounds::Union(centroid_bounds, primitive_info[i].centroid);
   }
-  // IDEA: Instead of using the widest axis, we could try to consider all axes
-  // (e.g. via the surface area heuristic) and pick the one that minimizes
-  // cost.
   int axis = centroid_bounds.MaxAxis();
 
   // Now partition the primitives based on the configured partition strategy.
@@ -300,117 +1410,58 @@ std::unique_ptr<BVHNode> BVH::Build(
     case PartitionStrategy::kSAH: {
       // Split the primitives by considering several candidate split points and
       // using a surface area heuristic. We do this greedily at each node split
-      // point.
-      SAHBucketInfo buckets[kNumSAHBuckets];
+      // point. By default we only consider the axis with the widest centroid
+      // spread, but can optionally consider all axes and pick the cheapest.
       glm::vec3 centroid_space = centroid_bounds.Dimensions();
-
-      // Fill the buckets with the working primitives.
-      for (size_t i = start; i < end; ++i) {
-        // Compute the relative offset of the given primitive's centroid within
-        // the space that we're considering splitting. This should always be a
-        // number between 0.0 and 1.0.
-        // We also need to be careful to avoid division by zero in case
-        // primitives are very close together (e.g. have identical centroids).
-        float offset = centroid_space[axis] == 0.0f
-                           ? 0.0f
-                           : (primitive_info[i].centroid[axis] -
-                              centroid_bounds.min_pos[axis]) /
-                                 centroid_space[axis];
-        int bucket_index = static_cast<size_t>(offset * kNumSAHBuckets);
-        // Handle edge case for primitive that is at the edge of the
-        // centroid_space, in which case we should consider it part of the
-        // final bucket.
-        if (bucket_index == kNumSAHBuckets) {
-          bucket_index = kNumSAHBuckets - 1;
+      bool axes[3] = {false, false, false};
+      if (options_.sah_all_axes) {
+        for (int i = 0; i < 3; ++i) {
+          axes[i] = centroid_space[i] > 0.0f;
         }
-        assert(bucket_index >= 0);
-        assert(bucket_index < kNumSAHBuckets);
-
-        SAHBucketInfo &bucket = buckets[bucket_index];
-        bucket.size++;
-        bucket.bounds = Bounds::Union(bucket.bounds, primitive_info[i].bounds);
       }
+      axes[axis] = true;
+
+      // Fill the buckets with the working primitives.
+      std::array<SAHBuckets, 3> buckets;
+      ParallelFillSAHBuckets(state, start, end, centroid_bounds, axes,
+                             buckets);
 
       // Also compute the full bucket bounds (i.e. the bounds of all
-      // primitives), as we'll need it later.
+      // primitives), as we'll need it later. This is the same for any axis.
       Bounds primitive_bounds;
       for (size_t i = 0; i < kNumSAHBuckets; ++i) {
-        primitive_bounds = Bounds::Union(primitive_bounds, buckets[i].bounds);
-      }
-
-      // Compute the heuristic costs for splitting in between each of the
-      // buckets. We don't consider splitting after the last bucket, which
-      // wouldn't actually split anything.
-      // We arbitrarily define primitive-ray intersections as having a cost of
-      // 1, allowing us to simply use the number of primitives in our
-      // calculations directly. Then we compute the cost based on the cost of
-      // intersecting with each branch of a split (i.e. the number of
-      // primitives), times the probability of hitting that branch, which is
-      // equivalent to the ratio of the surface area of the branch's bounds
-      // divided by the surface area of the parent bounds.
-      constexpr int kNumSAHSplitPoints = kNumSAHBuckets - 1;
-      float split_costs[kNumSAHSplitPoints];
-
-      // We compute the costs in three passes - first, we compute the partial
-      // costs for the left and right branches, and then the final cost while
-      // simultaneously determining the min cost.
-      {
-        size_t combined_size = 0;
-        Bounds combined_bounds;
-        for (size_t i = 0; i < kNumSAHSplitPoints; ++i) {
-          combined_size += buckets[i].size;
-          if (combined_size == 0) {
-            continue;
-          }
-          combined_bounds = Bounds::Union(combined_bounds, buckets[i].bounds);
-          split_costs[i] = combined_size * combined_bounds.SurfaceArea();
-        }
-      }
-      {
-        size_t combined_size = 0;
-        Bounds combined_bounds;
-        // Need to use a signed integer index since it goes below zero.
-        for (int i = kNumSAHSplitPoints - 1; i >= 0; --i) {
-          // Use i+1 for the bucket index since we are considering the right
-          // branch.
-          combined_size += buckets[i + 1].size;
-          if (combined_size == 0) {
-            continue;
-          }
-          combined_bounds =
-              Bounds::Union(combined_bounds, buckets[i + 1].bounds);
-          // TODO: This can sometimes result in a NaN if combined_size is 0 and
-          // the surface area is inf.
-          split_costs[i] += combined_size * combined_bounds.SurfaceArea();
-        }
+        primitive_bounds =
+            Bounds::Union(primitive_bounds, buckets[axis][i].bounds);
       }
-
       float total_surface = primitive_bounds.SurfaceArea();
-      // Now we compute the final costs and keep track of the minimum cost we
-      // have seen.
-      float min_cost = std::numeric_limits<float>::infinity();
+
       size_t split_bucket;
-      for (size_t i = 0; i < kNumSAHSplitPoints; ++i) {
-        // The final cost is partial cost normalized by the total surface of
-        // the combined bounds, plus a small factor to represent the bounding
-        // box intersection cost during rendering.
-        constexpr float kBoundingBoxCost = 0.125f;
-        float cost = kBoundingBoxCost + split_costs[i] / total_surface;
+      float min_cost =
+          FindSAHSplit(buckets[axis], total_surface, options_, split_bucket);
+      for (int i = 0; i < 3; ++i) {
+        if (i == axis || !axes[i]) {
+          continue;
+        }
+        size_t axis_split_bucket;
+        float cost = FindSAHSplit(buckets[i], total_surface, options_,
+                                  axis_split_bucket);
         if (cost < min_cost) {
           min_cost = cost;
-          split_bucket = i;
+          split_bucket = axis_split_bucket;
+          axis = i;
         }
       }
 
       // Based on the min cost, we now decide whether to split or to create a
-      // leaf node. Since we've defined the cost of intersection with any
-      // primitive as 1, the leaf cost is just the number of primitives.
-      float leaf_cost = num_primitives;
-      if (leaf_cost < min_cost) {
+      // leaf node, which costs intersecting with each of its primitives. Nodes
+      // with more than the max leaf size are always split.
+      float leaf_cost = options_.intersection_cost * num_primitives;
+      if (leaf_cost < min_cost &&
+          num_primitives <= options_.max_leaf_primitives) {
         // See earlier instance of leaf node creation for why we can pass
         // `start` directly here.
-        return absl::make_unique<BVHNode>(num_primitives, start,
-                                          primitive_bounds);
+        return state.arena.Create<BVHNode>(num_primitives, start,
+                                           primitive_bounds);
       }
 
       auto split_iter = std::partition(
@@ -419,16 +1470,8 @@ std::unique_ptr<BVHNode> BVH::Build(
            &centroid_bounds](const PrimitiveInfo &info) {
             // See earlier bucket computation for details on this partitioning
             // scheme.
-            float offset =
-                centroid_space[axis] == 0.0f
-                    ? 0.0f
-                    : (info.centroid[axis] - centroid_bounds.min_pos[axis]) /
-                          centroid_space[axis];
-            size_t bucket_index = static_cast<size_t>(offset * kNumSAHBuckets);
-            if (bucket_index == kNumSAHBuckets) {
-              bucket_index = kNumSAHBuckets - 1;
-            }
-            return bucket_index <= split_bucket;
+            return SAHBucketIndex(info.centroid, axis, centroid_bounds,
+                                  centroid_space) <= split_bucket;
           });
       split = std::distance(primitive_info.begin(), split_iter);
 
@@ -440,6 +1483,15 @@ std::unique_ptr<BVHNode> BVH::Build(
       }
       break;
     }
+    case PartitionStrategy::kMorton:
+    case PartitionStrategy::kHLBVH:
+    case PartitionStrategy::kSBVH: {
+      // These strategies are built by BuildLBVH() and BuildSpatial() instead,
+      // and never reach here.
+      assert(false);
+      split_uniformly = true;
+      break;
+    }
   }
 
   // Use uniform split as a fallback.
@@ -453,9 +1505,565 @@ std::unique_ptr<BVHNode> BVH::Build(
                      });
   }
 
-  return absl::make_unique<BVHNode>(Build(start, split, primitive_info),
-                                    Build(split, end, primitive_info), axis);
-}  // namespace acceleration
+  BVHNode *left;
+  BVHNode *right;
+  BuildSubtrees(
+      state, num_primitives, num_nodes,
+      [&](size_t &n) { return Build(start, split, state, n); },
+      [&](size_t &n) { return Build(split, end, state, n); }, left, right);
+  return state.arena.Create<BVHNode>(left, right, axis);
+}
+
+namespace {
+
+// Nodes with at most this many primitives become leaves in the Morton-based
+// builders.
+constexpr size_t kMortonLeafPrimitives = 4;
+// HLBVH groups primitives into treelets by this many of the most significant
+// Morton code bits, i.e. by a 16x16x16 grid over the centroid bounds.
+constexpr int kHLBVHTreeletBits = 12;
+// Sorts of at least this many Morton codes are split across threads, if there
+// are threads available.
+constexpr size_t kParallelSortThreshold = 65536;
+
+// Recursively emits a linear BVH over the Morton-sorted primitives in the
+// given range. Each node splits its primitives at the most significant code
+// bit (at or below `bit`) that differs within the range, which, since the
+// primitives are sorted, is found with a binary search. Building is O(n)
+// overall.
+BVHNode *EmitLBVH(BVHBuildState &state,
+                  const std::vector<MortonPrimitive> &morton, size_t start,
+                  size_t end, int bit, size_t &num_nodes) {
+  ++num_nodes;
+  size_t num_primitives = end - start;
+  // Skip bits that are the same for all primitives in the range; since the
+  // range is sorted, we only need to compare the first and last codes.
+  const uint64_t differing_bits = morton[start].code ^ morton[end - 1].code;
+  while (bit >= 0 && (differing_bits & (1ull << bit)) == 0) {
+    --bit;
+  }
+
+  // Create a leaf if there are only a few primitives left, or if they all
+  // share the same code (as long as they fit within a leaf).
+  const size_t max_leaf_primitives = state.options.max_leaf_primitives;
+  if (num_primitives <= std::min(kMortonLeafPrimitives, max_leaf_primitives) ||
+      (bit < 0 && num_primitives <= max_leaf_primitives)) {
+    Bounds bounds;
+    for (size_t i = start; i < end; ++i) {
+      bounds = Bounds::Union(bounds, state.primitive_info[i].bounds);
+    }
+    return state.arena.Create<BVHNode>(num_primitives, start, bounds);
+  }
+
+  size_t split;
+  int axis;
+  if (bit < 0) {
+    // Too many primitives share the same code to fit in one leaf, so split
+    // them evenly. They're essentially in the same place anyways.
+    split = (start + end) / 2;
+    axis = 0;
+  } else {
+    const uint64_t mask = 1ull << bit;
+    auto split_iter = std::partition_point(
+        std::next(morton.begin(), start), std::next(morton.begin(), end),
+        [mask](const MortonPrimitive &p) { return (p.code & mask) == 0; });
+    split = std::distance(morton.begin(), split_iter);
+    // See EncodeMorton3() for how bits map to axes.
+    axis = 2 - bit % 3;
+  }
+
+  BVHNode *left;
+  BVHNode *right;
+  BuildSubtrees(
+      state, num_primitives, num_nodes,
+      [&](size_t &n) {
+        return EmitLBVH(state, morton, start, split, bit - 1, n);
+      },
+      [&](size_t &n) {
+        return EmitLBVH(state, morton, split, end, bit - 1, n);
+      },
+      left, right);
+  return state.arena.Create<BVHNode>(left, right, axis);
+}
+
+// A subtree of an HLBVH, covering all primitives that share the same upper
+// Morton code bits.
+struct HLBVHTreelet {
+  BVHNode *root;
+  size_t num_primitives;
+  glm::vec3 centroid;
+};
+
+// Recursively builds the upper levels of an HLBVH over the given range of
+// treelets, using the surface area heuristic. There are relatively few
+// treelets, so this is cheap compared to building the whole tree via SAH.
+BVHNode *BuildUpperSAH(std::vector<HLBVHTreelet> &treelets, size_t start,
+                       size_t end, const BVHBuildOptions &options,
+                       Arena &arena, size_t &num_nodes) {
+  if (end - start == 1) {
+    return treelets[start].root;
+  }
+  ++num_nodes;
+
+  Bounds centroid_bounds;
+  for (size_t i = start; i < end; ++i) {
+    centroid_bounds = Bounds::Union(centroid_bounds, treelets[i].centroid);
+  }
+  int axis = centroid_bounds.MaxAxis();
+  glm::vec3 centroid_space = centroid_bounds.Dimensions();
+
+  // Bucket the treelets in the same way as primitives are bucketed in
+  // BVH::Build(), weighing each treelet by its number of primitives.
+  SAHBuckets buckets;
+  Bounds bounds;
+  for (size_t i = start; i < end; ++i) {
+    SAHBucketInfo &bucket = buckets[SAHBucketIndex(
+        treelets[i].centroid, axis, centroid_bounds, centroid_space)];
+    bucket.size += treelets[i].num_primitives;
+    bucket.bounds = Bounds::Union(bucket.bounds, treelets[i].root->bounds);
+    bounds = Bounds::Union(bounds, treelets[i].root->bounds);
+  }
+  size_t split_bucket;
+  FindSAHSplit(buckets, bounds.SurfaceArea(), options, split_bucket);
+
+  auto start_iter = std::next(treelets.begin(), start);
+  auto end_iter = std::next(treelets.begin(), end);
+  auto split_iter = std::partition(
+      start_iter, end_iter, [&](const HLBVHTreelet &treelet) {
+        return SAHBucketIndex(treelet.centroid, axis, centroid_bounds,
+                              centroid_space) <= split_bucket;
+      });
+  size_t split = std::distance(treelets.begin(), split_iter);
+  // Fall back to a uniform split if the partition failed.
+  if (split == start || split == end) {
+    split = (start + end) / 2;
+    std::nth_element(start_iter, std::next(treelets.begin(), split), end_iter,
+                     [axis](const HLBVHTreelet &a, const HLBVHTreelet &b) {
+                       return a.centroid[axis] < b.centroid[axis];
+                     });
+  }
+
+  BVHNode *left =
+      BuildUpperSAH(treelets, start, split, options, arena, num_nodes);
+  BVHNode *right =
+      BuildUpperSAH(treelets, split, end, options, arena, num_nodes);
+  return arena.Create<BVHNode>(left, right, axis);
+}
+
+}  // namespace
+
+BVHNode *BVH::BuildLBVH(BVHBuildState &state, size_t &num_nodes) const {
+  std::vector<PrimitiveInfo> &primitive_info = state.primitive_info;
+  const size_t num_primitives = primitive_info.size();
+
+  // Compute the Morton code of each primitive's centroid, relative to the
+  // bounds of all centroids.
+  Bounds centroid_bounds;
+  for (const PrimitiveInfo &info : primitive_info) {
+    centroid_bounds = Bounds::Union(centroid_bounds, info.centroid);
+  }
+  glm::vec3 centroid_space = centroid_bounds.Dimensions();
+  std::vector<MortonPrimitive> morton(num_primitives);
+  for (size_t i = 0; i < num_primitives; ++i) {
+    glm::vec3 offset = primitive_info[i].centroid - centroid_bounds.min_pos;
+    for (int axis = 0; axis < 3; ++axis) {
+      offset[axis] = centroid_space[axis] == 0.0f
+                         ? 0.0f
+                         : offset[axis] / centroid_space[axis];
+    }
+    morton[i] = {EncodeMorton3(offset), static_cast<uint32_t>(i)};
+  }
+
+  // Sort the primitives along the Morton curve, which places primitives that
+  // are close together in space next to each other.
+  int extra_threads = state.AcquireThreads(
+      static_cast<int>(num_primitives / kParallelSortThreshold));
+  RadixSort(morton, extra_threads + 1);
+  state.ReleaseThreads(extra_threads);
+  std::vector<PrimitiveInfo> sorted_info;
+  sorted_info.reserve(num_primitives);
+  for (const MortonPrimitive &p : morton) {
+    sorted_info.push_back(primitive_info[p.index]);
+  }
+  primitive_info.swap(sorted_info);
+
+  if (partition_strategy_ == PartitionStrategy::kMorton) {
+    return EmitLBVH(state, morton, 0, num_primitives, kMortonBits - 1,
+                    num_nodes);
+  }
+
+  // For HLBVH, we first build treelets out of primitives that share the same
+  // upper Morton code bits, and then join them via SAH. This gives the upper
+  // levels of the tree, which most rays pass through, SAH quality while
+  // keeping most of the speed of the linear build.
+  constexpr int kTreeletShift = kMortonBits - kHLBVHTreeletBits;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (size_t start = 0, end = 1; end <= num_primitives; ++end) {
+    if (end == num_primitives ||
+        morton[start].code >> kTreeletShift !=
+            morton[end].code >> kTreeletShift) {
+      ranges.emplace_back(start, end);
+      start = end;
+    }
+  }
+
+  std::vector<HLBVHTreelet> treelets(ranges.size());
+  extra_threads = state.AcquireThreads(
+      static_cast<int>(num_primitives / kParallelBuildThreshold));
+  std::vector<size_t> chunk_num_nodes(extra_threads + 1, 0);
+  ParallelForChunks(
+      ranges.size(), extra_threads + 1,
+      [&](int chunk, size_t chunk_start, size_t chunk_end) {
+        for (size_t i = chunk_start; i < chunk_end; ++i) {
+          HLBVHTreelet &treelet = treelets[i];
+          treelet.root =
+              EmitLBVH(state, morton, ranges[i].first, ranges[i].second,
+                       kTreeletShift - 1, chunk_num_nodes[chunk]);
+          treelet.num_primitives = ranges[i].second - ranges[i].first;
+          treelet.centroid = treelet.root->bounds.min_pos +
+                             0.5f * treelet.root->bounds.Dimensions();
+        }
+      });
+  state.ReleaseThreads(extra_threads);
+  for (size_t n : chunk_num_nodes) {
+    num_nodes += n;
+  }
+
+  return BuildUpperSAH(treelets, 0, treelets.size(), options_, state.arena,
+                       num_nodes);
+}
+
+namespace {
+
+// The number of bins along each axis when searching for spatial splits.
+constexpr size_t kNumSpatialBins = 32;
+// Spatial splits are only considered when the children of the best object
+// split overlap by at least this fraction of the root's surface area (alpha in
+// Stich et al.'s SBVH paper). This avoids spending time on spatial splits deep
+// in the tree, where they rarely pay off.
+constexpr float kSpatialSplitAlpha = 1e-5f;
+
+// Working info on a bin while searching for spatial splits.
+struct SpatialBin {
+  // The bounds of the parts of references that are clipped to the bin.
+  Bounds bounds;
+  // The number of references that start in this bin.
+  size_t entries = 0;
+  // The number of references that end in this bin.
+  size_t exits = 0;
+};
+
+// The best spatial split found for a node.
+struct SpatialSplit {
+  float cost = std::numeric_limits<float>::infinity();
+  int axis = 0;
+  // The split plane lies between bins plane_bin-1 and plane_bin.
+  size_t plane_bin = 0;
+  Bounds left_bounds;
+  Bounds right_bounds;
+  size_t left_count = 0;
+  size_t right_count = 0;
+};
+
+// Maps positions along an axis of a node's bounds to spatial bins.
+class SpatialBinner {
+ public:
+  SpatialBinner(const Bounds &bounds, int axis)
+      : min_(bounds.min_pos[axis]),
+        width_((bounds.max_pos[axis] - bounds.min_pos[axis]) /
+               kNumSpatialBins) {}
+
+  size_t Bin(float x) const {
+    float bin = (x - min_) / width_;
+    if (!(bin > 0.0f)) {
+      return 0;
+    }
+    return std::min(static_cast<size_t>(bin), kNumSpatialBins - 1);
+  }
+
+  // Returns the position of the plane at the start of the given bin.
+  float Plane(size_t bin) const { return min_ + bin * width_; }
+
+ private:
+  float min_;
+  float width_;
+};
+
+// Offsets the primitive ranges of all leaves in the given subtree.
+void OffsetLeaves(BVHNode &node, size_t offset) {
+  if (node.num_primitives > 0) {
+    node.start += offset;
+    return;
+  }
+  OffsetLeaves(*node.children[0], offset);
+  OffsetLeaves(*node.children[1], offset);
+}
+
+}  // namespace
+
+BVHNode *BVH::BuildSpatial(
+    std::vector<PrimitiveInfo> &references, size_t budget, float root_surface,
+    BVHBuildState &state, std::vector<PrimitiveInfo> &leaf_references,
+    size_t &num_nodes) const {
+  ++num_nodes;
+  const size_t num_references = references.size();
+  Bounds bounds;
+  Bounds centroid_bounds;
+  for (const PrimitiveInfo &reference : references) {
+    bounds = Bounds::Union(bounds, reference.bounds);
+    centroid_bounds = Bounds::Union(centroid_bounds, reference.centroid);
+  }
+  auto make_leaf = [&] {
+    size_t start = leaf_references.size();
+    leaf_references.insert(leaf_references.end(), references.begin(),
+                           references.end());
+    return state.arena.Create<BVHNode>(num_references, start, bounds);
+  };
+  if (num_references == 1) {
+    return make_leaf();
+  }
+  const float total_surface = bounds.SurfaceArea();
+
+  // First, find the best object split, in the same way as Build().
+  int object_axis = centroid_bounds.MaxAxis();
+  glm::vec3 centroid_space = centroid_bounds.Dimensions();
+  bool axes[3] = {false, false, false};
+  if (options_.sah_all_axes) {
+    for (int i = 0; i < 3; ++i) {
+      axes[i] = centroid_space[i] > 0.0f;
+    }
+  }
+  axes[object_axis] = true;
+  std::array<SAHBuckets, 3> buckets;
+  FillSAHBuckets(references, 0, num_references, centroid_bounds, axes,
+                 buckets);
+  size_t object_bucket;
+  float object_cost = FindSAHSplit(buckets[object_axis], total_surface,
+                                   options_, object_bucket);
+  for (int i = 0; i < 3; ++i) {
+    if (i == object_axis || !axes[i]) {
+      continue;
+    }
+    size_t axis_bucket;
+    float cost = FindSAHSplit(buckets[i], total_surface, options_, axis_bucket);
+    if (cost < object_cost) {
+      object_cost = cost;
+      object_bucket = axis_bucket;
+      object_axis = i;
+    }
+  }
+
+  // Next, consider spatial splits if the object split's children overlap
+  // significantly, and if there's still budget for duplicating references.
+  SpatialSplit spatial;
+  Bounds object_left;
+  Bounds object_right;
+  for (size_t i = 0; i < kNumSAHBuckets; ++i) {
+    Bounds &side = i <= object_bucket ? object_left : object_right;
+    side = Bounds::Union(side, buckets[object_axis][i].bounds);
+  }
+  Bounds overlap = Bounds::Overlap(object_left, object_right);
+  if (budget > 0 && !overlap.IsEmpty() &&
+      overlap.SurfaceArea() > kSpatialSplitAlpha * root_surface) {
+    glm::vec3 dimensions = bounds.Dimensions();
+    for (int axis = 0; axis < 3; ++axis) {
+      if (!(dimensions[axis] > 0.0f)) {
+        continue;
+      }
+      // Bin the references by chopping them into each bin that they span.
+      SpatialBinner binner(bounds, axis);
+      SpatialBin bins[kNumSpatialBins];
+      for (const PrimitiveInfo &reference : references) {
+        size_t first = binner.Bin(reference.bounds.min_pos[axis]);
+        size_t last = binner.Bin(reference.bounds.max_pos[axis]);
+        bins[first].entries++;
+        bins[last].exits++;
+        const PrimitiveRef &primitive = state.refs[reference.original_index];
+        for (size_t bin = first; bin <= last; ++bin) {
+          // Keep the chopped bounds within the reference's bounds, since the
+          // reference may have already been clipped along other axes.
+          Bounds chopped = Bounds::Overlap(
+              primitive.ClippedWorldBounds(axis, binner.Plane(bin),
+                                           binner.Plane(bin + 1)),
+              reference.bounds);
+          bins[bin].bounds = Bounds::Union(bins[bin].bounds, chopped);
+        }
+      }
+
+      // Sweep from the right to accumulate the right side of each candidate
+      // plane, then from the left to compute the cost of each one.
+      Bounds right_bounds[kNumSpatialBins];
+      size_t right_counts[kNumSpatialBins];
+      {
+        Bounds combined_bounds;
+        size_t combined_count = 0;
+        for (size_t bin = kNumSpatialBins - 1; bin > 0; --bin) {
+          combined_bounds = Bounds::Union(combined_bounds, bins[bin].bounds);
+          combined_count += bins[bin].exits;
+          right_bounds[bin] = combined_bounds;
+          right_counts[bin] = combined_count;
+        }
+      }
+      Bounds left_bounds;
+      size_t left_count = 0;
+      for (size_t plane_bin = 1; plane_bin < kNumSpatialBins; ++plane_bin) {
+        left_bounds = Bounds::Union(left_bounds, bins[plane_bin - 1].bounds);
+        left_count += bins[plane_bin - 1].entries;
+        size_t right_count = right_counts[plane_bin];
+        if (left_count == 0 || right_count == 0 ||
+            left_count + right_count - num_references > budget) {
+          continue;
+        }
+        float cost =
+            options_.traversal_cost +
+            options_.intersection_cost *
+                ((left_count * left_bounds.SurfaceArea() +
+                  right_count * right_bounds[plane_bin].SurfaceArea()) /
+                 total_surface);
+        if (cost < spatial.cost) {
+          spatial.cost = cost;
+          spatial.axis = axis;
+          spatial.plane_bin = plane_bin;
+          spatial.left_bounds = left_bounds;
+          spatial.right_bounds = right_bounds[plane_bin];
+          spatial.left_count = left_count;
+          spatial.right_count = right_count;
+        }
+      }
+    }
+  }
+
+  // Create a leaf if that's cheaper than either kind of split.
+  float leaf_cost = options_.intersection_cost * num_references;
+  if (leaf_cost < std::min(object_cost, spatial.cost) &&
+      num_references <= options_.max_leaf_primitives) {
+    return make_leaf();
+  }
+
+  std::vector<PrimitiveInfo> left;
+  std::vector<PrimitiveInfo> right;
+  int axis = object_axis;
+  if (spatial.cost < object_cost) {
+    axis = spatial.axis;
+    SpatialBinner binner(bounds, axis);
+    const float plane = binner.Plane(spatial.plane_bin);
+    for (const PrimitiveInfo &reference : references) {
+      size_t first = binner.Bin(reference.bounds.min_pos[axis]);
+      size_t last = binner.Bin(reference.bounds.max_pos[axis]);
+      if (last < spatial.plane_bin) {
+        left.push_back(reference);
+        continue;
+      }
+      if (first >= spatial.plane_bin) {
+        right.push_back(reference);
+        continue;
+      }
+
+      // The reference straddles the plane. Rather than always splitting it,
+      // check whether it's cheaper to put it wholly on one side instead
+      // ("reference unsplitting"), which avoids the duplication.
+      Bounds unsplit_left =
+          Bounds::Union(spatial.left_bounds, reference.bounds);
+      Bounds unsplit_right =
+          Bounds::Union(spatial.right_bounds, reference.bounds);
+      float split_cost =
+          spatial.left_bounds.SurfaceArea() * spatial.left_count +
+          spatial.right_bounds.SurfaceArea() * spatial.right_count;
+      float left_only_cost =
+          unsplit_left.SurfaceArea() * spatial.left_count +
+          spatial.right_bounds.SurfaceArea() * (spatial.right_count - 1);
+      float right_only_cost =
+          spatial.left_bounds.SurfaceArea() * (spatial.left_count - 1) +
+          unsplit_right.SurfaceArea() * spatial.right_count;
+
+      const PrimitiveRef &primitive = state.refs[reference.original_index];
+      Bounds left_part = Bounds::Overlap(
+          primitive.ClippedWorldBounds(
+              axis, -std::numeric_limits<float>::infinity(), plane),
+          reference.bounds);
+      Bounds right_part = Bounds::Overlap(
+          primitive.ClippedWorldBounds(
+              axis, plane, std::numeric_limits<float>::infinity()),
+          reference.bounds);
+      if (right_part.IsEmpty() ||
+          (left_only_cost < split_cost && left_only_cost <= right_only_cost)) {
+        left.push_back(reference);
+        spatial.left_bounds = unsplit_left;
+        spatial.right_count--;
+      } else if (left_part.IsEmpty() || right_only_cost < split_cost) {
+        right.push_back(reference);
+        spatial.right_bounds = unsplit_right;
+        spatial.left_count--;
+      } else {
+        left.push_back(PrimitiveInfo(reference.original_index, left_part));
+        right.push_back(PrimitiveInfo(reference.original_index, right_part));
+      }
+    }
+  }
+  if (left.empty() || right.empty()) {
+    // Either an object split was cheaper, or the spatial split failed to
+    // separate the references.
+    axis = object_axis;
+    left.clear();
+    right.clear();
+    for (const PrimitiveInfo &reference : references) {
+      bool is_left = SAHBucketIndex(reference.centroid, axis, centroid_bounds,
+                                    centroid_space) <= object_bucket;
+      (is_left ? left : right).push_back(reference);
+    }
+  }
+  if (left.empty() || right.empty()) {
+    // Fall back to a uniform split.
+    size_t split = num_references / 2;
+    std::nth_element(references.begin(), std::next(references.begin(), split),
+                     references.end(),
+                     [axis](const PrimitiveInfo &a, const PrimitiveInfo &b) {
+                       return a.centroid[axis] < b.centroid[axis];
+                     });
+    left.assign(references.begin(), std::next(references.begin(), split));
+    right.assign(std::next(references.begin(), split), references.end());
+  }
+
+  // Free this node's references before recursing, and divide the remaining
+  // budget between the children in proportion to their sizes. Dividing the
+  // budget up front (rather than sharing it) keeps the tree independent of
+  // the order in which subtrees are built.
+  std::vector<PrimitiveInfo>().swap(references);
+  const size_t duplicates = left.size() + right.size() - num_references;
+  const size_t remaining_budget = budget - std::min(budget, duplicates);
+  const size_t left_budget =
+      remaining_budget * left.size() / (left.size() + right.size());
+  const size_t right_budget = remaining_budget - left_budget;
+
+  // As with Build(), large subtrees hand their left child off to another
+  // thread. That child collects its leaf references separately, and they're
+  // appended after the right child's, with the left leaves offset to match.
+  BVHNode *left_node;
+  BVHNode *right_node;
+  if (num_references >= kParallelBuildThreshold && state.AcquireThreads(1)) {
+    std::vector<PrimitiveInfo> left_leaf_references;
+    size_t left_num_nodes = 0;
+    std::thread left_thread([&] {
+      left_node = BuildSpatial(left, left_budget, root_surface, state,
+                               left_leaf_references, left_num_nodes);
+      state.ReleaseThreads(1);
+    });
+    right_node = BuildSpatial(right, right_budget, root_surface, state,
+                              leaf_references, num_nodes);
+    left_thread.join();
+    num_nodes += left_num_nodes;
+    OffsetLeaves(*left_node, leaf_references.size());
+    leaf_references.insert(leaf_references.end(),
+                           left_leaf_references.begin(),
+                           left_leaf_references.end());
+  } else {
+    left_node = BuildSpatial(left, left_budget, root_surface, state,
+                             leaf_references, num_nodes);
+    right_node = BuildSpatial(right, right_budget, root_surface, state,
+                              leaf_references, num_nodes);
+  }
+  return state.arena.Create<BVHNode>(left_node, right_node, axis);
+}
 
 }  // namespace acceleration
 }  // namespace muon
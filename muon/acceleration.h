@@ -2,23 +2,47 @@
 #define MUON_ACCELERATION_H_
 
 #include <array>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "absl/types/optional.h"
 #include "muon/acceleration_type.h"
+#include "muon/arena.h"
 #include "muon/bounds.h"
 #include "muon/objects.h"
+#include "muon/ray_packet.h"
+#include "muon/scene_cache.h"
 #include "muon/stats.h"
+#include "muon/triangle.h"
 
 namespace muon {
 namespace acceleration {
 
+class Instance;
+class Structure;
+
 // Base scratch space for acceleration structures. Individual acceleration
 // structures create their own subtypes.
 class Workspace {
  public:
+  virtual ~Workspace() = default;
+
+  // Returns the scratch space to use for a structure nested within this one,
+  // e.g. the bottom-level structure of an instance. It's created on first use.
+  Workspace *Nested(const Structure &structure);
+
   TraceStats stats;
+  // The primitive that last occluded a ray in Structure::HasIntersection(),
+  // which is tested first for the next ray. Shadow rays toward the same light
+  // from nearby points are often occluded by the same primitive.
+  PrimitiveRef occluder;
+
+ private:
+  std::unordered_map<const Structure *, std::unique_ptr<Workspace>> nested_;
 };
 
 // Abstract base class for acceleration structures. They share similar
@@ -29,10 +53,34 @@ class Structure {
 
   // Adds a Primitive to the acceleration structure.
   virtual void AddPrimitive(std::unique_ptr<Primitive> obj);
+  // Adds an instance of a bottom-level structure. This is the same as
+  // AddPrimitive(), but also records the bottom-level structure's statistics.
+  void AddInstance(std::unique_ptr<Instance> instance);
+
+  // Pre-transforms the primitives into world coordinates, where supported (see
+  // Primitive::PreTransform()). If used, must be called before Init().
+  void PreTransformPrimitives();
 
   // Initialize the acceleration structure. Must be called after all primitives
   // have been added.
   virtual void Init() = 0;
+  // Updates the initialized structure after its primitives have moved, e.g.
+  // because their transforms are animated. Pre-transformed primitives must be
+  // pre-transformed again first. By default, the structure is rebuilt.
+  virtual void Refit();
+
+  // Adds the primitives to the key of a cached structure. Together with the
+  // build options, this determines the structure that Init() builds.
+  void AddToCacheKey(CacheKey &key) const;
+  // Writes the initialized structure to a cache file, so that LoadFromCache()
+  // can restore it over the same primitives without rebuilding it. Returns
+  // false if the structure doesn't support caching.
+  virtual bool SaveToCache(CacheWriter &writer) const { return false; }
+  // Initializes the structure from a cache file written by SaveToCache(),
+  // instead of calling Init(). The same primitives must have been added in the
+  // same order. Returns false, leaving the structure uninitialized, if the
+  // cached data doesn't match.
+  virtual bool LoadFromCache(CacheReader &reader) { return false; }
 
   // Creates a unique reusable workspace for the structure.
   virtual std::unique_ptr<Workspace> CreateWorkspace() const {
@@ -41,29 +89,117 @@ class Structure {
 
   // Intersects with a ray and returns the intersection point. Thread safe as
   // long as each thread has a unique workspace.
-  virtual absl::optional<Intersection> Intersect(Workspace *workspace,
-                                                 const Ray &ray) const = 0;
+  absl::optional<Intersection> Intersect(Workspace *workspace,
+                                         const Ray &ray) const;
+  // Intersects with a ray, only considering hits closer than `hit.distance`,
+  // and records the closest one in `hit`. Returns whether there was one. The
+  // hit can then be resolved with ResolveClosestHit(). Thread safe as long as
+  // each thread has a unique workspace.
+  virtual bool IntersectClosest(Workspace *workspace, const Ray &ray,
+                                HitRecord &hit) const = 0;
+  // Intersects each of `num_rays` rays, of which there may be at most
+  // kMaxRayPacketSize, as with IntersectClosest(): the closest hit of rays[i]
+  // is recorded in hits[i]. Structures may trace coherent rays (e.g. camera
+  // rays) together as a packet, which shares the work of visiting each node.
+  // By default, the rays are traced one at a time. Thread safe as long as each
+  // thread has a unique workspace.
+  virtual void IntersectClosestPacket(Workspace *workspace, const Ray *rays,
+                                      int num_rays, HitRecord *hits) const;
   // Returns whether an intersection exists within a distance along the ray.
-  // Thread safe as long as each thread has a unique workspace.
-  virtual bool HasIntersection(Workspace *workspace, const Ray &ray,
-                               const float max_distance) const = 0;
+  // The workspace's cached occluder is tested first, and is updated when a
+  // different primitive occludes the ray. Thread safe as long as each thread
+  // has a unique workspace.
+  bool HasIntersection(Workspace *workspace, const Ray &ray,
+                       const float max_distance) const;
+  // Returns a primitive that the ray intersects within a distance along it, or
+  // a null reference if there's none. Since any intersection will do,
+  // traversal stops at the first one found. Thread safe as long as each thread
+  // has a unique workspace.
+  virtual PrimitiveRef FindOccluder(Workspace *workspace, const Ray &ray,
+                                    const float max_distance) const = 0;
+
+  // Returns the world bounds of all primitives in the structure.
+  Bounds WorldBounds() const;
+
+  // Returns statistics gathered while initializing the structure.
+  const BuildStats &build_stats() const { return build_stats_; }
 
  protected:
+  // Returns a reference to each part of each primitive, in order. These are
+  // what structures are built over.
+  std::vector<PrimitiveRef> GatherPrimitiveRefs() const;
+
   std::vector<std::unique_ptr<Primitive>> primitives_;
+  BuildStats build_stats_;
+
+ private:
+  // The distinct bottom-level structures of the instances added so far.
+  std::unordered_set<const Structure *> instanced_structures_;
+};
+
+// An instance of a bottom-level acceleration structure, placed in the scene
+// with its own transform and material. The bottom-level structure's
+// primitives are in the instance's object coordinates (i.e. they have
+// identity transforms), so it can be shared between any number of instances.
+// This makes up a two-level hierarchy when instances are added to a top-level
+// structure: e.g. a mesh that's loaded several times only has its geometry and
+// bottom-level BVH built once.
+//
+// Intersections with an instance report the instance as the intersected
+// object, so that each instance uses its own material.
+class Instance : public Primitive {
+ public:
+  // Creates an instance of the given structure, which must already be
+  // initialized.
+  explicit Instance(std::shared_ptr<const Structure> structure);
+
+  Bounds ObjectBounds() const override;
+
+  absl::optional<Intersection> Intersect(const Ray &ray) override;
+  bool HasIntersection(const Ray &ray, const float max_distance) override;
+  absl::optional<Intersection> Intersect(Workspace *workspace,
+                                         const Ray &ray) override;
+  bool HasIntersection(Workspace *workspace, const Ray &ray, uint32_t part,
+                       const float max_distance) override;
+  // Records hits with the bottom-level structure's primitives, along with the
+  // instance itself. Note that this means instances can't be nested.
+  bool IntersectClosest(Workspace *workspace, const Ray &ray, uint32_t part,
+                        HitRecord &hit) override;
+  Intersection ResolveHit(const Ray &ray, const HitRecord &hit) override;
+  // Intersects with the bottom-level structure directly. Prefer Intersect(),
+  // which reuses the caller's scratch space.
+  absl::optional<Intersection> IntersectObjectSpace(const Ray &ray, float t_min,
+                                                    float t_max) override;
+
+  const Structure &structure() const { return *structure_; }
+
+ private:
+  std::shared_ptr<const Structure> structure_;
+  // The cached object bounds of the bottom-level structure.
+  Bounds object_bounds_;
 };
 
 // A simple, linear container that intersects all child primitives
-// sequentially.
+// sequentially, skipping those whose cached bounds the ray misses.
 class Linear : public Structure {
  public:
-  void Init() override {
-    // No-op.
+  void Init() override;
+  // There's nothing to cache, since Init() only gathers the primitive bounds.
+  bool SaveToCache(CacheWriter &writer) const override { return true; }
+  bool LoadFromCache(CacheReader &reader) override {
+    Init();
+    return true;
   }
 
-  absl::optional<Intersection> Intersect(Workspace *workspace,
-                                         const Ray &ray) const override;
-  bool HasIntersection(Workspace *workspace, const Ray &ray,
-                       const float max_distance) const override;
+  bool IntersectClosest(Workspace *workspace, const Ray &ray,
+                        HitRecord &hit) const override;
+  PrimitiveRef FindOccluder(Workspace *workspace, const Ray &ray,
+                            const float max_distance) const override;
+
+ private:
+  // The parts of the primitives, and the world bounds of each one.
+  std::vector<PrimitiveRef> refs_;
+  std::vector<Bounds> bounds_;
 };
 
 // Working info on primitives used during BVH construction.
@@ -71,9 +207,9 @@ class PrimitiveInfo {
  public:
   PrimitiveInfo(size_t original_index, const Bounds &bounds);
 
-  // The original index into the primitives vector. After the BVH is built, we
-  // use the original index to sort the primitives vector to match the build
-  // order.
+  // The original index into the primitive references being built over. After
+  // the BVH is built, we use the original index to order the references to
+  // match the build order.
   size_t original_index;
   // The cached world-space bounds of the primitive.
   Bounds bounds;
@@ -81,14 +217,15 @@ class PrimitiveInfo {
   glm::vec3 centroid;
 };
 
-// A single node of a BVH tree.
+// A single node of a BVH tree, as used during construction. The nodes are
+// allocated in an Arena that's freed in one go once the tree has been
+// flattened into a LinearBVHNode array.
 class BVHNode {
  public:
   // Constructs a leaf node.
   BVHNode(size_t num_primitives, size_t start, const Bounds &bounds);
   // Constructs an internal node.
-  BVHNode(std::unique_ptr<BVHNode> left, std::unique_ptr<BVHNode> right,
-          int axis);
+  BVHNode(BVHNode *left, BVHNode *right, int axis);
 
   // The number of primitives in this node. If this is greater than 0, then it
   // is a leaf node; otherwise, it is an internal node.
@@ -98,22 +235,98 @@ class BVHNode {
   // The axis that the node is split on, if this is an internal node.
   int axis;
   // The child nodes, if this is an internal node.
-  std::array<std::unique_ptr<BVHNode>, 2> children;
+  std::array<BVHNode *, 2> children;
   // The bounds of the node.
   const Bounds bounds;
 };
 
+// A compact BVH node, stored in a contiguous array in depth-first order. The
+// first child of an internal node always immediately follows it in the array,
+// so only the offset of the second child needs to be stored. Nodes are 32
+// bytes so that two of them fit in a single cache line.
+struct LinearBVHNode {
+  // The bounds of the node.
+  Bounds bounds;
+  union {
+    // The start primitives index, if this is a leaf node.
+    uint32_t primitives_offset;
+    // The index of the second child, if this is an internal node.
+    uint32_t second_child_offset;
+  };
+  // The number of primitives in this node. If this is greater than 0, then it
+  // is a leaf node; otherwise, it is an internal node.
+  uint16_t num_primitives;
+  // The axis that the node is split on, if this is an internal node.
+  uint8_t axis;
+  // Explicit padding to keep the node size at 32 bytes.
+  uint8_t padding;
+};
+static_assert(sizeof(LinearBVHNode) == 32,
+              "LinearBVHNode should be 32 bytes in size");
+
+// The maximum number of primitives that can be stored in a single leaf node.
+constexpr size_t kMaxLeafPrimitives = std::numeric_limits<uint16_t>::max();
+
 constexpr int kBVHStackSize = 64;
 
+// Options that control how a BVH is constructed.
+struct BVHBuildOptions {
+  // The maximum number of threads to use while building.
+  uint32_t parallelism = 1;
+  // Whether the surface area heuristic should consider splitting along all
+  // three axes, instead of only the axis with the widest centroid spread. This
+  // generally produces a better tree, at the cost of a slower build.
+  bool sah_all_axes = false;
+  // The estimated cost of traversing a node (i.e. testing its children's
+  // bounds), relative to intersection_cost. Used by the surface area heuristic
+  // to decide between splitting a node or making it a leaf.
+  float traversal_cost = 0.125f;
+  // The estimated cost of intersecting a ray with a single primitive.
+  float intersection_cost = 1.0f;
+  // The maximum number of primitives in a leaf. Nodes with more primitives are
+  // always split. Must be at most kMaxLeafPrimitives.
+  size_t max_leaf_primitives = 255;
+  // For the kSBVH partition strategy, the maximum number of primitive
+  // references that spatial splits may add, as a fraction of the number of
+  // primitives.
+  float sbvh_duplication_budget = 0.3f;
+  // When refitting, the BVH is rebuilt instead if refitting would make its SAH
+  // cost exceed the cost right after it was built by more than this factor.
+  float refit_rebuild_threshold = 1.5f;
+};
+
+// The packed tris of a BVH leaf. See TrianglePacket.
+struct LeafTriangles {
+  // The index of the leaf's first packet.
+  uint32_t first_packet;
+  // The number of tris packed, which come first in the leaf's primitives.
+  uint32_t num_triangles;
+};
+
+// Shared state used while building a BVH tree. See acceleration.cc.
+struct BVHBuildState;
+
+// A node to visit while intersecting a ray packet with a BVH, along with the
+// bitmask of the packet's rays that hit its parent.
+struct BVHPacketStackEntry {
+  uint32_t index;
+  uint32_t active;
+};
+
 // A reusable stack space for use while checking BVH intersection.
 class BVHWorkspace : public Workspace {
  public:
-  BVHWorkspace() { frontier_.reserve(kBVHStackSize); }
+  BVHWorkspace() {
+    frontier_.reserve(kBVHStackSize);
+    packet_frontier_.reserve(kBVHStackSize);
+  }
 
  private:
-  // A stack of nodes to visit while checking intersection. Is empty before and
-  // after intersection.
-  std::vector<BVHNode *> frontier_;
+  // A stack of node indices to visit while checking intersection. Is empty
+  // before and after intersection.
+  std::vector<uint32_t> frontier_;
+  // The same, for ray packets.
+  std::vector<BVHPacketStackEntry> packet_frontier_;
 
   friend class BVH;
 };
@@ -122,30 +335,138 @@ class BVHWorkspace : public Workspace {
 // This class generates a binary bounding volume hierarchy based on a set of
 // primitives, allowing for quick intersection tests. It provides several
 // partitioning strategies, including a uniform distribution, centroid midpoint
-// split, and splitting based on the surface area heuristic.
+// split, and splitting based on the surface area heuristic. Once built, the
+// tree is flattened into a linear array of nodes for cache-friendly traversal.
 class BVH : public Structure {
  public:
-  explicit BVH(PartitionStrategy strategy) : partition_strategy_(strategy) {}
+  explicit BVH(PartitionStrategy strategy,
+               const BVHBuildOptions &options = BVHBuildOptions())
+      : partition_strategy_(strategy), options_(options) {}
 
   void Init() override;
+  // Recomputes the bounds of the existing tree's nodes bottom-up, keeping its
+  // topology, unless that degrades it too much (see
+  // BVHBuildOptions::refit_rebuild_threshold), in which case it's rebuilt.
+  void Refit() override;
+  bool SaveToCache(CacheWriter &writer) const override;
+  bool LoadFromCache(CacheReader &reader) override;
 
   std::unique_ptr<Workspace> CreateWorkspace() const override {
     return absl::make_unique<BVHWorkspace>();
   }
 
-  absl::optional<Intersection> Intersect(Workspace *workspace,
-                                         const Ray &ray) const override;
-  bool HasIntersection(Workspace *workspace, const Ray &ray,
-                       const float max_distance) const override;
+  bool IntersectClosest(Workspace *workspace, const Ray &ray,
+                        HitRecord &hit) const override;
+  // Traverses the tree once for the whole packet when the rays' directions all
+  // have the same signs, and so visit the children of each node in the same
+  // order. Each node's bounds are first tested against the whole packet with
+  // interval arithmetic, and then against each ray that hit its parent with
+  // SIMD instructions. The hits are the same as with IntersectClosest().
+  void IntersectClosestPacket(Workspace *workspace, const Ray *rays,
+                              int num_rays, HitRecord *hits) const override;
+  PrimitiveRef FindOccluder(Workspace *workspace, const Ray &ray,
+                            const float max_distance) const override;
+
+ protected:
+  // Builds the binary BVH tree over the given primitive references, and fills
+  // leaf_primitives_ in the order of the tree's leaves. The nodes are allocated
+  // in the given arena. Returns the root of the tree, and outputs the number of
+  // nodes created.
+  BVHNode *BuildTree(const std::vector<PrimitiveRef> &refs, Arena &arena,
+                     size_t &num_nodes);
+
+  // Records the quality of the given binary tree in the build stats: its cost
+  // according to the surface area heuristic (with the costs from options_),
+  // and the average overlap of the bounds of sibling nodes, relative to their
+  // parent's surface area.
+  void RecordTreeQuality(const BVHNode &root);
+
+  // Sorts the primitives of each leaf of the given tree by type, and packs the
+  // pre-transformed tris into TrianglePackets, so that traversal can test
+  // several of them with a single SIMD call. The packed tris are moved to the
+  // front of each leaf's range of leaf_primitives_.
+  void PackTriangles(const BVHNode &root);
+
+  // Computes the bounds of each node bottom-up from the current world bounds
+  // of its primitives, and returns the resulting SAH cost of the tree. The
+  // nodes are only updated if `update` is set. Note that the bounds of leaves
+  // created by spatial splits grow to contain their primitives in full.
+  virtual double RefitNodes(bool update);
+  // Updates the triangle packets to the current world positions of the tris.
+  void RefitTrianglePackets();
+
+  // Writes the parts of the BVH that don't depend on its node layout to a
+  // cache file: the leaf primitives (as indices into GatherPrimitiveRefs()),
+  // the packed tris, and the quality of the tree.
+  void SaveLeafData(CacheWriter &writer) const;
+  // Reads the data written by SaveLeafData(), and records it in the build
+  // stats. Returns false, leaving the BVH unchanged, if it doesn't match the
+  // primitives.
+  bool LoadLeafData(CacheReader &reader);
+  // Returns whether a leaf of a tree loaded from a cache file, whose primitives
+  // are the given range of leaf_primitives_, fits the loaded leaf data.
+  bool IsValidCachedLeaf(uint32_t start, uint32_t num_primitives) const;
+
+  const BVHBuildOptions &options() const { return options_; }
+
+  // Intersects the ray with the primitives of the leaf whose range of
+  // leaf_primitives_ starts at `start`, and updates `hit` if any of them are
+  // hit closer than it. Each run of primitives of the same type is dispatched
+  // on the type once, calling the kernels of tris and spheres directly.
+  void IntersectLeaf(Workspace *workspace, const Ray &ray,
+                     const TriangleRay &triangle_ray, uint32_t start,
+                     uint32_t num_primitives, HitRecord &hit) const;
+  // Returns one of the leaf's primitives that's hit within a distance along
+  // the ray, or a null reference if there's none.
+  PrimitiveRef FindLeafOccluder(Workspace *workspace, const Ray &ray,
+                                const TriangleRay &triangle_ray,
+                                uint32_t start, uint32_t num_primitives,
+                                const float max_distance) const;
+
+  // The primitives referenced by the leaves of the tree. Each leaf refers to a
+  // contiguous range of this vector. With spatial splits, a primitive may be
+  // referenced by more than one leaf.
+  std::vector<PrimitiveRef> leaf_primitives_;
+  // The cost returned by RefitNodes() right after the tree was last built,
+  // which refitted trees are compared against.
+  double built_cost_ = 0.0;
 
  private:
   PartitionStrategy partition_strategy_;
-  std::unique_ptr<BVHNode> root_;
+  BVHBuildOptions options_;
+  // The flattened tree, with the root node at index 0.
+  std::vector<LinearBVHNode> nodes_;
+  // The packed tris of each leaf, indexed by the start of the leaf's range of
+  // leaf_primitives_. Empty if no tris were packed.
+  std::vector<LeafTriangles> leaf_triangles_;
+  std::vector<TrianglePacket> triangle_packets_;
 
   // Recursively builds the BVH tree out of a given start and end range in the
-  // primitives vector.
-  std::unique_ptr<BVHNode> Build(size_t start, size_t end,
-                                 std::vector<PrimitiveInfo> &info) const;
+  // primitives vector. Increments `num_nodes` for each node created. Large
+  // subtrees may be built on other threads.
+  BVHNode *Build(size_t start, size_t end, BVHBuildState &state,
+                 size_t &num_nodes) const;
+
+  // Builds the BVH tree by sorting primitives along a Morton curve, for the
+  // kMorton and kHLBVH partition strategies. This is much faster than the
+  // other strategies, but generally produces a lower quality tree.
+  BVHNode *BuildLBVH(BVHBuildState &state, size_t &num_nodes) const;
+
+  // Recursively builds a spatial split BVH (SBVH) over the given primitive
+  // references, which are consumed. Leaves are created by appending their
+  // references to `leaf_references`. Up to `budget` additional references may
+  // be created by splitting references that straddle a spatial split plane.
+  BVHNode *BuildSpatial(std::vector<PrimitiveInfo> &references, size_t budget,
+                        float root_surface, BVHBuildState &state,
+                        std::vector<PrimitiveInfo> &leaf_references,
+                        size_t &num_nodes) const;
+
+  // Recursively appends the given subtree, whose root is at the given depth, to
+  // nodes_ in depth-first order, and returns the index of the subtree's root.
+  uint32_t Flatten(const BVHNode &node, uint32_t depth);
+
+  // Records the build stats of the leaf data, once it's complete.
+  void RecordLeafData(size_t num_packed_triangles);
 };
 
 }  // namespace acceleration
@@ -12,6 +12,22 @@ bool AbslParseFlag(absl::string_view text, AccelerationType *type,
     *type = AccelerationType::kBVH;
     return true;
   }
+  if (text == "bvh4") {
+    *type = AccelerationType::kBVH4;
+    return true;
+  }
+  if (text == "bvh8") {
+    *type = AccelerationType::kBVH8;
+    return true;
+  }
+  if (text == "compressed_bvh4") {
+    *type = AccelerationType::kCompressedBVH4;
+    return true;
+  }
+  if (text == "compressed_bvh8") {
+    *type = AccelerationType::kCompressedBVH8;
+    return true;
+  }
   *error = "unknown value for acceleration";
   return false;
 }
@@ -22,6 +38,14 @@ std::string AbslUnparseFlag(AccelerationType type) {
       return "linear";
     case AccelerationType::kBVH:
       return "bvh";
+    case AccelerationType::kBVH4:
+      return "bvh4";
+    case AccelerationType::kBVH8:
+      return "bvh8";
+    case AccelerationType::kCompressedBVH4:
+      return "compressed_bvh4";
+    case AccelerationType::kCompressedBVH8:
+      return "compressed_bvh8";
     default:
       return absl::StrCat(type);
   }
@@ -41,6 +65,18 @@ bool AbslParseFlag(absl::string_view text, PartitionStrategy *strategy,
     *strategy = PartitionStrategy::kSAH;
     return true;
   }
+  if (text == "morton") {
+    *strategy = PartitionStrategy::kMorton;
+    return true;
+  }
+  if (text == "hlbvh") {
+    *strategy = PartitionStrategy::kHLBVH;
+    return true;
+  }
+  if (text == "sbvh") {
+    *strategy = PartitionStrategy::kSBVH;
+    return true;
+  }
   *error = "unknown value for partition_strategy";
   return false;
 }
@@ -53,6 +89,12 @@ std::string AbslUnparseFlag(PartitionStrategy strategy) {
       return "midpoint";
     case PartitionStrategy::kSAH:
       return "sah";
+    case PartitionStrategy::kMorton:
+      return "morton";
+    case PartitionStrategy::kHLBVH:
+      return "hlbvh";
+    case PartitionStrategy::kSBVH:
+      return "sbvh";
     default:
       return absl::StrCat(strategy);
   }
@@ -13,6 +13,14 @@ enum class AccelerationType {
   kLinear = 0,
   // A bounding volume hierarchy.
   kBVH,
+  // A 4-wide bounding volume hierarchy, with SIMD node tests.
+  kBVH4,
+  // An 8-wide bounding volume hierarchy, with SIMD node tests.
+  kBVH8,
+  // Like kBVH4 and kBVH8, but with child bounds quantized to 8 bits, which
+  // shrinks the nodes so that more of them fit in cache.
+  kCompressedBVH4,
+  kCompressedBVH8,
 };
 
 // The strategy used for partitioning primitives within a bounding volume
@@ -25,6 +33,18 @@ enum class PartitionStrategy {
   kMidpoint,
   // Partition based on a surface area heuristic.
   kSAH,
+  // Build a linear BVH (LBVH) by sorting primitives along a Morton curve and
+  // splitting on the bits of their Morton codes. Very fast to build, at the
+  // cost of tree quality.
+  kMorton,
+  // Like kMorton, but builds the upper levels of the tree via the surface
+  // area heuristic (HLBVH).
+  kHLBVH,
+  // Partition based on a surface area heuristic, additionally considering
+  // spatial splits that clip primitives straddling the split plane and
+  // reference them from both children (SBVH). This helps with large or long,
+  // thin primitives whose bounds overlap heavily.
+  kSBVH,
 };
 
 bool AbslParseFlag(absl::string_view text, AccelerationType *type,
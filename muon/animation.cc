@@ -0,0 +1,62 @@
+#include "muon/animation.h"
+
+#include "third_party/glm/gtx/transform.hpp"
+
+namespace muon {
+
+AnimatedTransform::AnimatedTransform()
+    : transform(std::make_shared<glm::mat4>(1.0f)),
+      inv_transform(std::make_shared<glm::mat4>(1.0f)),
+      inv_transpose_transform(std::make_shared<glm::mat4>(1.0f)),
+      steps_({Step{false, glm::mat4(1.0f)}}) {}
+
+std::shared_ptr<AnimatedTransform> AnimatedTransform::Multiply(
+    const glm::mat4 &m) const {
+  return Append(Step{false, m});
+}
+
+std::shared_ptr<AnimatedTransform>
+AnimatedTransform::MultiplyTranslationPerFrame(
+    const glm::vec3 &translation) const {
+  return Append(Step{true, glm::mat4(1.0f), translation,
+                     glm::vec3(0.0f, 1.0f, 0.0f), 0.0f});
+}
+
+std::shared_ptr<AnimatedTransform> AnimatedTransform::MultiplyRotationPerFrame(
+    const glm::vec3 &axis, float degrees) const {
+  return Append(Step{true, glm::mat4(1.0f), glm::vec3(0.0f), axis, degrees});
+}
+
+void AnimatedTransform::SetFrame(int frame) {
+  frame_ = frame;
+  glm::mat4 m = steps_[0].AtFrame(frame);
+  for (size_t i = 1; i < steps_.size(); ++i) {
+    m = m * steps_[i].AtFrame(frame);
+  }
+  *transform = m;
+  *inv_transform = glm::inverse(m);
+  *inv_transpose_transform = glm::transpose(*inv_transform);
+}
+
+glm::mat4 AnimatedTransform::Step::AtFrame(int frame) const {
+  if (!animated) {
+    return matrix;
+  }
+  return glm::translate(translation * static_cast<float>(frame)) *
+         glm::rotate(glm::radians(degrees * frame), axis);
+}
+
+std::shared_ptr<AnimatedTransform> AnimatedTransform::Append(
+    const Step &step) const {
+  auto result = std::make_shared<AnimatedTransform>();
+  result->steps_ = steps_;
+  if (!step.animated && !result->steps_.back().animated) {
+    result->steps_.back().matrix = result->steps_.back().matrix * step.matrix;
+  } else {
+    result->steps_.push_back(step);
+  }
+  result->SetFrame(frame_);
+  return result;
+}
+
+}  // namespace muon
@@ -0,0 +1,67 @@
+#ifndef MUON_ANIMATION_H_
+#define MUON_ANIMATION_H_
+
+#include <memory>
+#include <vector>
+
+#include "third_party/glm/glm.hpp"
+
+namespace muon {
+
+// A transform that may change with each frame of an animation. It's the
+// product of a sequence of steps, each of which is either a fixed matrix or a
+// motion that's repeated every frame (e.g. a rotation by a fixed angle per
+// frame). Primitives share its matrices, which SetFrame() updates in place.
+class AnimatedTransform {
+ public:
+  // Creates an identity transform, at frame 0.
+  AnimatedTransform();
+
+  // Returns a new transform that applies the given matrix before this one,
+  // i.e. their product.
+  std::shared_ptr<AnimatedTransform> Multiply(const glm::mat4 &m) const;
+  // Returns a new transform that applies a translation of `frame * translation`
+  // before this one.
+  std::shared_ptr<AnimatedTransform> MultiplyTranslationPerFrame(
+      const glm::vec3 &translation) const;
+  // Returns a new transform that applies a rotation of `frame * degrees` about
+  // the given axis before this one.
+  std::shared_ptr<AnimatedTransform> MultiplyRotationPerFrame(
+      const glm::vec3 &axis, float degrees) const;
+
+  // Whether the transform changes between frames, i.e. has any motion steps.
+  // The first step is always a fixed matrix.
+  bool animated() const { return steps_.size() > 1; }
+  // Updates the matrices to the given frame.
+  void SetFrame(int frame);
+
+  // The transform at the current frame, and its inverse and inverse transpose.
+  const std::shared_ptr<glm::mat4> transform;
+  const std::shared_ptr<glm::mat4> inv_transform;
+  const std::shared_ptr<glm::mat4> inv_transpose_transform;
+
+ private:
+  struct Step {
+    // Whether this step is a motion rather than a fixed matrix.
+    bool animated;
+    // The fixed matrix.
+    glm::mat4 matrix;
+    // The motion per frame: a translation, followed by a rotation.
+    glm::vec3 translation;
+    glm::vec3 axis;
+    float degrees;
+
+    glm::mat4 AtFrame(int frame) const;
+  };
+
+  std::shared_ptr<AnimatedTransform> Append(const Step &step) const;
+
+  // The steps, in the order of multiplication. Consecutive fixed matrices are
+  // combined into a single step.
+  std::vector<Step> steps_;
+  int frame_ = 0;
+};
+
+}  // namespace muon
+
+#endif
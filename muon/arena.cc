@@ -0,0 +1,42 @@
+#include "muon/arena.h"
+
+#include <algorithm>
+
+namespace muon {
+
+void *Arena::Allocate(size_t size, size_t alignment) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  ++num_allocations_;
+  size_t padding = -reinterpret_cast<uintptr_t>(next_) & (alignment - 1);
+  if (next_ == nullptr || padding + size > remaining_) {
+    // Start a new block. Allocations larger than a block get one of their own;
+    // the remainder of the current block is abandoned either way.
+    size_t block_size = std::max(block_size_, size + alignment);
+    blocks_.emplace_back(new char[block_size]);
+    next_ = blocks_.back().get();
+    remaining_ = block_size;
+    bytes_reserved_ += block_size;
+    padding = -reinterpret_cast<uintptr_t>(next_) & (alignment - 1);
+  }
+  void *ptr = next_ + padding;
+  next_ += padding + size;
+  remaining_ -= padding + size;
+  return ptr;
+}
+
+uint64_t Arena::num_allocations() const {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  return num_allocations_;
+}
+
+uint64_t Arena::num_blocks() const {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  return blocks_.size();
+}
+
+uint64_t Arena::bytes_reserved() const {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_reserved_;
+}
+
+}  // namespace muon
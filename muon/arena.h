@@ -0,0 +1,63 @@
+#ifndef MUON_ARENA_H_
+#define MUON_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace muon {
+
+// A monotonic allocator for many small objects that share a lifetime, e.g. the
+// nodes of a BVH under construction. Objects are allocated by bumping a
+// pointer through large blocks, and are all freed at once when the arena is
+// destroyed. Their destructors aren't run, so only trivially destructible
+// objects may be created. Thread safe.
+class Arena {
+ public:
+  static constexpr size_t kDefaultBlockSize = 256 * 1024;
+
+  explicit Arena(size_t block_size = kDefaultBlockSize)
+      : block_size_(block_size) {}
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns uninitialized memory of the given size and alignment, which must
+  // be a power of two.
+  void *Allocate(size_t size, size_t alignment);
+
+  // Constructs an object in the arena.
+  template <typename T, typename... Args>
+  T *Create(Args &&...args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Arena objects must be trivially destructible");
+    return new (Allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  // The number of calls to Allocate(), and the number of blocks they were
+  // served from, i.e. the number of heap allocations.
+  uint64_t num_allocations() const;
+  uint64_t num_blocks() const;
+  // The total size of the blocks.
+  uint64_t bytes_reserved() const;
+
+ private:
+  const size_t block_size_;
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  // The unused remainder of the current block.
+  char *next_ = nullptr;
+  size_t remaining_ = 0;
+  uint64_t num_allocations_ = 0;
+  uint64_t bytes_reserved_ = 0;
+
+  mutable std::mutex mutex_;
+};
+
+}  // namespace muon
+
+#endif
@@ -49,6 +49,11 @@ float Bounds::SurfaceArea() const {
                  dimensions.y * dimensions.z);
 }
 
+bool Bounds::IsEmpty() const {
+  return min_pos.x > max_pos.x || min_pos.y > max_pos.y ||
+         min_pos.z > max_pos.z;
+}
+
 Bounds Bounds::Transform(const glm::mat4 &transform) const {
   // Construct a bounding box with all 8 transformed corners of the current
   // bounding box, which will ensure that the new bounds are correct.
@@ -98,9 +103,8 @@ bool Bounds::Intersect(const Ray &ray, float &t_min, float &t_max) const {
     if (direction[i] == 0.0f) {
       continue;
     }
-    // IDEA: This code is called often during BVH traversal, so it may be
-    // faster to accept precomputed inverse values for the ray's direction to
-    // avoid the relatively costly division.
+    // NOTE: Acceleration structures should use the TraversalRay overload of
+    // HasIntersection instead, which avoids the divisions and branches here.
     float t_axis_min = (min_pos[i] - origin[i]) / direction[i];
     float t_axis_max = (max_pos[i] - origin[i]) / direction[i];
 
@@ -138,6 +142,19 @@ Bounds Bounds::Union(const Bounds &b1, const Bounds &b2) {
   return b;
 }
 
+Bounds Bounds::Overlap(const Bounds &b1, const Bounds &b2) {
+  // The overlap is bounded by the larger of the minimums, and the smaller of
+  // the maximums. If the boxes don't overlap, then the min will be greater
+  // than the max along some axis.
+  Bounds b;
+  b.min_pos = glm::max(b1.min_pos, b2.min_pos);
+  b.max_pos = glm::min(b1.max_pos, b2.max_pos);
+  if (b.IsEmpty()) {
+    return Bounds();
+  }
+  return b;
+}
+
 Bounds Bounds::Union(const Bounds &b1, const glm::vec3 &pos) {
   Bounds b;
   b.min_pos.x = glm::min(b1.min_pos.x, pos.x);
@@ -24,6 +24,9 @@ class Bounds {
   // Returns the surface area of the bounding box.
   float SurfaceArea() const;
 
+  // Returns whether the bounding box is empty (e.g. uninitialized).
+  bool IsEmpty() const;
+
   // Transforms the bounding box by the given transform and returns a new
   // axis-aligned bounding box. Note, because it is axis-aligned, the new
   // bounding box may have different area and volume.
@@ -32,12 +35,20 @@ class Bounds {
   // Returns whether an intersection exists.
   bool HasIntersection(const Ray &ray) const;
   bool HasIntersection(const Ray &ray, const float max_distance) const;
+  // Returns whether an intersection exists within a distance along the ray,
+  // using a branchless slab test. This is the fast path used during
+  // acceleration structure traversal.
+  inline bool HasIntersection(const TraversalRay &ray,
+                              const float max_distance) const;
 
   // Computes a combined bounding box from an existing bounding box and an
   // additional position.
   static Bounds Union(const Bounds &b1, const glm::vec3 &pos);
   // Computes a combined bounding box from two existing bounding boxes.
   static Bounds Union(const Bounds &b1, const Bounds &b2);
+  // Computes the bounding box of the region where two bounding boxes overlap.
+  // The result is empty if they don't overlap.
+  static Bounds Overlap(const Bounds &b1, const Bounds &b2);
 
   glm::vec3 min_pos;
   glm::vec3 max_pos;
@@ -46,6 +57,52 @@ class Bounds {
   bool Intersect(const Ray &ray, float &t_min, float &t_max) const;
 };
 
+// Returns the larger of a and b, or b if either is NaN.
+inline float SlabMax(float a, float b) { return a > b ? a : b; }
+// Returns the smaller of a and b, or b if either is NaN.
+inline float SlabMin(float a, float b) { return a < b ? a : b; }
+
+// Conservatively scales the far slab distance to account for floating point
+// rounding error in the slab computation (see pbrt's section on ray-bounds
+// intersection robustness), so that rays grazing a box are never missed.
+constexpr float kSlabErrorScale = 1.0f + 2.0f * (3.0f * 0.5f * 1.19209290e-7f);
+
+inline bool Bounds::HasIntersection(const TraversalRay &ray,
+                                    const float max_distance) const {
+  // Select the near and far planes for each axis based on the sign of the ray
+  // direction, so that the slab distances never need to be swapped. The
+  // selects compile down to conditional moves rather than branches.
+  float t_near_x = ((ray.dir_is_negative[0] ? max_pos.x : min_pos.x) -
+                    ray.origin.x) *
+                   ray.inv_direction.x;
+  float t_far_x = ((ray.dir_is_negative[0] ? min_pos.x : max_pos.x) -
+                   ray.origin.x) *
+                  ray.inv_direction.x;
+  float t_near_y = ((ray.dir_is_negative[1] ? max_pos.y : min_pos.y) -
+                    ray.origin.y) *
+                   ray.inv_direction.y;
+  float t_far_y = ((ray.dir_is_negative[1] ? min_pos.y : max_pos.y) -
+                   ray.origin.y) *
+                  ray.inv_direction.y;
+  float t_near_z = ((ray.dir_is_negative[2] ? max_pos.z : min_pos.z) -
+                    ray.origin.z) *
+                   ray.inv_direction.z;
+  float t_far_z = ((ray.dir_is_negative[2] ? min_pos.z : max_pos.z) -
+                   ray.origin.z) *
+                  ray.inv_direction.z;
+
+  // Narrow the [0, max_distance] window by each axis. A NaN slab distance
+  // (which occurs when the origin lies exactly on a plane and the direction is
+  // parallel to it, i.e. 0 * inf) leaves the window untouched. Infinite slab
+  // distances from parallel rays either keep or empty the window as expected.
+  float t_min = SlabMax(t_near_x, SlabMax(t_near_y, SlabMax(t_near_z, 0.0f)));
+  float t_max = SlabMin(t_far_x * kSlabErrorScale,
+                        SlabMin(t_far_y * kSlabErrorScale,
+                                SlabMin(t_far_z * kSlabErrorScale,
+                                        max_distance)));
+  return t_min <= t_max;
+}
+
 }  // namespace muon
 
 #endif
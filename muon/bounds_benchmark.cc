@@ -0,0 +1,99 @@
+// A microbenchmark comparing the ray-box tests used during acceleration
+// structure traversal. It measures the original per-ray Bounds test, which
+// divides by the ray direction for each axis, against the branchless slab test
+// that uses a TraversalRay with a precomputed inverse direction.
+//
+// Usage: bazel run -c opt //muon:bounds_benchmark
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "muon/bounds.h"
+#include "muon/random.h"
+#include "muon/ray.h"
+#include "third_party/glm/glm.hpp"
+
+namespace {
+
+constexpr int kNumBoxes = 4096;
+constexpr int kNumRays = 2048;
+constexpr int kNumRepeats = 8;
+constexpr unsigned int kSeed = 1234;
+
+glm::vec3 RandomVec(muon::UniformRandom &rand, float scale) {
+  return scale * (glm::vec3(rand.Next(), rand.Next(), rand.Next()) * 2.0f -
+                  glm::vec3(1.0f));
+}
+
+// Runs the given box test over all rays and boxes, printing its throughput.
+// Returns the number of hits.
+template <typename RayType, typename TestFn>
+uint64_t Run(const char *name, const std::vector<muon::Bounds> &boxes,
+             const std::vector<RayType> &rays, TestFn test) {
+  uint64_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int repeat = 0; repeat < kNumRepeats; ++repeat) {
+    for (const RayType &ray : rays) {
+      for (const muon::Bounds &box : boxes) {
+        hits += test(box, ray);
+      }
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double num_tests = static_cast<double>(kNumRepeats) * rays.size() *
+                     boxes.size();
+  std::printf("%-16s: %8.2f Mtests/sec (%.3f sec)\n", name,
+              num_tests / elapsed.count() / 1e6, elapsed.count());
+  return hits;
+}
+
+}  // namespace
+
+int main() {
+  muon::UniformRandom rand(kSeed);
+
+  std::vector<muon::Bounds> boxes;
+  boxes.reserve(kNumBoxes);
+  for (int i = 0; i < kNumBoxes; ++i) {
+    glm::vec3 center = RandomVec(rand, 10.0f);
+    glm::vec3 extent = glm::abs(RandomVec(rand, 1.0f));
+    boxes.emplace_back(center - extent, center + extent);
+  }
+
+  std::vector<muon::Ray> rays;
+  std::vector<muon::TraversalRay> traversal_rays;
+  rays.reserve(kNumRays);
+  traversal_rays.reserve(kNumRays);
+  for (int i = 0; i < kNumRays; ++i) {
+    glm::vec3 direction = RandomVec(rand, 1.0f);
+    // Exercise axis-aligned directions too, which hit the zero-direction
+    // special cases of both tests. Note that the original test conservatively
+    // treats such axes as always overlapping, so it reports extra hits for
+    // these rays.
+    if (i % 16 == 0) {
+      direction[i % 3] = 0.0f;
+    }
+    rays.emplace_back(RandomVec(rand, 12.0f), glm::normalize(direction));
+    traversal_rays.emplace_back(rays.back());
+  }
+
+  const float max_distance = 20.0f;
+  uint64_t before_hits =
+      Run("Bounds (before)", boxes, rays,
+          [&](const muon::Bounds &box, const muon::Ray &ray) {
+            return box.HasIntersection(ray, max_distance);
+          });
+  uint64_t after_hits =
+      Run("Slab (after)", boxes, traversal_rays,
+          [&](const muon::Bounds &box, const muon::TraversalRay &ray) {
+            return box.HasIntersection(ray, max_distance);
+          });
+
+  std::printf("Hits: %llu before, %llu after\n",
+              static_cast<unsigned long long>(before_hits),
+              static_cast<unsigned long long>(after_hits));
+  return 0;
+}
@@ -29,6 +29,9 @@ constexpr char kOutput[] = "raytrace.png";
 // The gamma of the final image.
 constexpr float kGamma = 1.0f;
 
+// The number of frames to render.
+constexpr int kFrames = 1;
+
 // Whether or not to compute vertex normals.
 constexpr bool kComputeVertexNormals = false;
 
@@ -51,6 +54,10 @@ constexpr bool kRussianRoulette = false;
 constexpr ImportanceSampling kImportanceSampling =
     ImportanceSampling::kHemisphere;
 
+// The number of primitive or bounds tests per ray that maps to full intensity
+// when rendering a heatmap.
+constexpr float kHeatmapScale = 100.0f;
+
 // Light attenuation, in terms of constant, linear, and quadratic.
 static const glm::vec3 kAttenuation = glm::vec3(1.0f, 0.0f, 0.0f);
 
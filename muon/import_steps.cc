@@ -0,0 +1,80 @@
+#include "muon/import_steps.h"
+
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "assimp/postprocess.h"
+
+namespace muon {
+namespace {
+
+// The names of the presets, followed by those of the individual steps. When
+// unparsing, presets are preferred over listing the steps they consist of.
+const std::vector<std::pair<std::string, unsigned int>> step_names = {
+    {"max_quality", aiProcessPreset_TargetRealtime_MaxQuality},
+    {"quality", aiProcessPreset_TargetRealtime_Quality},
+    {"fast", aiProcessPreset_TargetRealtime_Fast},
+    {"calc_tangent_space", aiProcess_CalcTangentSpace},
+    {"join_identical_vertices", aiProcess_JoinIdenticalVertices},
+    {"triangulate", aiProcess_Triangulate},
+    {"gen_normals", aiProcess_GenNormals},
+    {"gen_smooth_normals", aiProcess_GenSmoothNormals},
+    {"split_large_meshes", aiProcess_SplitLargeMeshes},
+    {"limit_bone_weights", aiProcess_LimitBoneWeights},
+    {"validate_data_structure", aiProcess_ValidateDataStructure},
+    {"improve_cache_locality", aiProcess_ImproveCacheLocality},
+    {"remove_redundant_materials", aiProcess_RemoveRedundantMaterials},
+    {"sort_by_ptype", aiProcess_SortByPType},
+    {"find_degenerates", aiProcess_FindDegenerates},
+    {"find_invalid_data", aiProcess_FindInvalidData},
+    {"gen_uv_coords", aiProcess_GenUVCoords},
+    {"find_instances", aiProcess_FindInstances},
+    {"optimize_meshes", aiProcess_OptimizeMeshes},
+};
+
+}  // namespace
+
+ImportSteps DefaultImportSteps() {
+  return {aiProcessPreset_TargetRealtime_MaxQuality};
+}
+
+bool AbslParseFlag(absl::string_view text, ImportSteps *steps,
+                   std::string *error) {
+  unsigned int flags = 0;
+  for (absl::string_view name :
+       absl::StrSplit(text, ',', absl::SkipWhitespace())) {
+    bool remove = absl::ConsumePrefix(&name, "-");
+    bool found = false;
+    for (const auto &[step_name, step_flags] : step_names) {
+      if (name == step_name) {
+        flags = remove ? flags & ~step_flags : flags | step_flags;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      *error = absl::StrCat("unknown import step: ", name);
+      return false;
+    }
+  }
+  steps->flags = flags;
+  return true;
+}
+
+std::string AbslUnparseFlag(ImportSteps steps) {
+  std::vector<std::string> names;
+  unsigned int remaining = steps.flags;
+  for (const auto &[name, flags] : step_names) {
+    if (flags != 0 && (remaining & flags) == flags) {
+      names.push_back(name);
+      remaining &= ~flags;
+    }
+  }
+  return absl::StrJoin(names, ",");
+}
+
+}  // namespace muon
@@ -0,0 +1,32 @@
+#ifndef MUON_IMPORT_STEPS_H_
+#define MUON_IMPORT_STEPS_H_
+
+#include <string>
+
+#include "absl/flags/flag.h"
+
+namespace muon {
+
+// The Assimp post-processing steps (a combination of aiPostProcessSteps) run
+// on models imported by the `load` command.
+//
+// As a flag, it's a comma-separated list of step names (e.g.
+// "triangulate,join_identical_vertices") or presets ("fast", "quality",
+// "max_quality"), each of which adds to the set of steps. A name prefixed with
+// '-' removes the step instead, so that e.g. "max_quality,-calc_tangent_space"
+// skips a step that muon doesn't need.
+struct ImportSteps {
+  unsigned int flags;
+};
+
+// The steps that are run by default: Assimp's
+// aiProcessPreset_TargetRealtime_MaxQuality.
+ImportSteps DefaultImportSteps();
+
+bool AbslParseFlag(absl::string_view text, ImportSteps *steps,
+                   std::string *error);
+std::string AbslUnparseFlag(ImportSteps steps);
+
+}  // namespace muon
+
+#endif
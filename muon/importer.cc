@@ -0,0 +1,80 @@
+#include "muon/importer.h"
+
+#include <utility>
+
+#include "assimp/Importer.hpp"
+#include "assimp/postprocess.h"
+#include "assimp/scene.h"
+#include "glog/logging.h"
+
+namespace muon {
+
+std::vector<MeshData> ImportMeshes(const std::string &path, ImportSteps steps) {
+  std::vector<MeshData> meshes;
+  Assimp::Importer importer;
+  const aiScene *scene = importer.ReadFile(path, steps.flags);
+  if (!scene) {
+    LOG(WARNING) << "Error during load: " << importer.GetErrorString();
+    return meshes;
+  }
+  // TODO: Instead of just loading meshes without a transform, load the
+  // assimp scene's hierarchical nodes.
+  if (scene->mRootNode != nullptr) {
+    VLOG(3) << "Root node contains " << scene->mRootNode->mNumChildren
+            << " children";
+    auto &trans = scene->mRootNode->mTransformation;
+    // clang-format off
+    VLOG(3) << "Root node transform: \n"
+      << trans.a1 << " " << trans.a2 << " " << trans.a3 << " " << trans.a4 << "\n"
+      << trans.b1 << " " << trans.b2 << " " << trans.b3 << " " << trans.b4 << "\n"
+      << trans.c1 << " " << trans.c2 << " " << trans.c3 << " " << trans.c4 << "\n"
+      << trans.d1 << " " << trans.d2 << " " << trans.d3 << " " << trans.d4 << "\n";
+    // clang-format on
+  }
+  if (scene->HasMeshes()) {
+    VLOG(3) << "  Contains " << scene->mNumMeshes << " meshes";
+    for (unsigned int mesh_idx = 0; mesh_idx < scene->mNumMeshes; ++mesh_idx) {
+      const aiMesh *mesh = scene->mMeshes[mesh_idx];
+      if (mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE) {
+        LOG(WARNING) << " Skipping mesh #" << mesh_idx
+                     << " (name: " << mesh->mName.C_Str()
+                     << "), which contains non-triangular primitive types: "
+                     << mesh->mPrimitiveTypes;
+        continue;
+      }
+      if (!mesh->HasFaces()) {
+        VLOG(3) << " Skipping mesh #" << mesh_idx << " (" << mesh->mName.C_Str()
+                << "), which contains no faces";
+        continue;
+      }
+      VLOG(3) << "  Mesh #" << mesh_idx << " with " << mesh->mNumVertices
+              << " vertices and " << mesh->mNumFaces << " faces";
+
+      std::vector<glm::vec3> positions;
+      positions.reserve(mesh->mNumVertices);
+      const aiVector3D *vertices = mesh->mVertices;
+      for (unsigned int vertex_idx = 0; vertex_idx < mesh->mNumVertices;
+           ++vertex_idx) {
+        positions.emplace_back(vertices[vertex_idx].x, vertices[vertex_idx].y,
+                               vertices[vertex_idx].z);
+      }
+      std::vector<uint32_t> indices;
+      indices.reserve(3 * mesh->mNumFaces);
+      for (unsigned int tri_idx = 0; tri_idx < mesh->mNumFaces; ++tri_idx) {
+        const aiFace &face = mesh->mFaces[tri_idx];
+        if (face.mNumIndices != 3) {
+          LOG(WARNING) << "  Encountered a non-triangle face!";
+          break;
+        }
+        indices.insert(indices.end(), face.mIndices, face.mIndices + 3);
+      }
+      MeshData data;
+      data.positions = std::move(positions);
+      data.indices = std::move(indices);
+      meshes.push_back(std::move(data));
+    }
+  }
+  return meshes;
+}
+
+}  // namespace muon
@@ -0,0 +1,31 @@
+#ifndef MUON_IMPORTER_H_
+#define MUON_IMPORTER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "muon/import_steps.h"
+#include "muon/vertex.h"
+#include "third_party/glm/glm.hpp"
+
+namespace muon {
+
+// The geometry of a triangle mesh, flattened into arrays.
+struct MeshData {
+  MeshArray<glm::vec3> positions;
+  // The vertex normals, in the same order, or empty if they aren't known. These
+  // are the sums of the face normals around each vertex, as accumulated by
+  // Mesh::AddTriangle().
+  MeshArray<glm::vec3> normals;
+  // The indices of the vertices of each tri.
+  MeshArray<uint32_t> indices;
+};
+
+// Imports the triangle meshes in the given model file via Assimp, running the
+// given post-processing steps on them first.
+std::vector<MeshData> ImportMeshes(const std::string &path, ImportSteps steps);
+
+}  // namespace muon
+
+#endif
@@ -1,5 +1,9 @@
 #include "muon/integration.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
 #include <limits>
 
 #include "glog/logging.h"
@@ -18,17 +22,7 @@ glm::vec3 Integrator::Trace(const Ray &ray) {
 
 glm::vec3 Integrator::Trace(const Ray &ray, const glm::vec3 &throughput,
                             const int depth) {
-  // When Russian Roulette is enabled, we rely on it to probabilistically end
-  // paths. Currently, max_depth must be -1 when Russian Roulette is enabled in
-  // order to result in an unbiased render.
-  // TODO: Make it so that Russian Roulette ignores max_depth (if someone wants
-  // to control depth, they should disable Russian Roulette).
-  // When Next Event Estimation is active, we shorten paths by 1, since NEE
-  // effectively increases path lengths by one since it samples direct
-  // lighting.
-  if (scene_.max_depth != -1 &&
-      depth > (scene_.next_event_estimation != NEE::kOff ? scene_.max_depth - 1
-                                                         : scene_.max_depth)) {
+  if (ExceedsMaxDepth(depth)) {
     return glm::vec3(0.0f);
   }
   if (depth == 0) {
@@ -44,6 +38,41 @@ glm::vec3 Integrator::Trace(const Ray &ray, const glm::vec3 &throughput,
   return glm::vec3(0.0f);
 }
 
+void Integrator::TracePacket(const Ray *rays, int num_rays,
+                             glm::vec3 *colors) {
+  if (ExceedsMaxDepth(0)) {
+    std::fill(colors, colors + num_rays, glm::vec3(0.0f));
+    return;
+  }
+  HitRecord hits[kMaxRayPacketSize];
+  auto start_time = std::chrono::steady_clock::now();
+  scene_.root->IntersectClosestPacket(workspace_.get(), rays, num_rays, hits);
+  workspace_->stats.AddPrimaryRays(num_rays,
+                                   std::chrono::steady_clock::now() -
+                                       start_time);
+  for (int i = 0; i < num_rays; ++i) {
+    colors[i] = hits[i].primitive != nullptr
+                    ? Shade(ResolveClosestHit(rays[i], hits[i]), rays[i],
+                            /*throughput=*/glm::vec3(1.0f), /*depth=*/0)
+                    : glm::vec3(0.0f);
+  }
+}
+
+bool Integrator::ExceedsMaxDepth(const int depth) const {
+  // When Russian Roulette is enabled, we rely on it to probabilistically end
+  // paths. Currently, max_depth must be -1 when Russian Roulette is enabled in
+  // order to result in an unbiased render.
+  // TODO: Make it so that Russian Roulette ignores max_depth (if someone wants
+  // to control depth, they should disable Russian Roulette).
+  // When Next Event Estimation is active, we shorten paths by 1, since NEE
+  // effectively increases path lengths by one since it samples direct
+  // lighting.
+  return scene_.max_depth != -1 &&
+         depth > (scene_.next_event_estimation != NEE::kOff
+                      ? scene_.max_depth - 1
+                      : scene_.max_depth);
+}
+
 glm::vec3 NormalsTracer::Shade(const Intersection &hit, const Ray &ray,
                                const glm::vec3 &throughput, const int depth) {
   // Map from [-1, 1] to [0, 1].
@@ -75,6 +104,30 @@ std::unique_ptr<Integrator> DepthTracer::Clone() const {
   return absl::make_unique<DepthTracer>(*this);
 }
 
+void HeatmapTracer::TracePacket(const Ray *rays, int num_rays,
+                                glm::vec3 *colors) {
+  for (int i = 0; i < num_rays; ++i) {
+    workspace_->stats.IncrementPrimaryRays();
+    const TraceStats before = workspace_->stats;
+    HitRecord hit;
+    scene_.root->IntersectClosest(workspace_.get(), rays[i], hit);
+    const TraceStats &after = workspace_->stats;
+    float object_tests = after.object_tests() - before.object_tests();
+    float bounds_tests = after.bounds_tests() - before.bounds_tests();
+    colors[i] =
+        glm::vec3(object_tests, bounds_tests, 0.0f) / scene_.heatmap_scale;
+  }
+}
+
+glm::vec3 HeatmapTracer::Shade(const Intersection &hit, const Ray &ray,
+                               const glm::vec3 &throughput, const int depth) {
+  return glm::vec3(0.0f);
+}
+
+std::unique_ptr<Integrator> HeatmapTracer::Clone() const {
+  return absl::make_unique<HeatmapTracer>(*this);
+}
+
 glm::vec3 Raytracer::Shade(const Intersection &hit, const Ray &ray,
                            const glm::vec3 &throughput, const int depth) {
   glm::vec3 color = hit.obj->material->ambient + hit.obj->material->emission;
@@ -202,8 +255,10 @@ std::unique_ptr<Integrator> AnalyticDirect::Clone() const {
   return absl::make_unique<AnalyticDirect>(*this);
 }
 
-glm::vec3 PathTracer::Shade(const Intersection &hit, const Ray &ray,
-                            const glm::vec3 &throughput, const int depth) {
+glm::vec3 PathTracer::Shade(const Intersection &first_hit,
+                            const Ray &first_ray,
+                            const glm::vec3 &first_throughput,
+                            const int first_depth) {
   // For physically based rendering, the rendering equation defines the
   // reflected radiance:
   //   L_r(w_o) = L_e(w_o) + ∫_omega(f(w_i, w_o) * L_i(w_i) * (n • w_i) * dw_i)
@@ -238,36 +293,60 @@ glm::vec3 PathTracer::Shade(const Intersection &hit, const Ray &ray,
   // introducing bias.
   //
 
-  // Shift the collision point by an epsilon to avoid surfaces shadowing
-  // themselves.
-  glm::vec3 shift_pos = hit.pos + kEpsilon * hit.normal;
+  // The path is traced iteratively rather than recursively, carrying the
+  // current intersection and throughput from one bounce to the next, so that
+  // deep paths (e.g. with Russian Roulette) don't grow the stack.
+  glm::vec3 color(0.0f);
+  Intersection hit = first_hit;
+  Ray ray = first_ray;
+  glm::vec3 throughput = first_throughput;
+  for (int depth = first_depth;; ++depth) {
+    // Shift the collision point by an epsilon to avoid surfaces shadowing
+    // themselves.
+    glm::vec3 shift_pos = hit.pos + kEpsilon * hit.normal;
+
+    // Only accumulate indirect light if current depth is being filtered.
+    if (depth >= scene_.min_depth) {
+      color += ShadeEmission(hit, ray, throughput, depth);
+      color += ShadeDirect(hit, shift_pos, ray, throughput);
+    }
 
-  // Only return indirect light if current depth is being filtered. We only
-  // need to check min_depth since max_depth is checked in Integrator::Trace.
-  if (depth < scene_.min_depth) {
-    return ShadeIndirect(hit, shift_pos, ray, throughput, depth);
+    // Continue the path with a sampled secondary ray.
+    glm::vec3 sampled_dir;
+    glm::vec3 next_throughput;
+    if (!SampleContinuation(hit, ray, throughput, sampled_dir,
+                            next_throughput) ||
+        ExceedsMaxDepth(depth + 1)) {
+      break;
+    }
+    ray = Ray(shift_pos, sampled_dir);
+    workspace_->stats.IncrementSecondaryRays();
+    absl::optional<Intersection> next_hit =
+        scene_.root->Intersect(workspace_.get(), ray);
+    if (!next_hit) {
+      break;
+    }
+    hit = next_hit.value();
+    throughput = next_throughput;
   }
+  return color;
+}
 
+glm::vec3 PathTracer::ShadeEmission(const Intersection &hit, const Ray &ray,
+                                    const glm::vec3 &throughput,
+                                    const int depth) {
   // Only consider emission for base lighting, but take special care when we're
   // using next event estimation. Since emission from the first intersection is
   // not sampled by NEE, we accumulate it _only_ for the first intersection and
   // ignore it for subsequent depths.
   // TODO: We treat emission objects and "lights" a bit differently, and
   // probably incorrectly. Fix this.
-  glm::vec3 color;
   // TODO: Is this "reverse tri" check necessary?
   if ((scene_.next_event_estimation != NEE::kOff && depth > 0) ||
       glm::dot(hit.normal, -ray.direction()) < 0.0f) {
-    color = glm::vec3(0.0f);
-  } else {
-    color = throughput * hit.obj->material->emission;
+    return glm::vec3(0.0f);
   }
-
-  color += ShadeDirect(hit, shift_pos, ray, throughput);
-
-  color += ShadeIndirect(hit, shift_pos, ray, throughput, depth);
-
-  return color;
+  return throughput * hit.obj->material->emission;
 }
 
 glm::vec3 PathTracer::ShadeDirect(const Intersection &hit,
@@ -291,18 +370,16 @@ glm::vec3 PathTracer::ShadeDirect(const Intersection &hit,
              << static_cast<int>(scene_.next_event_estimation);
 }
 
-glm::vec3 PathTracer::ShadeIndirect(const Intersection &hit,
-                                    const glm::vec3 &shift_pos, const Ray &ray,
+bool PathTracer::SampleContinuation(const Intersection &hit, const Ray &ray,
                                     const glm::vec3 &throughput,
-                                    const int depth) {
+                                    glm::vec3 &sampled_dir,
+                                    glm::vec3 &next_throughput) {
   // Sample a reflection direction and compute its throughput.
-  glm::vec3 sampled_dir;
   float unused_pdf;
-  glm::vec3 next_throughput;
   if (!SampleReflection(hit, ray, throughput, sampled_dir, unused_pdf,
                         next_throughput)) {
-    // Early return in case the sample is below the visible hemisphere.
-    return glm::vec3(0.0f);
+    // The sample is below the visible hemisphere.
+    return false;
   }
 
   // Handle Russian Roulette.
@@ -313,18 +390,14 @@ glm::vec3 PathTracer::ShadeIndirect(const Intersection &hit,
     float continuation_probability =
         glm::min(glm::compMax(next_throughput), 1.0f);
     if (continuation_probability < rand_.Next()) {
-      return glm::vec3(0.0f);
+      return false;
     }
 
     // Add back the energy we lose by randomly terminating paths, in order to
     // remain unbiased.
     next_throughput /= continuation_probability;
   }
-
-  // Trace the sampled ray. Note that we don't multiply the result of Trace()
-  // with the new throughput, as that would apply it twice.
-  Ray sampled_ray(shift_pos, sampled_dir);
-  return Trace(sampled_ray, next_throughput, depth + 1);
+  return true;
 }
 
 // Returns the power heuristic of a PDF in comparison to another PDF.
@@ -344,125 +417,130 @@ glm::vec3 PathTracer::ShadeDirectNEE(const Intersection &hit,
 
   // Calculate direct lighting contributions.
   for (const auto &light : scene_.lights()) {
-    ShadingInfo info = light->ShadingInfoAt(hit.pos);
-    // Special case for non-area lights.
-    // TODO: I'm unconvinced that this is physically accurate...
-    if (info.area == nullptr) {
-      Ray shadow_ray(shift_pos, info.direction);
-      if (scene_.root->HasIntersection(workspace_.get(), shadow_ray,
-                                       info.distance)) {
-        // Light is occluded.
+    SampleLight(*light, hit, shift_pos, ray, mis, light_samples_);
+    glm::vec3 sample_contributions(0.0f);
+    for (const LightSample &sample : light_samples_.samples) {
+      if (scene_.root->HasIntersection(workspace_.get(), sample.shadow_ray,
+                                       sample.distance)) {
+        // Light is occluded; discard the sample.
         continue;
       }
-      glm::vec3 irradiance = info.color;
-      if (info.distance < std::numeric_limits<float>::infinity()) {
-        irradiance /= info.distance * info.distance;
-      }
-      float cos_incident_angle =
-          glm::max(glm::dot(hit.normal, info.direction), 0.0f);
-      glm::vec3 brdf_term = hit.obj->material->BRDF().Eval(
-          info.direction, ray.direction(), hit.normal);
-
-      // TODO: Does this handle MIS?
-      color += irradiance * cos_incident_angle * brdf_term;
-      continue;
+      sample_contributions += sample.contribution;
     }
+    color += light_samples_.color *
+             (sample_contributions * light_samples_.scale);
+  }
 
-    // Calculate the light's area and reverse normal, which are used in the
-    // following calculations. Note, the reverse normal is the direction _away_
-    // from which the light is emitting. We do this so that we normalize our
-    // sampling method: instead of sampling over the solid angle subtended by
-    // the light, we want to sample of the area of the light, and thus need to
-    // normalize by:
-    //   (n_l • w_i) / R^2
-    // where R is the distance between the point being shaded and the
-    // corresponding point on the light, w_i is the direction _to_ the point on
-    // the light, and thus n_l has to be the reverse normal of the light so
-    // that the result of the dot product is positive (alternatively, we could
-    // use the reverse of w_i with the normal).
-    float light_area =
-        glm::length(glm::cross(info.area->edge0, info.area->edge1));
-    glm::vec3 light_reverse_normal =
-        glm::normalize(glm::cross(info.area->edge0, info.area->edge1));
-
-    // Sum the contributions of all samples. If enabled, we subdivide the
-    // light's area via stratified sampling. Note, we assume that the number of
-    // requested samples must be a perfect square in this case, and we use this
-    // to calculate the dimensions of the strata. When stratified sampling is
-    // enabled, each section is sampled once.
-    int strata = scene_.light_stratify ? glm::sqrt(scene_.light_samples) : 1;
-    int samples_per_section = scene_.light_stratify ? 1 : scene_.light_samples;
-
-    glm::vec3 sample_contributions(0.0f);
-
-    for (int i = 0; i < strata; i++) {
-      for (int j = 0; j < strata; j++) {
-        for (int k = 0; k < samples_per_section; k++) {
-          // Generate a random sample on the surface of the light. When
-          // stratified sampling is enabled, this scales the u, v random values
-          // by the size of each strata and offsets into the current section
-          // that we're sampling from.
-          float u = rand_.Next();
-          float v = rand_.Next();
-          assert(u >= 0 && u < 1 && v >= 0 && v < 1);
-          glm::vec3 light_pos = info.area->corner +
-                                (i + u) / strata * info.area->edge0 +
-                                (j + v) / strata * info.area->edge1;
-          // Shift the light point by an epsilon to avoid being shadowed by any
-          // light-related geometry. Since we have the reverse normal, we simply
-          // subtract by it.
-          light_pos -= kEpsilon * light_reverse_normal;
-
-          glm::vec3 point_to_light = light_pos - shift_pos;
-          glm::vec3 light_dir = glm::normalize(point_to_light);
-          float light_distance = glm::length(point_to_light);
-
-          // First check to see if light is occluded.
-          Ray shadow_ray(shift_pos, light_dir);
-          if (scene_.root->HasIntersection(workspace_.get(), shadow_ray,
-                                           light_distance)) {
-            // Light is occluded; discard the sample.
-            continue;
-          }
+  return throughput * color;
+}
 
-          // Calculate the geometry term, which normalizes for the incident
-          // angle on the surface being shaded and for the emission angle from
-          // the light source.
-          float cos_incident_angle =
-              glm::max(glm::dot(hit.normal, light_dir), 0.0f);
-          float cos_light_emission_angle =
-              glm::max(glm::dot(light_reverse_normal, light_dir), 0.0f);
-          float light_distance_squared = light_distance * light_distance;
-          float geometry_term = cos_incident_angle * cos_light_emission_angle /
-                                light_distance_squared;
-
-          auto &brdf = hit.obj->material->BRDF();
-          glm::vec3 brdf_term =
-              brdf.Eval(light_dir, ray.direction(), hit.normal);
-          glm::vec3 contribution = geometry_term * brdf_term;
-
-          if (mis) {
-            // When MIS is active, weigh the light sample in comparison to the
-            // PDF of BRDF for the same sample.
-            float light_pdf = NEEPDF(shadow_ray, hit.pos);
-            float brdf_pdf = ImportanceSamplingPDF(light_dir, hit, ray, brdf);
-            float weight = PowerHeuristic(light_pdf, brdf_pdf);
-            contribution *= weight;
-          }
+void PathTracer::SampleLight(Light &light, const Intersection &hit,
+                             const glm::vec3 &shift_pos, const Ray &ray,
+                             bool mis, LightSamples &samples) {
+  samples.samples.clear();
+  ShadingInfo info = light.ShadingInfoAt(hit.pos);
+  // Special case for non-area lights, which are sampled once.
+  // TODO: I'm unconvinced that this is physically accurate...
+  if (info.area == nullptr) {
+    glm::vec3 irradiance = info.color;
+    if (info.distance < std::numeric_limits<float>::infinity()) {
+      irradiance /= info.distance * info.distance;
+    }
+    float cos_incident_angle =
+        glm::max(glm::dot(hit.normal, info.direction), 0.0f);
+    glm::vec3 brdf_term = hit.obj->material->BRDF().Eval(
+        info.direction, ray.direction(), hit.normal);
+
+    // TODO: Does this handle MIS?
+    samples.color = glm::vec3(1.0f);
+    samples.scale = 1.0f;
+    samples.samples.push_back({Ray(shift_pos, info.direction), info.distance,
+                               irradiance * cos_incident_angle * brdf_term});
+    return;
+  }
 
-          sample_contributions += contribution;
+  // Calculate the light's area and reverse normal, which are used in the
+  // following calculations. Note, the reverse normal is the direction _away_
+  // from which the light is emitting. We do this so that we normalize our
+  // sampling method: instead of sampling over the solid angle subtended by
+  // the light, we want to sample of the area of the light, and thus need to
+  // normalize by:
+  //   (n_l • w_i) / R^2
+  // where R is the distance between the point being shaded and the
+  // corresponding point on the light, w_i is the direction _to_ the point on
+  // the light, and thus n_l has to be the reverse normal of the light so
+  // that the result of the dot product is positive (alternatively, we could
+  // use the reverse of w_i with the normal).
+  float light_area =
+      glm::length(glm::cross(info.area->edge0, info.area->edge1));
+  glm::vec3 light_reverse_normal =
+      glm::normalize(glm::cross(info.area->edge0, info.area->edge1));
+
+  // Once the contributions of all unoccluded samples are summed, we must
+  // normalize by the light's area, and then we can compute the final color
+  // contribution.
+  samples.color = info.color;
+  samples.scale = light_area / scene_.light_samples;
+
+  // Take all samples. If enabled, we subdivide the light's area via
+  // stratified sampling. Note, we assume that the number of requested samples
+  // must be a perfect square in this case, and we use this to calculate the
+  // dimensions of the strata. When stratified sampling is enabled, each
+  // section is sampled once.
+  int strata = scene_.light_stratify ? glm::sqrt(scene_.light_samples) : 1;
+  int samples_per_section = scene_.light_stratify ? 1 : scene_.light_samples;
+
+  for (int i = 0; i < strata; i++) {
+    for (int j = 0; j < strata; j++) {
+      for (int k = 0; k < samples_per_section; k++) {
+        // Generate a random sample on the surface of the light. When
+        // stratified sampling is enabled, this scales the u, v random values
+        // by the size of each strata and offsets into the current section
+        // that we're sampling from.
+        float u = rand_.Next();
+        float v = rand_.Next();
+        assert(u >= 0 && u < 1 && v >= 0 && v < 1);
+        glm::vec3 light_pos = info.area->corner +
+                              (i + u) / strata * info.area->edge0 +
+                              (j + v) / strata * info.area->edge1;
+        // Shift the light point by an epsilon to avoid being shadowed by any
+        // light-related geometry. Since we have the reverse normal, we simply
+        // subtract by it.
+        light_pos -= kEpsilon * light_reverse_normal;
+
+        glm::vec3 point_to_light = light_pos - shift_pos;
+        glm::vec3 light_dir = glm::normalize(point_to_light);
+        float light_distance = glm::length(point_to_light);
+        Ray shadow_ray(shift_pos, light_dir);
+
+        // Calculate the geometry term, which normalizes for the incident
+        // angle on the surface being shaded and for the emission angle from
+        // the light source.
+        float cos_incident_angle =
+            glm::max(glm::dot(hit.normal, light_dir), 0.0f);
+        float cos_light_emission_angle =
+            glm::max(glm::dot(light_reverse_normal, light_dir), 0.0f);
+        float light_distance_squared = light_distance * light_distance;
+        float geometry_term = cos_incident_angle * cos_light_emission_angle /
+                              light_distance_squared;
+
+        auto &brdf = hit.obj->material->BRDF();
+        glm::vec3 brdf_term = brdf.Eval(light_dir, ray.direction(), hit.normal);
+        glm::vec3 contribution = geometry_term * brdf_term;
+
+        if (mis) {
+          // When MIS is active, weigh the light sample in comparison to the
+          // PDF of BRDF for the same sample.
+          float light_pdf = NEEPDF(shadow_ray, hit.pos);
+          float brdf_pdf = ImportanceSamplingPDF(light_dir, hit, ray, brdf);
+          float weight = PowerHeuristic(light_pdf, brdf_pdf);
+          contribution *= weight;
         }
+
+        samples.samples.push_back({shadow_ray, light_distance, contribution});
       }
     }
-
-    // Now we must normalize by the light's area and then we can finally
-    // compute the final color contribution.
-    sample_contributions *= light_area / scene_.light_samples;
-
-    color += info.color * sample_contributions;
   }
-
-  return throughput * color;
 }
 
 glm::vec3 PathTracer::ShadeDirectImportanceSampling(
@@ -483,21 +561,31 @@ glm::vec3 PathTracer::ShadeDirectImportanceSampling(
   workspace_->stats.IncrementSecondaryRays();
   absl::optional<Intersection> next_hit =
       scene_.root->Intersect(workspace_.get(), sampled_ray);
+  if (!next_hit) {
+    return glm::vec3(0.0f);
+  }
+  return ShadeLightHit(next_hit.value(), sampled_ray, hit.pos, brdf_pdf,
+                       next_throughput);
+}
 
-  if (next_hit && next_hit->obj->light != nullptr) {
-    ShadingInfo info = next_hit->obj->light->ShadingInfoAt(next_hit->pos);
-    if (info.area == nullptr) {
-      return glm::vec3(0.0f);
-    }
+glm::vec3 PathTracer::ShadeLightHit(const Intersection &light_hit,
+                                    const Ray &sampled_ray,
+                                    const glm::vec3 &hit_pos, float brdf_pdf,
+                                    const glm::vec3 &next_throughput) {
+  if (light_hit.obj->light == nullptr) {
+    return glm::vec3(0.0f);
+  }
+  ShadingInfo info = light_hit.obj->light->ShadingInfoAt(light_hit.pos);
+  if (info.area == nullptr) {
+    return glm::vec3(0.0f);
+  }
 
-    // We have a hit; weigh the BRDF sample in comparison to the PDF of NEE for
-    // the same sample.
-    float light_pdf = NEEPDF(sampled_ray, hit.pos);
-    float weight = PowerHeuristic(brdf_pdf, light_pdf);
+  // We have a hit; weigh the BRDF sample in comparison to the PDF of NEE for
+  // the same sample.
+  float light_pdf = NEEPDF(sampled_ray, hit_pos);
+  float weight = PowerHeuristic(brdf_pdf, light_pdf);
 
-    return next_throughput * info.color * weight;
-  }
-  return glm::vec3(0.0f);
+  return next_throughput * info.color * weight;
 }
 
 bool PathTracer::SampleReflection(const Intersection &hit, const Ray &ray,
@@ -633,4 +721,178 @@ std::unique_ptr<Integrator> PathTracer::Clone() const {
   return absl::make_unique<PathTracer>(*this);
 }
 
+namespace {
+
+// Returns the octant of a ray's direction (in the upper three bits) and of its
+// origin around `center` (in the lower three bits).
+int OctantKey(const Ray &ray, const glm::vec3 &center) {
+  glm::vec3 origin = ray.origin();
+  glm::vec3 direction = ray.direction();
+  return std::signbit(direction.x) << 5 | std::signbit(direction.y) << 4 |
+         std::signbit(direction.z) << 3 | (origin.x < center.x) << 2 |
+         (origin.y < center.y) << 1 | (origin.z < center.z);
+}
+
+// Outputs the order in which to trace the rays of the given items (which each
+// have a `ray`), so that rays with the same octant key are traced together.
+// This is a counting sort, so items with the same key keep their order.
+template <typename T>
+void SortByOctant(const std::vector<T> &items, const glm::vec3 &center,
+                  std::vector<uint32_t> &order) {
+  constexpr int kNumKeys = 64;
+  std::array<uint32_t, kNumKeys> offsets = {};
+  for (const T &item : items) {
+    ++offsets[OctantKey(item.ray, center)];
+  }
+  uint32_t offset = 0;
+  for (uint32_t &count : offsets) {
+    uint32_t start = offset;
+    offset += count;
+    count = start;
+  }
+  order.resize(items.size());
+  for (uint32_t i = 0; i < items.size(); ++i) {
+    order[offsets[OctantKey(items[i].ray, center)]++] = i;
+  }
+}
+
+}  // namespace
+
+void WavefrontPathTracer::Init() {
+  PathTracer::Init();
+  Bounds bounds = scene_.root->WorldBounds();
+  center_ = bounds.IsEmpty() ? glm::vec3(0.0f)
+                             : 0.5f * (bounds.min_pos + bounds.max_pos);
+}
+
+void WavefrontPathTracer::TracePacket(const Ray *rays, int num_rays,
+                                      glm::vec3 *colors) {
+  std::fill(colors, colors + num_rays, glm::vec3(0.0f));
+  paths_.clear();
+  for (int i = 0; i < num_rays; ++i) {
+    paths_.push_back({rays[i], glm::vec3(1.0f), i});
+  }
+
+  // All paths are at the same depth, since they're extended together. Paths
+  // that end are simply dropped, since their contributions are added to the
+  // colors as they're found.
+  for (int depth = 0; !paths_.empty() && !ExceedsMaxDepth(depth); ++depth) {
+    IntersectPaths(depth);
+    next_paths_.clear();
+    shadow_rays_.clear();
+    light_probes_.clear();
+    ShadePaths(depth, colors);
+    TraceShadowRays(colors);
+    TraceLightProbes(colors);
+    paths_.swap(next_paths_);
+  }
+}
+
+void WavefrontPathTracer::IntersectPaths(const int depth) {
+  SortByOctant(paths_, center_, order_);
+  rays_.clear();
+  for (uint32_t i : order_) {
+    rays_.push_back(paths_[i].ray);
+  }
+  hits_.assign(rays_.size(), HitRecord());
+
+  // Rays that are sorted next to each other are likely to have the same
+  // direction signs, and so can be traced as a packet.
+  auto start_time = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rays_.size(); i += kMaxRayPacketSize) {
+    int num_rays = std::min<size_t>(kMaxRayPacketSize, rays_.size() - i);
+    scene_.root->IntersectClosestPacket(workspace_.get(), &rays_[i], num_rays,
+                                        &hits_[i]);
+  }
+  if (depth == 0) {
+    workspace_->stats.AddPrimaryRays(rays_.size(),
+                                     std::chrono::steady_clock::now() -
+                                         start_time);
+  } else {
+    workspace_->stats.IncrementSecondaryRays(rays_.size());
+  }
+}
+
+void WavefrontPathTracer::ShadePaths(const int depth, glm::vec3 *colors) {
+  // This follows PathTracer::Shade(), except that rays are queued rather than
+  // traced right away.
+  for (size_t i = 0; i < order_.size(); ++i) {
+    if (hits_[i].primitive == nullptr) {
+      continue;
+    }
+    const PathState &path = paths_[order_[i]];
+    Intersection hit = ResolveClosestHit(path.ray, hits_[i]);
+    glm::vec3 shift_pos = hit.pos + kEpsilon * hit.normal;
+
+    if (depth >= scene_.min_depth) {
+      colors[path.sample] +=
+          ShadeEmission(hit, path.ray, path.throughput, depth);
+
+      if (scene_.next_event_estimation != NEE::kOff) {
+        bool mis = scene_.next_event_estimation == NEE::kMIS;
+        for (const auto &light : scene_.lights()) {
+          SampleLight(*light, hit, shift_pos, path.ray, mis, light_samples_);
+          for (const LightSample &sample : light_samples_.samples) {
+            glm::vec3 contribution =
+                path.throughput *
+                (light_samples_.color *
+                 (sample.contribution * light_samples_.scale));
+            shadow_rays_.push_back({sample.shadow_ray, sample.distance,
+                                    contribution, path.sample});
+          }
+        }
+      }
+
+      if (scene_.next_event_estimation == NEE::kMIS) {
+        glm::vec3 sampled_dir;
+        float brdf_pdf;
+        glm::vec3 next_throughput;
+        if (SampleReflection(hit, path.ray, path.throughput, sampled_dir,
+                             brdf_pdf, next_throughput)) {
+          light_probes_.push_back({Ray(shift_pos, sampled_dir), hit.pos,
+                                   brdf_pdf, next_throughput, path.sample});
+        }
+      }
+    }
+
+    glm::vec3 sampled_dir;
+    glm::vec3 next_throughput;
+    if (SampleContinuation(hit, path.ray, path.throughput, sampled_dir,
+                           next_throughput)) {
+      next_paths_.push_back(
+          {Ray(shift_pos, sampled_dir), next_throughput, path.sample});
+    }
+  }
+}
+
+void WavefrontPathTracer::TraceShadowRays(glm::vec3 *colors) {
+  SortByOctant(shadow_rays_, center_, order_);
+  for (uint32_t i : order_) {
+    const ShadowRay &shadow_ray = shadow_rays_[i];
+    if (!scene_.root->HasIntersection(workspace_.get(), shadow_ray.ray,
+                                      shadow_ray.distance)) {
+      colors[shadow_ray.sample] += shadow_ray.contribution;
+    }
+  }
+}
+
+void WavefrontPathTracer::TraceLightProbes(glm::vec3 *colors) {
+  SortByOctant(light_probes_, center_, order_);
+  for (uint32_t i : order_) {
+    const LightProbe &probe = light_probes_[i];
+    workspace_->stats.IncrementSecondaryRays();
+    absl::optional<Intersection> light_hit =
+        scene_.root->Intersect(workspace_.get(), probe.ray);
+    if (light_hit) {
+      colors[probe.sample] += ShadeLightHit(light_hit.value(), probe.ray,
+                                            probe.hit_pos, probe.brdf_pdf,
+                                            probe.throughput);
+    }
+  }
+}
+
+std::unique_ptr<Integrator> WavefrontPathTracer::Clone() const {
+  return absl::make_unique<WavefrontPathTracer>(*this);
+}
+
 }  // namespace muon
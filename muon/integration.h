@@ -3,10 +3,13 @@
 
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "muon/acceleration.h"
 #include "muon/camera.h"
+#include "muon/lighting.h"
 #include "muon/random.h"
+#include "muon/ray_packet.h"
 #include "muon/scene.h"
 #include "muon/stats.h"
 #include "third_party/glm/glm.hpp"
@@ -32,6 +35,15 @@ class Integrator {
   // Traces a ray against the scene and returns a traced color.
   glm::vec3 Trace(const Ray &ray);
   glm::vec3 Trace(const Ray &ray, const glm::vec3 &throughput, const int depth);
+  // Traces `num_rays` camera rays, of which there may be at most
+  // BatchSize(kMaxRayPacketSize), and outputs their colors. This is the same
+  // as calling Trace() on each ray, except that the rays are intersected with
+  // the scene together first, which is faster for coherent rays.
+  virtual void TracePacket(const Ray *rays, int num_rays, glm::vec3 *colors);
+
+  // Returns the number of camera rays to pass to TracePacket() at once, given
+  // the requested number of rays to intersect together as a packet.
+  virtual size_t BatchSize(size_t packet_size) const { return packet_size; }
 
   TraceStats trace_stats() { return workspace_->stats; }
 
@@ -44,6 +56,9 @@ class Integrator {
   virtual glm::vec3 Shade(const Intersection &hit, const Ray &ray,
                           const glm::vec3 &throughput, const int depth) = 0;
 
+  // Returns whether paths are cut off before reaching the given depth.
+  bool ExceedsMaxDepth(const int depth) const;
+
   Scene &scene_;
   std::unique_ptr<acceleration::Workspace> workspace_;
 };
@@ -87,6 +102,27 @@ class DepthTracer : public Integrator {
                           const int depth) override;
 };
 
+// A debug integrator that renders the cost of intersecting each camera ray
+// with the acceleration structure, as a heatmap. The red channel shows the
+// number of primitives tested, and the green channel the number of bounds
+// tested (i.e. node visits), both relative to the scene's heatmap_scale.
+class HeatmapTracer : public Integrator {
+ public:
+  HeatmapTracer(const HeatmapTracer &other) : Integrator(other) {}
+  explicit HeatmapTracer(Scene &scene) : Integrator(scene) {}
+  virtual std::unique_ptr<Integrator> Clone() const override;
+
+  // Traces each ray on its own rather than as a packet, so that the costs are
+  // those of a single ray.
+  void TracePacket(const Ray *rays, int num_rays, glm::vec3 *colors) override;
+
+ protected:
+  // Unused, since the cost of a ray is known only after intersecting it.
+  virtual glm::vec3 Shade(const Intersection &hit, const Ray &ray,
+                          const glm::vec3 &throughput,
+                          const int depth) override;
+};
+
 // A simple, non-physically-based integrator that approximates the rendering
 // equation by tracing rays directly and shading using a simple Phong lighting
 // model.
@@ -117,6 +153,24 @@ class AnalyticDirect : public Integrator {
                           const int depth) override;
 };
 
+// A sample of a light taken via next event estimation, which only contributes
+// if the light is visible along its shadow ray.
+struct LightSample {
+  Ray shadow_ray;
+  // The distance to the sampled point on the light.
+  float distance;
+  glm::vec3 contribution;
+};
+
+// The samples of a single light taken at an intersection. The light's
+// contribution is `color * (sum * scale)`, where `sum` is the total
+// contribution of the unoccluded samples.
+struct LightSamples {
+  glm::vec3 color;
+  float scale;
+  std::vector<LightSample> samples;
+};
+
 // A Monte Carlo based path tracer that handles global illumination.
 class PathTracer : public Integrator {
  public:
@@ -130,12 +184,47 @@ class PathTracer : public Integrator {
                           const glm::vec3 &throughput,
                           const int depth) override;
 
- private:
-  // Shades an intersection with only the indirect light contribution.
-  glm::vec3 ShadeIndirect(const Intersection &hit, const glm::vec3 &shift_pos,
-                          const Ray &ray, const glm::vec3 &throughput,
-                          const int depth);
+  // The stages of shading an intersection, which are exposed separately so
+  // that they can be interleaved with tracing other paths (see
+  // WavefrontPathTracer).
+
+  // Returns the emitted light of an intersection that counts toward the path.
+  glm::vec3 ShadeEmission(const Intersection &hit, const Ray &ray,
+                          const glm::vec3 &throughput, const int depth);
+
+  // Samples a light via next event estimation, for shading an intersection.
+  // Outputs the samples, whose shadow rays are left to the caller to trace.
+  // Optionally weighs each sample via multiple importance sampling.
+  void SampleLight(Light &light, const Intersection &hit,
+                   const glm::vec3 &shift_pos, const Ray &ray, bool mis,
+                   LightSamples &samples);
+
+  // Returns the contribution of a light hit by a ray sampled from the BRDF
+  // at `hit_pos`, weighed via multiple importance sampling against NEE. See
+  // ShadeDirectImportanceSampling().
+  glm::vec3 ShadeLightHit(const Intersection &light_hit, const Ray &sampled_ray,
+                          const glm::vec3 &hit_pos, float brdf_pdf,
+                          const glm::vec3 &next_throughput);
+
+  // Samples the direction in which to continue the path from an intersection,
+  // outputting it along with the path's next throughput. Returns false if the
+  // path ends instead, either because the sample is invalid or due to Russian
+  // Roulette.
+  bool SampleContinuation(const Intersection &hit, const Ray &ray,
+                          const glm::vec3 &throughput, glm::vec3 &sampled_dir,
+                          glm::vec3 &next_throughput);
+
+  // Samples a reflected ray, outputting its direction, pdf, and computed BRDF
+  // throughput (taking into account current throughput). Returns a boolean
+  // indicating if the sample is valid (e.g. above the horizon).
+  bool SampleReflection(const Intersection &hit, const Ray &ray,
+                        const glm::vec3 &throughput, glm::vec3 &sampled_dir,
+                        float &pdf, glm::vec3 &next_throughput);
 
+  // Scratch space for light samples.
+  LightSamples light_samples_;
+
+ private:
   // Shades an intersection with only direct light contribution.
   glm::vec3 ShadeDirect(const Intersection &hit, const glm::vec3 &shift_pos,
                         const Ray &ray, const glm::vec3 &throughput);
@@ -154,13 +243,6 @@ class PathTracer : public Integrator {
                                           const Ray &ray,
                                           const glm::vec3 &throughput);
 
-  // Samples a reflected ray, outputting its direction, pdf, and computed BRDF
-  // throughput (taking into account current throughput). Returns a boolean
-  // indicating if the sample is valid (e.g. above the horizon).
-  bool SampleReflection(const Intersection &hit, const Ray &ray,
-                        const glm::vec3 &throughput, glm::vec3 &sampled_dir,
-                        float &pdf, glm::vec3 &next_throughput);
-
   // Computes the combined PDF of all lights for a given sample direction.
   // TODO: This should be part of the lighting system instead.
   float NEEPDF(const Ray &sampled_ray, const glm::vec3 &hit_pos);
@@ -175,6 +257,90 @@ class PathTracer : public Integrator {
   UniformRandom rand_;
 };
 
+// The number of paths that WavefrontPathTracer traces at once.
+constexpr size_t kWavefrontSize = 4096;
+
+// A path tracer that traces a large batch of paths at once, in wavefront
+// order: instead of following each path to its end before starting the next,
+// all paths are extended one bounce at a time. Each bounce runs as separate
+// stages that intersect the paths' rays, shade the hits, and trace the shadow
+// rays generated by the shading, so each stage stays in the same code and
+// touches similar scene data. Before each stage, the rays are sorted by the
+// octants of their directions and origins, so that similar rays are traced
+// together (and in packets, where possible).
+//
+// The result matches PathTracer statistically, but not exactly, since random
+// numbers are drawn in a different order.
+class WavefrontPathTracer : public PathTracer {
+ public:
+  WavefrontPathTracer(const WavefrontPathTracer &other) : PathTracer(other) {}
+  explicit WavefrontPathTracer(Scene &scene, unsigned int random_seed)
+      : PathTracer(scene, random_seed) {}
+  virtual std::unique_ptr<Integrator> Clone() const override;
+
+  void Init() override;
+
+  void TracePacket(const Ray *rays, int num_rays, glm::vec3 *colors) override;
+
+  size_t BatchSize(size_t packet_size) const override {
+    return kWavefrontSize;
+  }
+
+ private:
+  // A path that's still being traced, along with the camera sample that it
+  // contributes to.
+  struct PathState {
+    Ray ray;
+    glm::vec3 throughput;
+    int sample;
+  };
+
+  // A shadow ray for a light sample, whose contribution (including the path's
+  // throughput) counts toward the sample if it's unoccluded.
+  struct ShadowRay {
+    Ray ray;
+    float distance;
+    glm::vec3 contribution;
+    int sample;
+  };
+
+  // A ray sampled from the BRDF for multiple importance sampling, which counts
+  // toward the sample if it hits a light. See ShadeLightHit().
+  struct LightProbe {
+    Ray ray;
+    glm::vec3 hit_pos;
+    float brdf_pdf;
+    glm::vec3 throughput;
+    int sample;
+  };
+
+  // Intersects the rays of all paths with the scene, outputting the hits into
+  // hits_, in the order given by order_.
+  void IntersectPaths(const int depth);
+  // Shades the hits of all paths, adding their emission to `colors` and
+  // queueing shadow rays and light probes. The paths that continue are added
+  // to next_paths_.
+  void ShadePaths(const int depth, glm::vec3 *colors);
+  // Traces the queued shadow rays and light probes, adding the contributions
+  // of those that reach lights to `colors`.
+  void TraceShadowRays(glm::vec3 *colors);
+  void TraceLightProbes(glm::vec3 *colors);
+
+  // The center of the scene, used to sort rays by the octant of their origin.
+  glm::vec3 center_;
+
+  // Scratch space for each stage, reused between batches.
+  std::vector<PathState> paths_;
+  std::vector<PathState> next_paths_;
+  std::vector<ShadowRay> shadow_rays_;
+  std::vector<LightProbe> light_probes_;
+  // The order in which to trace the items of the current stage.
+  std::vector<uint32_t> order_;
+  // The rays of the current paths in sorted order, and their hits.
+  std::vector<Ray> rays_;
+  std::vector<HitRecord> hits_;
+};
+
 }  // namespace muon
 
 #endif
@@ -0,0 +1,31 @@
+#include "muon/mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace muon {
+
+std::shared_ptr<const MappedFile> MappedFile::Open(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  // The mapping stays valid after closing the file.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  return std::shared_ptr<const MappedFile>(
+      new MappedFile(static_cast<const char *>(data), st.st_size));
+}
+
+MappedFile::~MappedFile() { munmap(const_cast<char *>(data_), size_); }
+
+}  // namespace muon
@@ -0,0 +1,35 @@
+#ifndef MUON_MAPPED_FILE_H_
+#define MUON_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace muon {
+
+// A whole file, memory-mapped read-only, so that only the parts that are
+// accessed get paged in. Data can be used straight out of the mapping for as
+// long as it's kept alive.
+class MappedFile {
+ public:
+  // Maps the file at the given path. Returns null if it doesn't exist or can't
+  // be mapped, e.g. because it's empty.
+  static std::shared_ptr<const MappedFile> Open(const std::string &path);
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const char *data, size_t size) : data_(data), size_(size) {}
+
+  const char *data_;
+  size_t size_;
+};
+
+}  // namespace muon
+
+#endif
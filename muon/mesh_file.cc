@@ -0,0 +1,163 @@
+#include "muon/mesh_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <utility>
+
+#include "glog/logging.h"
+#include "muon/mapped_file.h"
+
+namespace muon {
+namespace {
+
+// Identifies native mesh files ("MUONMESH").
+constexpr uint64_t kMagic = 0x4853454d4e4f554dull;
+// The version of the format. Bump this whenever the layout changes.
+constexpr uint32_t kVersion = 1;
+// The alignment of the arrays within the file.
+constexpr uint64_t kAlignment = 64;
+
+struct Header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t num_meshes;
+};
+
+// An entry in the table of meshes that follows the header. Offsets are from
+// the start of the file. Meshes without normals have a normals offset of 0.
+struct MeshEntry {
+  uint64_t num_vertices;
+  uint64_t num_indices;
+  uint64_t positions_offset;
+  uint64_t normals_offset;
+  uint64_t indices_offset;
+};
+
+uint64_t Align(uint64_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// Returns an array of `size` elements at the given offset of the file, or
+// false if they don't fit within it.
+template <typename T>
+bool MapArray(const std::shared_ptr<const MappedFile> &file, uint64_t offset,
+              uint64_t size, MeshArray<T> &array) {
+  if (offset % alignof(T) != 0 || offset > file->size() ||
+      size > (file->size() - offset) / sizeof(T)) {
+    return false;
+  }
+  array = MeshArray<T>(reinterpret_cast<const T *>(file->data() + offset),
+                       size, file);
+  return true;
+}
+
+}  // namespace
+
+bool IsMeshFile(const std::string &path) {
+  return std::filesystem::path(path).extension() == kMeshFileExtension;
+}
+
+bool WriteMeshFile(const std::string &path,
+                   const std::vector<MeshData> &meshes) {
+  std::vector<MeshEntry> entries;
+  uint64_t offset = sizeof(Header) + meshes.size() * sizeof(MeshEntry);
+  for (const MeshData &mesh : meshes) {
+    MeshEntry entry = {};
+    entry.num_vertices = mesh.positions.size();
+    entry.num_indices = mesh.indices.size();
+    entry.positions_offset = offset = Align(offset);
+    offset += mesh.positions.size() * sizeof(glm::vec3);
+    if (!mesh.normals.empty()) {
+      CHECK_EQ(mesh.normals.size(), mesh.positions.size());
+      entry.normals_offset = offset = Align(offset);
+      offset += mesh.normals.size() * sizeof(glm::vec3);
+    }
+    entry.indices_offset = offset = Align(offset);
+    offset += mesh.indices.size() * sizeof(uint32_t);
+    entries.push_back(entry);
+  }
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  uint64_t written = 0;
+  auto write = [&file, &written](const void *data, uint64_t size) {
+    file.write(static_cast<const char *>(data), size);
+    written += size;
+  };
+  auto pad_to = [&file, &written](uint64_t offset) {
+    static const char kZeros[kAlignment] = {};
+    file.write(kZeros, offset - written);
+    written = offset;
+  };
+  Header header = {kMagic, kVersion, uint32_t(meshes.size())};
+  write(&header, sizeof(header));
+  write(entries.data(), entries.size() * sizeof(MeshEntry));
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    const MeshData &mesh = meshes[i];
+    const MeshEntry &entry = entries[i];
+    pad_to(entry.positions_offset);
+    write(mesh.positions.data(), mesh.positions.size() * sizeof(glm::vec3));
+    if (entry.normals_offset != 0) {
+      pad_to(entry.normals_offset);
+      write(mesh.normals.data(), mesh.normals.size() * sizeof(glm::vec3));
+    }
+    pad_to(entry.indices_offset);
+    write(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+  }
+  file.close();
+  if (!file) {
+    LOG(WARNING) << "Failed to write mesh file: " << path;
+    return false;
+  }
+  return true;
+}
+
+bool ReadMeshFile(const std::string &path, std::vector<MeshData> &meshes) {
+  meshes.clear();
+  std::shared_ptr<const MappedFile> file = MappedFile::Open(path);
+  if (file == nullptr) {
+    LOG(WARNING) << "Failed to read mesh file: " << path;
+    return false;
+  }
+  Header header;
+  if (file->size() < sizeof(Header)) {
+    LOG(WARNING) << "Invalid mesh file: " << path;
+    return false;
+  }
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (header.magic != kMagic || header.version != kVersion ||
+      header.num_meshes >
+          (file->size() - sizeof(Header)) / sizeof(MeshEntry)) {
+    LOG(WARNING) << "Invalid mesh file: " << path;
+    return false;
+  }
+  for (uint32_t i = 0; i < header.num_meshes; ++i) {
+    MeshEntry entry;
+    std::memcpy(&entry, file->data() + sizeof(Header) + i * sizeof(MeshEntry),
+                sizeof(entry));
+    MeshData mesh;
+    bool ok = entry.num_vertices <= UINT32_MAX &&
+              entry.num_indices % 3 == 0 &&
+              MapArray(file, entry.positions_offset, entry.num_vertices,
+                       mesh.positions) &&
+              (entry.normals_offset == 0 ||
+               MapArray(file, entry.normals_offset, entry.num_vertices,
+                        mesh.normals)) &&
+              MapArray(file, entry.indices_offset, entry.num_indices,
+                       mesh.indices);
+    for (uint32_t index : mesh.indices) {
+      ok = ok && index < entry.num_vertices;
+    }
+    if (!ok) {
+      LOG(WARNING) << "Invalid mesh file: " << path;
+      meshes.clear();
+      return false;
+    }
+    meshes.push_back(std::move(mesh));
+  }
+  return true;
+}
+
+}  // namespace muon
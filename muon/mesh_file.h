@@ -0,0 +1,36 @@
+#ifndef MUON_MESH_FILE_H_
+#define MUON_MESH_FILE_H_
+
+#include <string>
+#include <vector>
+
+#include "muon/importer.h"
+
+namespace muon {
+
+// Muon's native binary mesh format. A header and a table of the meshes in the
+// file are followed by each mesh's positions, normals and vertex indices, as
+// contiguous arrays in the layout they have in memory (native endianness).
+// Files are memory-mapped when loaded, and meshes use the arrays in place,
+// so that loading them does no parsing or copying. Files are produced from
+// any model Assimp can import by the meshconv tool.
+
+// The extension of native mesh files.
+constexpr char kMeshFileExtension[] = ".muonmesh";
+
+// Returns whether the file at the given path is a native mesh file, judging by
+// its extension.
+bool IsMeshFile(const std::string &path);
+
+// Writes the given meshes to a native mesh file. Returns false on failure.
+bool WriteMeshFile(const std::string &path,
+                   const std::vector<MeshData> &meshes);
+
+// Maps the native mesh file at the given path, and returns its meshes, whose
+// arrays refer to the mapping and keep it alive. Returns false if the file
+// can't be read or is invalid, e.g. if tris refer to vertices that don't exist.
+bool ReadMeshFile(const std::string &path, std::vector<MeshData> &meshes);
+
+}  // namespace muon
+
+#endif
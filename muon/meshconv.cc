@@ -0,0 +1,78 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "glog/logging.h"
+#include "muon/import_steps.h"
+#include "muon/importer.h"
+#include "muon/mesh_file.h"
+#include "muon/objects.h"
+#include "muon/vertex.h"
+
+ABSL_FLAG(std::string, input, "", "Path to a model that Assimp can import");
+ABSL_FLAG(std::string, output, "",
+          "Path to the native mesh file (.muonmesh) to write");
+ABSL_FLAG(muon::ImportSteps, import_steps, muon::DefaultImportSteps(),
+          "The comma-separated Assimp post-processing steps to run on the "
+          "model, as for muon's flag of the same name");
+ABSL_FLAG(bool, vertex_normals, true,
+          "Whether to store vertex normals, which are used by scenes with "
+          "compute_vertex_normals on instead of computing them when loading");
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+
+  absl::SetProgramUsageMessage(
+      "Converts models into muon's native mesh format. Usage:\n"
+      "  meshconv --input path/to/model.obj --output path/to/model.muonmesh");
+  absl::ParseCommandLine(argc, argv);
+
+  std::string input = absl::GetFlag(FLAGS_input);
+  std::string output = absl::GetFlag(FLAGS_output);
+  if (input.empty() || output.empty()) {
+    LOG(ERROR) << "An input and an output are required";
+    return 1;
+  }
+  if (!muon::IsMeshFile(output)) {
+    LOG(ERROR) << "The output must have the extension "
+               << muon::kMeshFileExtension;
+    return 1;
+  }
+
+  std::vector<muon::MeshData> meshes =
+      muon::ImportMeshes(input, absl::GetFlag(FLAGS_import_steps));
+  if (meshes.empty()) {
+    LOG(ERROR) << "No triangle meshes found in " << input;
+    return 1;
+  }
+  size_t num_tris = 0;
+  for (muon::MeshData &mesh : meshes) {
+    num_tris += mesh.indices.size() / 3;
+    if (!absl::GetFlag(FLAGS_vertex_normals)) {
+      continue;
+    }
+    // Compute the normals exactly as they'd be computed when loading the
+    // model, by adding the tris to a mesh.
+    auto vertices = std::make_shared<muon::MeshVertices>();
+    vertices->positions = std::move(mesh.positions);
+    vertices->normals.assign(vertices->positions.size(), glm::vec3(0.0f));
+    muon::Mesh tris(vertices, true);
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+      tris.AddTriangle(mesh.indices[i], mesh.indices[i + 1],
+                       mesh.indices[i + 2]);
+    }
+    mesh.positions = std::move(vertices->positions);
+    mesh.normals = std::move(vertices->normals);
+  }
+  if (!muon::WriteMeshFile(output, meshes)) {
+    return 1;
+  }
+  std::cout << "Wrote " << meshes.size() << " meshes with " << num_tris
+            << " tris to " << output << std::endl;
+  return 0;
+}
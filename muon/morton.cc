@@ -0,0 +1,103 @@
+#include "muon/morton.h"
+
+#include <algorithm>
+#include <array>
+
+#include "muon/parallel.h"
+
+namespace muon {
+
+namespace {
+
+// Spreads out the lower 21 bits of v so that there are two zero bits between
+// each of them.
+uint64_t LeftShift3(uint64_t v) {
+  v &= (1ull << kMortonBitsPerAxis) - 1;
+  v = (v | v << 32) & 0x001f00000000ffffull;
+  v = (v | v << 16) & 0x001f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+// Quantizes a coordinate in [0, 1] to an integer in [0, 2^21).
+uint64_t Quantize(float x) {
+  constexpr float kScale = 1 << kMortonBitsPerAxis;
+  constexpr uint64_t kMax = (1ull << kMortonBitsPerAxis) - 1;
+  // Guard against NaNs and coordinates slightly outside of [0, 1].
+  if (!(x > 0.0f)) {
+    return 0;
+  }
+  return std::min(static_cast<uint64_t>(x * kScale), kMax);
+}
+
+// The number of bits sorted in each radix sort pass.
+constexpr int kRadixBits = 11;
+constexpr int kRadixBuckets = 1 << kRadixBits;
+constexpr int kRadixPasses = (kMortonBits + kRadixBits - 1) / kRadixBits;
+
+}  // namespace
+
+uint64_t EncodeMorton3(const glm::vec3 &p) {
+  return (LeftShift3(Quantize(p.x)) << 2) | (LeftShift3(Quantize(p.y)) << 1) |
+         LeftShift3(Quantize(p.z));
+}
+
+void RadixSort(std::vector<MortonPrimitive> &primitives, int num_threads) {
+  num_threads = std::max(num_threads, 1);
+  std::vector<MortonPrimitive> temp(primitives.size());
+  std::vector<MortonPrimitive> *in = &primitives;
+  std::vector<MortonPrimitive> *out = &temp;
+  // The per-thread bucket counts, which are then converted into per-thread
+  // output offsets.
+  std::vector<std::array<size_t, kRadixBuckets>> offsets(num_threads);
+
+  for (int pass = 0; pass < kRadixPasses; ++pass) {
+    const int shift = pass * kRadixBits;
+    auto digit = [shift](const MortonPrimitive &p) {
+      return (p.code >> shift) & (kRadixBuckets - 1);
+    };
+
+    // Count the primitives in each bucket, per thread.
+    ParallelForChunks(in->size(), num_threads,
+                      [&](int chunk, size_t start, size_t end) {
+                        std::array<size_t, kRadixBuckets> &counts =
+                            offsets[chunk];
+                        counts.fill(0);
+                        for (size_t i = start; i < end; ++i) {
+                          ++counts[digit((*in)[i])];
+                        }
+                      });
+
+    // Compute where each thread starts writing each bucket. Buckets are laid
+    // out in order, and within each bucket the threads' chunks are laid out
+    // in order, which keeps the sort stable.
+    size_t offset = 0;
+    for (int bucket = 0; bucket < kRadixBuckets; ++bucket) {
+      for (int chunk = 0; chunk < num_threads; ++chunk) {
+        size_t count = offsets[chunk][bucket];
+        offsets[chunk][bucket] = offset;
+        offset += count;
+      }
+    }
+
+    // Scatter the primitives into their buckets.
+    ParallelForChunks(in->size(), num_threads,
+                      [&](int chunk, size_t start, size_t end) {
+                        std::array<size_t, kRadixBuckets> &next =
+                            offsets[chunk];
+                        for (size_t i = start; i < end; ++i) {
+                          const MortonPrimitive &p = (*in)[i];
+                          (*out)[next[digit(p)]++] = p;
+                        }
+                      });
+    std::swap(in, out);
+  }
+
+  if (in != &primitives) {
+    primitives.swap(*in);
+  }
+}
+
+}  // namespace muon
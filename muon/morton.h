@@ -0,0 +1,35 @@
+#ifndef MUON_MORTON_H_
+#define MUON_MORTON_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "third_party/glm/glm.hpp"
+
+namespace muon {
+
+// The number of bits used to quantize each axis when computing Morton codes.
+// Three axes of 21 bits each make for 63-bit codes.
+constexpr int kMortonBitsPerAxis = 21;
+constexpr int kMortonBits = 3 * kMortonBitsPerAxis;
+
+// Returns the 63-bit Morton code (i.e. position along a Z-order curve) of a
+// point whose coordinates are each in the range [0, 1]. Bits are interleaved
+// in x, y, z order from the most significant bit, so bit i of the code comes
+// from the axis 2 - (i % 3).
+uint64_t EncodeMorton3(const glm::vec3 &p);
+
+// A primitive's Morton code, along with the primitive's index.
+struct MortonPrimitive {
+  uint64_t code;
+  uint32_t index;
+};
+
+// Stably sorts the primitives by Morton code via an LSD radix sort. Each pass
+// is split across `num_threads` threads; the result does not depend on the
+// number of threads.
+void RadixSort(std::vector<MortonPrimitive> &primitives, int num_threads);
+
+}  // namespace muon
+
+#endif
@@ -6,6 +6,7 @@
 #include "absl/flags/usage.h"
 #include "glog/logging.h"
 #include "muon/acceleration_type.h"
+#include "muon/import_steps.h"
 #include "muon/options.h"
 #include "muon/renderer.h"
 
@@ -16,9 +17,46 @@ ABSL_FLAG(muon::AccelerationType, acceleration, muon::AccelerationType::kBVH,
 ABSL_FLAG(muon::PartitionStrategy, partition_strategy,
           muon::PartitionStrategy::kSAH,
           "The strategy when partitioning primitives in a BVH");
+ABSL_FLAG(bool, sah_all_axes, false,
+          "Whether the SAH BVH partition strategy should consider splits along "
+          "all axes, rather than only the widest axis");
+ABSL_FLAG(float, sah_traversal_cost, 0.125f,
+          "The SAH cost of traversing a BVH node, relative to the "
+          "intersection cost");
+ABSL_FLAG(float, sah_intersection_cost, 1.0f,
+          "The SAH cost of intersecting a ray with a primitive");
+ABSL_FLAG(uint32_t, max_leaf_primitives, 255,
+          "The maximum number of primitives in each BVH leaf");
+ABSL_FLAG(float, sbvh_duplication_budget, 0.3f,
+          "For the sbvh partition strategy, the maximum number of duplicate "
+          "primitive references, as a fraction of the number of primitives");
+ABSL_FLAG(float, refit_rebuild_threshold, 1.5f,
+          "When rendering several frames, the factor by which refitting a BVH "
+          "to the moved primitives may increase its SAH cost before it is "
+          "rebuilt instead");
+ABSL_FLAG(bool, pretransform_tris, false,
+          "Whether to transform tris into world coordinates once before "
+          "rendering, rather than transforming each ray that is tested "
+          "against them. This is faster, but rounds differently, so renders "
+          "may differ slightly at seams and silhouettes");
+ABSL_FLAG(uint32_t, ray_packet_size, 16,
+          "The number of camera rays to trace together as a packet, up to 16; "
+          "1 traces each ray individually");
 ABSL_FLAG(uint32_t, parallelism, 1,
-          "The number of parallel threads to use when rendering");
+          "The number of parallel threads to use when building the "
+          "acceleration structure and rendering");
+ABSL_FLAG(muon::ImportSteps, import_steps, muon::DefaultImportSteps(),
+          "The comma-separated Assimp post-processing steps to run on loaded "
+          "models, e.g. \"max_quality,-calc_tangent_space\"; see "
+          "import_steps.h");
 ABSL_FLAG(bool, stats, true, "Whether to show stats after rendering");
+ABSL_FLAG(bool, bvh_report, false,
+          "Whether to show the SAH cost, node overlap, and leaf depth and size "
+          "histograms of the BVH after building it");
+ABSL_FLAG(std::string, scene_cache_dir, "",
+          "A directory in which to cache loaded meshes and built acceleration "
+          "structures, so that later runs over the same geometry skip "
+          "rebuilding them; disabled if empty");
 
 int main(int argc, char **argv) {
   // Initialize Google logging framework. absl doesn't yet have a logging
@@ -41,8 +79,19 @@ int main(int argc, char **argv) {
       .output = absl::GetFlag(FLAGS_output),
       .acceleration = absl::GetFlag(FLAGS_acceleration),
       .partition_strategy = absl::GetFlag(FLAGS_partition_strategy),
+      .sah_all_axes = absl::GetFlag(FLAGS_sah_all_axes),
+      .sah_traversal_cost = absl::GetFlag(FLAGS_sah_traversal_cost),
+      .sah_intersection_cost = absl::GetFlag(FLAGS_sah_intersection_cost),
+      .max_leaf_primitives = absl::GetFlag(FLAGS_max_leaf_primitives),
+      .sbvh_duplication_budget = absl::GetFlag(FLAGS_sbvh_duplication_budget),
+      .refit_rebuild_threshold = absl::GetFlag(FLAGS_refit_rebuild_threshold),
+      .pretransform_tris = absl::GetFlag(FLAGS_pretransform_tris),
+      .ray_packet_size = absl::GetFlag(FLAGS_ray_packet_size),
       .parallelism = absl::GetFlag(FLAGS_parallelism),
+      .import_steps = absl::GetFlag(FLAGS_import_steps),
       .show_stats = absl::GetFlag(FLAGS_stats),
+      .bvh_report = absl::GetFlag(FLAGS_bvh_report),
+      .scene_cache_dir = absl::GetFlag(FLAGS_scene_cache_dir),
   };
 
   muon::Renderer r(scene_file, options);
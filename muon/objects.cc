@@ -1,5 +1,8 @@
 #include "muon/objects.h"
 
+#include <limits>
+#include <utility>
+
 #include "glog/logging.h"
 #include "muon/strings.h"
 #include "muon/transform.h"
@@ -26,11 +29,30 @@ Bounds Primitive::WorldBounds() const {
   return b.Transform(*transform);
 }
 
+Bounds Primitive::ClippedWorldBounds(uint32_t part, int axis, float min,
+                                     float max) const {
+  // By default, conservatively clip the part's world bounds to the slab.
+  Bounds slab;
+  slab.min_pos = glm::vec3(-std::numeric_limits<float>::infinity());
+  slab.max_pos = glm::vec3(std::numeric_limits<float>::infinity());
+  slab.min_pos[axis] = min;
+  slab.max_pos[axis] = max;
+  return Bounds::Overlap(PartWorldBounds(part), slab);
+}
+
+void Primitive::AddToCacheKey(CacheKey &key) const {
+  Bounds bounds = WorldBounds();
+  key.Add(bounds.min_pos);
+  key.Add(bounds.max_pos);
+}
+
 absl::optional<Intersection> Primitive::Intersect(const Ray &ray) {
   // Inverse transform the ray to make the intersection test simpler.
-  Ray t_ray = ray.Transform(*inv_transform);
+  float distance_scale;
+  Ray t_ray = ToObjectSpace(ray, distance_scale);
 
-  absl::optional<Intersection> intersection = IntersectObjectSpace(t_ray);
+  absl::optional<Intersection> intersection = IntersectObjectSpace(
+      t_ray, 0.0f, std::numeric_limits<float>::infinity());
   if (!intersection) {
     return intersection;
   }
@@ -45,219 +67,329 @@ absl::optional<Intersection> Primitive::Intersect(const Ray &ray) {
   return intersection;
 }
 
-Tri::Tri(Vertex &v0, Vertex &v1, Vertex &v2, bool use_vertex_normals)
-    : v0_(v0), v1_(v1), v2_(v2), use_vertex_normals_(use_vertex_normals) {
-  // Calculate the surface normal by computing the cross product of the
-  // triangle's edges.
-  const glm::vec3 &edge_ba = v1_.pos - v0_.pos;
-  const glm::vec3 &edge_ca = v2_.pos - v0_.pos;
-  normal_ = glm::cross(edge_ba, edge_ca);
-  normal_length2_ = glm::dot(normal_, normal_);
+bool Primitive::HasIntersection(const Ray &ray, const float max_distance) {
+  float distance_scale;
+  Ray t_ray = ToObjectSpace(ray, distance_scale);
+  absl::optional<Intersection> intersection = IntersectObjectSpace(
+      t_ray, 0.0f, ObjectSpaceBound(max_distance, distance_scale));
+  if (!intersection) {
+    return false;
+  }
+  // Check that the hit is in front of the origin, and closer than the target
+  // distance, in world distances.
+  float distance = WorldDistance(ray, t_ray, intersection->distance);
+  return distance > 0.0f && distance < max_distance;
 }
 
-absl::optional<Intersection> Tri::IntersectObjectSpace(const Ray &ray) {
-  // A tri can be conceptualized as a bounded plane. A plane can be represented
-  // as:
-  //   (P - A) • n = 0
-  // where P is a point on the plane, A is one of the vertices, and n is the
-  // normal of the plane. This is also equivalently written as:
-  //   P • n = A • n
-  //
-  // Given a ray `P = P_0 + P_1*t`, where P_0 is the origin and P_1 is the
-  // direction, we can substitute it into the plane equation in place of the
-  // point P:
-  //   (P_0 + P_1*t) • n = A • n
-  //
-  // Solving for t:
-  //   t = (A • n - P_0 • n) / (P_1 • n)
-  // If `P_1 • n` is 0, it means that the ray is parallel to the plane, so
-  // there is no intersection. Otherwise, there is.
-  //
-  // Next, we must determine if the ray actually hit inside the triangle.
-  // We can find barycentric coordinates for the intersection point:
-  //   P = u * A + v * B + w * C
-  // where u, v, and w are all nonnegative and sum up to 1, and [A, B, C] are
-  // the vertices.
-  //
-  // If we treat the triangle as a 2d coordinate system with origin at A, we
-  // can define any point inside the triangle as a sum of components AB and AC,
-  // which we can call u and v. In practice, we don't need w explicitly, and so
-  // our coordinates can become:
-  //   P = (1 - u - v) * A + u * B + v * C
-  //
-  // We can determine u and v by calculating the ratio between the area of the
-  // triangle created by two vertices + our intersection point, as compared to
-  // the area of the tri as a whole. In practice, we don't need to compute the
-  // actual areas, but instead can compare the magnitudes of the cross products
-  // of the relevant edges.
-  //
-  // We don't need to compute w explicitly, but we do need to check that it
-  // actually lies inside the triangle, which we can do for an arbitrary
-  // triangle edge by computing the cross product of the edge with an analogous
-  // edge formed with the point P. We then compute the dot product between this
-  // new vector and our triangle's normal -- if the result is negative, then it
-  // means that the point was outside (or, to the "right" of the triangle's
-  // edge, based on the right-hand-rule). Incidentally, we can reuse this
-  // computation to then find u and v.
-
-  // First, we find an intersection with the triangle's plane.
-  float dir_along_normal = glm::dot(normal_, ray.direction());
-  if (dir_along_normal > -kEpsilon && dir_along_normal < kEpsilon) {
-    // The ray is parallel, so they don't intersect.
-    return absl::nullopt;
-  }
+bool Primitive::IntersectClosest(acceleration::Workspace *workspace,
+                                 const Ray &ray, uint32_t part,
+                                 HitRecord &hit) {
+  float distance_scale;
+  Ray t_ray = ToObjectSpace(ray, distance_scale);
+  absl::optional<Intersection> intersection = IntersectObjectSpace(
+      t_ray, 0.0f, ObjectSpaceBound(hit.distance, distance_scale));
+  return intersection &&
+         RecordObjectSpaceHit(ray, t_ray, intersection->distance, part, hit);
+}
 
-  const glm::vec3 &a = v0_.pos;
-  const glm::vec3 &b = v1_.pos;
-  const glm::vec3 &c = v2_.pos;
+Intersection Primitive::ResolveHit(const Ray &ray, const HitRecord &hit) {
+  // Without a compact representation of the hit, just intersect again.
+  absl::optional<Intersection> intersection = Intersect(ray);
+  CHECK(intersection) << "Hit could not be resolved";
+  return *intersection;
+}
 
-  float t = (glm::dot(a, normal_) - glm::dot(ray.origin(), normal_)) /
-            dir_along_normal;
-  if (t < 0) {
-    // The tri is behind the ray.
-    return absl::nullopt;
-  }
+Ray Primitive::ToObjectSpace(const Ray &ray, float &distance_scale) const {
+  // Note that TransformDirection() would normalize the direction, which loses
+  // the scale needed to convert distances.
+  glm::vec3 direction =
+      glm::vec3(*inv_transform * glm::vec4(ray.direction(), 0.0f));
+  distance_scale = glm::length(direction) / glm::length(ray.direction());
+  return Ray(TransformPosition(*inv_transform, ray.origin()),
+             glm::normalize(direction));
+}
 
-  glm::vec3 p = ray.At(t);
+float Primitive::WorldDistance(const Ray &ray, const Ray &object_ray,
+                               float t) const {
+  // Measure the distance to the world hit position, rather than scaling t, so
+  // that it rounds the same way as Intersect()'s.
+  return glm::length(TransformPosition(*transform, object_ray.At(t)) -
+                     ray.origin());
+}
 
-  // Next, for each edge formed by the triangle A B C, we check that the point
-  // lies "inside" the triangle. Simultaneously, we compute u, v, and w.
-  // See
-  // https://www.scratchapixel.com/images/upload/ray-triangle/barycentric.png
-  // for a visual representation of this.
-  glm::vec3 tri_edge, point_edge, sub_tri_normal;
-
-  // Edge AB.
-  tri_edge = b - a;
-  point_edge = p - a;
-  sub_tri_normal = glm::cross(tri_edge, point_edge);
-  float v = glm::dot(normal_, sub_tri_normal);
-  if (v < 0) {
-    // P is on the outside of this edge.
-    return absl::nullopt;
+bool Primitive::RecordObjectSpaceHit(const Ray &ray, const Ray &object_ray,
+                                     float t, uint32_t part,
+                                     HitRecord &hit) {
+  float distance = WorldDistance(ray, object_ray, t);
+  if (!(distance > 0.0f) || !IsCloserHit(distance, this, part, hit)) {
+    return false;
   }
+  hit.distance = distance;
+  hit.t = t;
+  hit.primitive = this;
+  hit.part = part;
+  hit.instance = nullptr;
+  return true;
+}
 
-  // Edge BC.
-  tri_edge = c - b;
-  point_edge = p - b;
-  sub_tri_normal = glm::cross(tri_edge, point_edge);
-  float w = glm::dot(normal_, sub_tri_normal);
-  if (w < 0) {
-    // P is on the outside of this edge.
-    return absl::nullopt;
+Intersection Primitive::ObjectToWorld(const HitRecord &hit,
+                                      const glm::vec3 &pos,
+                                      const glm::vec3 &normal) {
+  return Intersection{
+      .distance = hit.distance,
+      .pos = TransformPosition(*transform, pos),
+      .normal = TransformDirection(*inv_transpose_transform, normal),
+      .obj = this,
+  };
+}
+
+Mesh::Mesh(std::shared_ptr<MeshVertices> vertices, bool use_vertex_normals)
+    : vertices_(std::move(vertices)), use_vertex_normals_(use_vertex_normals) {}
+
+void Mesh::AddTriangle(uint32_t v0, uint32_t v1, uint32_t v2) {
+  indices_.push_back(v0);
+  indices_.push_back(v1);
+  indices_.push_back(v2);
+  if (use_vertex_normals_) {
+    glm::vec3 normal = FaceNormal(num_parts() - 1);
+    glm::vec3 *normals = vertices_->normals.mutable_data();
+    normals[v0] += normal;
+    normals[v1] += normal;
+    normals[v2] += normal;
   }
+}
 
-  // Edge CA.
-  tri_edge = a - c;
-  point_edge = p - c;
-  sub_tri_normal = glm::cross(tri_edge, point_edge);
-  float u = glm::dot(normal_, sub_tri_normal);
-  if (u < 0) {
-    // P is on the outside of this edge.
+void Mesh::SetTriangles(MeshArray<uint32_t> indices) {
+  indices_ = std::move(indices);
+}
+
+glm::vec3 Mesh::FaceNormal(uint32_t part) const {
+  // Calculate the surface normal by computing the cross product of the
+  // triangle's edges.
+  const glm::vec3 &edge_ba = position(part, 1) - position(part, 0);
+  const glm::vec3 &edge_ca = position(part, 2) - position(part, 0);
+  return glm::cross(edge_ba, edge_ca);
+}
+
+glm::vec3 Mesh::ObjectNormal(uint32_t part, const glm::vec3 &weights) const {
+  return use_vertex_normals_ ? weights[0] * vertex_normal(part, 0) +
+                                   weights[1] * vertex_normal(part, 1) +
+                                   weights[2] * vertex_normal(part, 2)
+                             : glm::normalize(FaceNormal(part));
+}
+
+absl::optional<Intersection> Mesh::Intersect(const Ray &ray) {
+  HitRecord hit;
+  bool found = false;
+  for (uint32_t part = 0; part < num_parts(); ++part) {
+    found |= IntersectClosest(nullptr, ray, part, hit);
+  }
+  if (!found) {
     return absl::nullopt;
   }
+  return ResolveHit(ray, hit);
+}
 
-  u /= normal_length2_;
-  v /= normal_length2_;
-  w /= normal_length2_;
-
-  // Compute the intersection's normal based on the vertex normals.
-  glm::vec3 n = use_vertex_normals_
-                    ? w * v0_.normal + u * v1_.normal + v * v2_.normal
-                    : glm::normalize(normal_);
+bool Mesh::HasIntersection(const Ray &ray, const float max_distance) {
+  for (uint32_t part = 0; part < num_parts(); ++part) {
+    if (HasIntersection(nullptr, ray, part, max_distance)) {
+      return true;
+    }
+  }
+  return false;
+}
 
+Intersection Mesh::ResolveHit(const Ray &ray, const HitRecord &hit) {
+  const uint32_t part = hit.part;
+  const glm::vec3 &weights = hit.weights;
+  if (!pretransformed_) {
+    float distance_scale;
+    Ray object_ray = ToObjectSpace(ray, distance_scale);
+    return ObjectToWorld(hit, object_ray.At(hit.t),
+                         ObjectNormal(part, weights));
+  }
+  glm::vec3 n;
+  if (use_vertex_normals_) {
+    const uint32_t *indices = &indices_[3 * part];
+    n = glm::normalize(weights[0] * world_normals_[indices[0]] +
+                       weights[1] * world_normals_[indices[1]] +
+                       weights[2] * world_normals_[indices[2]]);
+  } else {
+    // Match the normalization in IntersectObjectSpace() and
+    // Primitive::Intersect().
+    n = TransformDirection(*inv_transpose_transform,
+                           glm::normalize(FaceNormal(part)));
+  }
   return Intersection{
-      .distance = t,
-      .pos = p,
+      .distance = hit.distance,
+      .pos = ray.At(hit.t),
       .normal = n,
       .obj = this,
   };
 }
 
-Bounds Tri::ObjectBounds() const {
-  const glm::vec3 &a = v0_.pos;
-  const glm::vec3 &b = v1_.pos;
-  const glm::vec3 &c = v2_.pos;
-  Bounds bounds(a, b);
-  return Bounds::Union(bounds, c);
+absl::optional<Intersection> Mesh::IntersectObjectSpace(const Ray &ray,
+                                                        float t_min,
+                                                        float t_max) {
+  TriangleRay triangle_ray(ray);
+  TriangleHit hit;
+  uint32_t hit_part = 0;
+  bool found = false;
+  for (uint32_t part = 0; part < num_parts(); ++part) {
+    if (IntersectTriangle(triangle_ray, position(part, 0), position(part, 1),
+                          position(part, 2), t_min, t_max, hit)) {
+      // Only look for closer hits from now on.
+      t_max = hit.t;
+      hit_part = part;
+      found = true;
+    }
+  }
+  if (!found) {
+    return absl::nullopt;
+  }
+  return Intersection{
+      .distance = hit.t,
+      .pos = ray.At(hit.t),
+      .normal = ObjectNormal(hit_part, hit.weights),
+      .obj = this,
+  };
 }
 
-Bounds Tri::WorldBounds() const {
+void Mesh::PreTransform() {
+  // Each vertex is transformed once, however many tris share it. Normals are
+  // transformed by the inverse transpose, as in Primitive::Intersect(), but
+  // left unnormalized until they're interpolated.
+  const MeshArray<glm::vec3> &positions = vertices_->positions;
+  world_positions_.resize(positions.size());
+  for (size_t i = 0; i < positions.size(); ++i) {
+    world_positions_[i] = TransformPosition(*transform, positions[i]);
+  }
+  if (use_vertex_normals_) {
+    const MeshArray<glm::vec3> &normals = vertices_->normals;
+    glm::mat3 normal_transform(*inv_transpose_transform);
+    world_normals_.resize(normals.size());
+    for (size_t i = 0; i < normals.size(); ++i) {
+      world_normals_[i] = normal_transform * normals[i];
+    }
+  }
+  pretransformed_ = true;
+}
+
+void Mesh::CompactVertices() {
+  DCHECK(!pretransformed_);
+  constexpr uint32_t kUnused = std::numeric_limits<uint32_t>::max();
+  const MeshVertices &vertices = *vertices_;
+  bool has_normals = !vertices.normals.empty();
+  // Vertices are copied in the order in which the tris first use them.
+  std::vector<uint32_t> remap(vertices.positions.size(), kUnused);
+  std::vector<uint32_t> indices;
+  indices.reserve(indices_.size());
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> normals;
+  for (uint32_t index : indices_) {
+    if (remap[index] == kUnused) {
+      remap[index] = positions.size();
+      positions.push_back(vertices.positions[index]);
+      if (has_normals) {
+        normals.push_back(vertices.normals[index]);
+      }
+    }
+    indices.push_back(remap[index]);
+  }
+  auto compacted = std::make_shared<MeshVertices>();
+  compacted->positions = MeshArray<glm::vec3>(std::move(positions));
+  compacted->normals = MeshArray<glm::vec3>(std::move(normals));
+  vertices_ = std::move(compacted);
+  indices_ = MeshArray<uint32_t>(std::move(indices));
+}
+
+void Mesh::AddToCacheKey(CacheKey &key) const {
+  // These determine the world bounds, the clipped bounds, and the packed
+  // triangles of BVH leaves.
+  key.Add(uint64_t(num_parts()));
+  for (uint32_t part = 0; part < num_parts(); ++part) {
+    for (int vertex = 0; vertex < 3; ++vertex) {
+      key.Add(TransformPosition(*transform, position(part, vertex)));
+    }
+  }
+}
+
+Bounds Mesh::ObjectBounds() const {
+  Bounds bounds;
+  for (uint32_t index : indices_) {
+    bounds = Bounds::Union(bounds, vertices_->positions[index]);
+  }
+  return bounds;
+}
+
+Bounds Mesh::WorldBounds() const {
+  // The union of the tris' bounds is tighter than the transformed object
+  // bounds.
+  Bounds bounds;
+  for (uint32_t part = 0; part < num_parts(); ++part) {
+    bounds = Bounds::Union(bounds, PartWorldBounds(part));
+  }
+  return bounds;
+}
+
+Bounds Mesh::PartWorldBounds(uint32_t part) const {
   // We explicitly pre-transform the vertices of the triangle in order to
   // obtain a tighter axis-aligned bounding box.
-  const glm::vec3 &a = TransformPosition(*transform, v0_.pos);
-  const glm::vec3 &b = TransformPosition(*transform, v1_.pos);
-  const glm::vec3 &c = TransformPosition(*transform, v2_.pos);
+  if (pretransformed_) {
+    Bounds bounds(world_position(part, 0), world_position(part, 1));
+    return Bounds::Union(bounds, world_position(part, 2));
+  }
+  const glm::vec3 &a = TransformPosition(*transform, position(part, 0));
+  const glm::vec3 &b = TransformPosition(*transform, position(part, 1));
+  const glm::vec3 &c = TransformPosition(*transform, position(part, 2));
   Bounds bounds(a, b);
   return Bounds::Union(bounds, c);
 }
 
-absl::optional<Intersection> Sphere::IntersectObjectSpace(const Ray &ray) {
-  // A sphere can be conceptualized as:
-  //   (P - C) • (P - C) = r^2
-  // where P is a point on the sphere, C is the center of the sphere, and r is
-  // the radius.
-  //
-  // Given a ray `P = P_0 + P_1*t`, where P_0 is the origin and P_1 is the
-  // direction, we can substitute it into the sphere equation in place of the
-  // point P:
-  //   (P_0 + P_1*t - C) • (P_0 + P_1*t - C) - r^2 = 0
-  //
-  // The only unknown is the distance along the ray, t. Expanding it, we can
-  // see that it is a quadratic equation of the standard form `ax^2 + bx + c =
-  // 0`, where x = t:
-  //   (P_1 • P_1) * t^2 + 2 * (P_1 • (P_0 - C)) * t + (P_0 - C) • (P_0 - C) -
-  //   r^2 = 0
-  //
-  // Now we need to solve for t using the standard formula:
-  //   t = (-b +- sqrt(b^2 - 4ac)) / 2a
-  //
-  // The `a` component involves a dot product between two identical unit
-  // vectors, which is 1, so we can ignore it:
-  //   t = (-b +- sqrt(b^2 - 4c)) / 2
-  //
-  // Expanding it out, we notice that we can factor out a coefficient of 2 from
-  // both `b` and the sqrt, which then cancels with the divisor, finally
-  // leaving us with:
-  //   t = -b' +- sqrt(b'^2 - c)
-  // where
-  //   b' = (P_1 • (P_0 - C)), and
-  //   c = (P_0 - C) • (P_0 - C) - r^2
-  //
-  // Expanding it all out, we can now solve for t:
-  //   t = -(P_1 • (P_0 - C)) +- sqrt((P_1 • (P_0 - C))^2 - ((P_0 - C) • (P_0 -
-  //   C) - r^2))
-
-  glm::vec3 dir_to_center = ray.origin() - pos_;
-  float b_prime = glm::dot(ray.direction(), dir_to_center);
-  float c = glm::dot(dir_to_center, dir_to_center) - radius_ * radius_;
-
-  // First check the discriminant.
-  float discriminant = b_prime * b_prime - c;
-  if (discriminant < 0) {
-    // No hits.
-    return absl::nullopt;
+Bounds Mesh::ClippedWorldBounds(uint32_t part, int axis, float min,
+                                float max) const {
+  // The clipped triangle is a polygon whose vertices are the triangle's
+  // vertices that lie within the slab, plus the points where the triangle's
+  // edges cross the slab's planes. Its bounds are the bounds of those points.
+  const glm::vec3 vertices[3] = {
+      TransformPosition(*transform, position(part, 0)),
+      TransformPosition(*transform, position(part, 1)),
+      TransformPosition(*transform, position(part, 2)),
+  };
+  Bounds bounds;
+  for (int i = 0; i < 3; ++i) {
+    const glm::vec3 &p = vertices[i];
+    const glm::vec3 &q = vertices[(i + 1) % 3];
+    if (p[axis] >= min && p[axis] <= max) {
+      bounds = Bounds::Union(bounds, p);
+    }
+    for (float plane : {min, max}) {
+      if ((p[axis] < plane && q[axis] > plane) ||
+          (p[axis] > plane && q[axis] < plane)) {
+        glm::vec3 crossing =
+            glm::mix(p, q, (plane - p[axis]) / (q[axis] - p[axis]));
+        // Snap to the plane exactly, to avoid rounding outside of the slab.
+        crossing[axis] = plane;
+        bounds = Bounds::Union(bounds, crossing);
+      }
+    }
   }
+  return bounds;
+}
 
-  // At this point, we know there is an intersection!
-  // Calculate the roots.
-  float sqrt_d = glm::sqrt(discriminant);
-  float root_0 = -b_prime + sqrt_d;
-  float root_1 = -b_prime - sqrt_d;
+Intersection Sphere::ResolveHit(const Ray &ray, const HitRecord &hit) {
+  float distance_scale;
+  glm::vec3 p = ToObjectSpace(ray, distance_scale).At(hit.t);
+  return ObjectToWorld(hit, p, glm::normalize(p - pos_));
+}
 
-  // If both roots are negative, then the sphere is behind the ray.
-  if (root_0 < 0 && root_1 < 0) {
+absl::optional<Intersection> Sphere::IntersectObjectSpace(const Ray &ray,
+                                                          float t_min,
+                                                          float t_max) {
+  float t;
+  if (!IntersectSphere(ray, t_min, t_max, t)) {
     return absl::nullopt;
   }
-
-  // Otherwise, we pick the smallest (i.e. closest) _positive_ root,
-  // corresponding to the surface we hit. If one of the roots is negative, then
-  // it means that the ray started inside the sphere.
-  float t = glm::min(root_0, root_1);
-  if (t < 0) {
-    t = glm::max(root_0, root_1);
-  }
-
   glm::vec3 p = ray.At(t);
   glm::vec3 n = glm::normalize(p - pos_);
 
@@ -1,6 +1,7 @@
 #ifndef MUON_OBJECTS_H_
 #define MUON_OBJECTS_H_
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -9,12 +10,18 @@
 #include "muon/camera.h"
 #include "muon/lighting.h"
 #include "muon/materials.h"
+#include "muon/scene_cache.h"
+#include "muon/triangle.h"
 #include "muon/types.h"
 #include "muon/vertex.h"
 #include "third_party/glm/glm.hpp"
 
 namespace muon {
 
+namespace acceleration {
+class Workspace;
+}  // namespace acceleration
+
 // Represents an object that supports intersection tests.
 class Intersectable {
  public:
@@ -27,6 +34,18 @@ class Intersectable {
   virtual bool HasIntersection(const Ray &ray, const float max_distance);
 };
 
+// The concrete types of primitives that acceleration structures dispatch to
+// directly, instead of through Primitive's virtual interface. See
+// PrimitiveRef::type.
+enum class PrimitiveType : uint8_t {
+  // A tri of a Mesh.
+  kTriangle,
+  // A Sphere.
+  kSphere,
+  // Any other primitive, which is intersected through its virtual interface.
+  kGeneric,
+};
+
 // Represents a geometric primitive.
 // All primitive geometric data is represented in object coordinates, and
 // transformed as needed for intersection tests.
@@ -41,13 +60,80 @@ class Primitive : public Intersectable {
   // in world coordinates.
   virtual Bounds WorldBounds() const;
 
+  // Returns the primitive's type, which acceleration structures use to call
+  // the kernels of the types they know about directly.
+  virtual PrimitiveType type() const { return PrimitiveType::kGeneric; }
+
+  // The number of parts that acceleration structures reference separately.
+  // Most primitives are a single part, but meshes are made up of one part per
+  // tri, so that they only need a single primitive (see Mesh).
+  virtual uint32_t num_parts() const { return 1; }
+  // Returns the bounding box of the given part, in world coordinates. By
+  // default, this is the bounding box of the whole primitive.
+  virtual Bounds PartWorldBounds(uint32_t part) const { return WorldBounds(); }
+  // Returns the bounding box of the region of the given part that lies within
+  // the slab [min, max] along the given axis, in world coordinates. This is
+  // used to clip primitives to the split planes of spatial split BVHs.
+  virtual Bounds ClippedWorldBounds(uint32_t part, int axis, float min,
+                                    float max) const;
+
+  // Bakes the primitive's transform into a world space copy of its geometry,
+  // if supported, so that intersection tests can skip transforming each ray.
+  // Must be called after the primitive's geometry and transform are final.
+  virtual void PreTransform() {}
+
+  // Adds the primitive's geometry to the key of a cached acceleration structure
+  // built over it. Anything that affects the structure's construction (e.g. the
+  // clipped bounds used by spatial splits) must be included. By default, this
+  // adds the world bounds.
+  virtual void AddToCacheKey(CacheKey &key) const;
+
   // Transforms the ray to object coordinates and calls IntersectObjectSpace.
   virtual absl::optional<Intersection> Intersect(const Ray &ray) override;
+  // Same as Intersect(), but IntersectObjectSpace() is given the distance
+  // bound, so that farther hits are rejected early.
+  virtual bool HasIntersection(const Ray &ray,
+                               const float max_distance) override;
+
+  // Variants of Intersect() and HasIntersection() that are given the scratch
+  // space of the acceleration structure containing the primitive, and only
+  // consider the given part. Primitives that contain acceleration structures
+  // of their own (i.e. instances) use the scratch space for their own
+  // traversal; by default, it's ignored.
+  virtual absl::optional<Intersection> Intersect(
+      acceleration::Workspace *workspace, const Ray &ray) {
+    return Intersect(ray);
+  }
+  virtual bool HasIntersection(acceleration::Workspace *workspace,
+                               const Ray &ray, uint32_t part,
+                               const float max_distance) {
+    return HasIntersection(ray, max_distance);
+  }
 
-  // Intersects with a ray in object coordinates and returns the intersection
-  // point.
-  virtual absl::optional<Intersection> IntersectObjectSpace(const Ray &ray) = 0;
+  // Intersects the given part with a ray, only considering hits in front of
+  // its origin and closer than `hit.distance`. If there is one, records it in
+  // `hit` and returns true. When testing many primitives, this avoids
+  // computing the position and normal of every hit; only the closest one is
+  // resolved, via ResolveHit(). By default, this calls Intersect().
+  virtual bool IntersectClosest(acceleration::Workspace *workspace,
+                                const Ray &ray, uint32_t part, HitRecord &hit);
+  // Returns the full intersection for a hit that IntersectClosest() recorded
+  // for the same ray.
+  virtual Intersection ResolveHit(const Ray &ray, const HitRecord &hit);
 
+  // Intersects with a ray in object coordinates and returns the closest
+  // intersection point whose distance along the ray is in (t_min, t_max).
+  // Distances are in units of the ray's direction. Hits outside of the range
+  // should be rejected before computing their positions and normals.
+  virtual absl::optional<Intersection> IntersectObjectSpace(const Ray &ray,
+                                                            float t_min,
+                                                            float t_max) = 0;
+
+  // The position of the primitive in the acceleration structure that contains
+  // it, which breaks ties between equally close hits (see IsCloserHit()), so
+  // that every structure resolves them the same way regardless of its
+  // traversal order.
+  uint32_t order = 0;
   std::shared_ptr<glm::mat4> transform;
   std::shared_ptr<glm::mat4> inv_transform;
   std::shared_ptr<glm::mat4> inv_transpose_transform;
@@ -56,47 +142,326 @@ class Primitive : public Intersectable {
   // TODO: This is a hack to get MIS working; ideally there'd be less
   // distinction between "lights" and primitives with emission.
   Light *light = nullptr;
+
+ protected:
+  // Helpers for primitives that are intersected in object coordinates.
+  // Transforms the ray to object coordinates, normalizing its direction, and
+  // outputs the ratio of object space distances to world distances along it.
+  Ray ToObjectSpace(const Ray &ray, float &distance_scale) const;
+  // Returns the scaled object space bound for a world distance bound, which
+  // only serves to reject farther hits early (see kDistanceBoundScale).
+  static float ObjectSpaceBound(float max_distance, float distance_scale) {
+    return max_distance * distance_scale * kDistanceBoundScale;
+  }
+  // Returns the world distance to the hit at distance t along `object_ray`
+  // (i.e. `ray` transformed to object coordinates).
+  float WorldDistance(const Ray &ray, const Ray &object_ray, float t) const;
+  // Records a hit on the given part at distance t along `object_ray` in `hit`,
+  // if it's closer (see IsCloserHit()). Returns whether it was.
+  bool RecordObjectSpaceHit(const Ray &ray, const Ray &object_ray, float t,
+                            uint32_t part, HitRecord &hit);
+  // Transforms the position and normal of a hit from object to world
+  // coordinates, and returns its intersection.
+  Intersection ObjectToWorld(const HitRecord &hit, const glm::vec3 &pos,
+                             const glm::vec3 &normal);
 };
 
-// Represents a triangle.
-class Tri : public Primitive {
+// Returns whether a hit on the given part of a primitive, at a world distance
+// along the ray, is closer than the one recorded in `hit`. Equally close hits
+// are ordered by the primitive's order and then the part, so that ties (e.g.
+// where coplanar tris meet) don't depend on the order in which they're tested.
+// Hits within an instance are ordered by the instance's.
+inline bool IsCloserHit(float distance, const Primitive *primitive,
+                        uint32_t part, const HitRecord &hit) {
+  if (distance != hit.distance) {
+    return distance < hit.distance;
+  }
+  if (hit.instance != nullptr) {
+    return primitive->order < hit.instance->order;
+  }
+  return hit.primitive != nullptr &&
+         (primitive->order < hit.primitive->order ||
+          (primitive == hit.primitive && part < hit.part));
+}
+
+// A reference to a single part of a primitive. Acceleration structures are
+// built over these, so that e.g. each tri of a mesh is placed separately.
+struct PrimitiveRef {
+  Bounds WorldBounds() const { return primitive->PartWorldBounds(part); }
+  Bounds ClippedWorldBounds(int axis, float min, float max) const {
+    return primitive->ClippedWorldBounds(part, axis, min, max);
+  }
+  bool IntersectClosest(acceleration::Workspace *workspace, const Ray &ray,
+                        HitRecord &hit) const {
+    return primitive->IntersectClosest(workspace, ray, part, hit);
+  }
+  bool HasIntersection(acceleration::Workspace *workspace, const Ray &ray,
+                       const float max_distance) const {
+    return primitive->HasIntersection(workspace, ray, part, max_distance);
+  }
+
+  Primitive *primitive = nullptr;
+  uint32_t part = 0;
+  // The primitive's type(), cached so that traversal can dispatch on it
+  // without a virtual call. This fits in what would otherwise be padding.
+  PrimitiveType type = PrimitiveType::kGeneric;
+};
+static_assert(sizeof(PrimitiveRef) == 16, "PrimitiveRef should be 16 bytes");
+
+// Resolves the closest hit recorded by Primitive::IntersectClosest() calls
+// into its full intersection, via the instance that was hit, if any.
+inline Intersection ResolveClosestHit(const Ray &ray, const HitRecord &hit) {
+  Primitive *hit_object =
+      hit.instance != nullptr ? hit.instance : hit.primitive;
+  return hit_object->ResolveHit(ray, hit);
+}
+
+// Represents a triangle mesh. Its vertices and the vertex indices of its tris
+// are stored in flat arrays, and it has a single material and transform, so
+// each tri only costs its three indices, plus a reference in the acceleration
+// structure. Each tri is a separate part of the primitive.
+class Mesh final : public Primitive {
  public:
-  Tri(Vertex &v0, Vertex &v1, Vertex &v2, bool use_vertex_normals);
-  // IDEA: Instead of relying on IntersectObjectSpace, tris can pre-transform
-  // their vertices once at startup for a speed improvement.
-  absl::optional<Intersection> IntersectObjectSpace(const Ray &ray) override;
+  Mesh(std::shared_ptr<MeshVertices> vertices, bool use_vertex_normals);
+
+  PrimitiveType type() const override { return PrimitiveType::kTriangle; }
+
+  // Adds a tri with the given vertex indices, in counter-clockwise order. When
+  // using vertex normals, the tri's face normal is added to the normal of each
+  // of its vertices; they're expected to be normalized later, if at all.
+  void AddTriangle(uint32_t v0, uint32_t v1, uint32_t v2);
+  // Replaces the tris with the given vertex indices, three per tri, which may
+  // e.g. be mapped from a mesh file. Unlike AddTriangle(), this doesn't
+  // accumulate vertex normals, so they should already be set.
+  void SetTriangles(MeshArray<uint32_t> indices);
+
+  uint32_t num_parts() const override { return indices_.size() / 3; }
+  Bounds PartWorldBounds(uint32_t part) const override;
+  Bounds ClippedWorldBounds(uint32_t part, int axis, float min,
+                            float max) const override;
   Bounds ObjectBounds() const override;
   Bounds WorldBounds() const override;
 
-  glm::vec3 Normal() const { return normal_; }
+  // Intersect all of the tris. The per-part variants below intersect a single
+  // tri, in world coordinates directly once pre-transformed, and in object
+  // coordinates otherwise. They're defined inline, below, so that
+  // acceleration structures can inline them into their traversal loops.
+  absl::optional<Intersection> Intersect(const Ray &ray) override;
+  bool HasIntersection(const Ray &ray, const float max_distance) override;
+  bool HasIntersection(acceleration::Workspace *workspace, const Ray &ray,
+                       uint32_t part, const float max_distance) override;
+  bool IntersectClosest(acceleration::Workspace *workspace, const Ray &ray,
+                        uint32_t part, HitRecord &hit) override;
+  Intersection ResolveHit(const Ray &ray, const HitRecord &hit) override;
+  absl::optional<Intersection> IntersectObjectSpace(const Ray &ray, float t_min,
+                                                    float t_max) override;
+  void PreTransform() override;
+  // Replaces the mesh's vertices with a copy of only those that its tris use,
+  // and remaps the tris to them. This is for meshes that share their vertices
+  // with others (e.g. tris of the same mesh with different materials), so that
+  // each only transforms its own vertices when pre-transformed. Must be called
+  // once the vertex normals are final, and before PreTransform().
+  void CompactVertices();
+  // Adds the world space vertex positions of each tri.
+  void AddToCacheKey(CacheKey &key) const override;
+
+  const std::shared_ptr<MeshVertices> &vertices() const { return vertices_; }
+  bool use_vertex_normals() const { return use_vertex_normals_; }
+  // Whether PreTransform() has been called, in which case world_position()
+  // is valid.
+  bool pretransformed() const { return pretransformed_; }
+  // Returns the position of the given vertex of a tri, in world coordinates.
+  // Only valid once pre-transformed.
+  const glm::vec3 &world_position(uint32_t part, int vertex) const {
+    return world_positions_[indices_[3 * part + vertex]];
+  }
 
  private:
-  // Vertices specified in counter-clockwise order.
-  Vertex &v0_;
-  Vertex &v1_;
-  Vertex &v2_;
-  // Face normal. Note, we store it unnormalized so that we can use it for the
-  // intersection calculations.
-  glm::vec3 normal_;
-  // Squared length of the face normal. Used in computing barycentric
+  // Returns the object space position of the given vertex of a tri.
+  const glm::vec3 &position(uint32_t part, int vertex) const {
+    return vertices_->positions[indices_[3 * part + vertex]];
+  }
+  // Returns the object space normal of the given vertex of a tri.
+  const glm::vec3 &vertex_normal(uint32_t part, int vertex) const {
+    return vertices_->normals[indices_[3 * part + vertex]];
+  }
+  // Returns the unnormalized face normal of a tri, in object coordinates.
+  glm::vec3 FaceNormal(uint32_t part) const;
+  // Returns the normal at the given barycentric weights of a tri, in object
   // coordinates.
-  float normal_length2_;
-  // Whether or not to use the vertex normals instead of the tri's normal.
+  glm::vec3 ObjectNormal(uint32_t part, const glm::vec3 &weights) const;
+
+  std::shared_ptr<MeshVertices> vertices_;
+  // The indices of the vertices of each tri, three per tri.
+  MeshArray<uint32_t> indices_;
+  // Whether or not to use the vertex normals instead of each tri's normal.
   bool use_vertex_normals_;
+  // Whether PreTransform() has been called, in which case the world space
+  // copies of the vertices are valid.
+  bool pretransformed_ = false;
+  // The vertex positions in world coordinates.
+  std::vector<glm::vec3> world_positions_;
+  // The vertex normals, transformed but unnormalized. Empty when not using
+  // vertex normals.
+  std::vector<glm::vec3> world_normals_;
 };
 
 // Represents a sphere.
-class Sphere : public Primitive {
+class Sphere final : public Primitive {
  public:
   Sphere(glm::vec3 pos, float radius) : pos_(pos), radius_(radius) {}
-  absl::optional<Intersection> IntersectObjectSpace(const Ray &ray) override;
+
+  PrimitiveType type() const override { return PrimitiveType::kSphere; }
+  // Defined inline, below, like Mesh::IntersectClosest().
+  bool IntersectClosest(acceleration::Workspace *workspace, const Ray &ray,
+                        uint32_t part, HitRecord &hit) override;
+  Intersection ResolveHit(const Ray &ray, const HitRecord &hit) override;
+  absl::optional<Intersection> IntersectObjectSpace(const Ray &ray, float t_min,
+                                                    float t_max) override;
   Bounds ObjectBounds() const override;
 
  private:
+  // Intersects with a ray in object coordinates, and outputs the distance along
+  // the ray to the closest hit in (t_min, t_max).
+  bool IntersectSphere(const Ray &ray, float t_min, float t_max,
+                       float &t) const;
+
   glm::vec3 pos_;
   float radius_;
 };
 
+inline bool Mesh::HasIntersection(acceleration::Workspace *workspace,
+                                  const Ray &ray, uint32_t part,
+                                  const float max_distance) {
+  TriangleHit tri_hit;
+  if (!pretransformed_) {
+    float distance_scale;
+    Ray object_ray = ToObjectSpace(ray, distance_scale);
+    if (!IntersectTriangle(TriangleRay(object_ray), position(part, 0),
+                           position(part, 1), position(part, 2), 0.0f,
+                           ObjectSpaceBound(max_distance, distance_scale),
+                           tri_hit)) {
+      return false;
+    }
+    return WorldDistance(ray, object_ray, tri_hit.t) < max_distance;
+  }
+  TriangleRay triangle_ray(ray);
+  return IntersectTriangle(triangle_ray, world_position(part, 0),
+                           world_position(part, 1), world_position(part, 2),
+                           0.0f, max_distance / triangle_ray.length, tri_hit);
+}
+
+inline bool Mesh::IntersectClosest(acceleration::Workspace *workspace,
+                                   const Ray &ray, uint32_t part,
+                                   HitRecord &hit) {
+  TriangleHit tri_hit;
+  if (!pretransformed_) {
+    float distance_scale;
+    Ray object_ray = ToObjectSpace(ray, distance_scale);
+    if (!IntersectTriangle(TriangleRay(object_ray), position(part, 0),
+                           position(part, 1), position(part, 2), 0.0f,
+                           ObjectSpaceBound(hit.distance, distance_scale),
+                           tri_hit) ||
+        !RecordObjectSpaceHit(ray, object_ray, tri_hit.t, part, hit)) {
+      return false;
+    }
+    hit.weights = tri_hit.weights;
+    return true;
+  }
+  // The bound is widened so that equally close hits reach IsCloserHit().
+  TriangleRay triangle_ray(ray);
+  if (!IntersectTriangle(
+          triangle_ray, world_position(part, 0), world_position(part, 1),
+          world_position(part, 2), 0.0f,
+          hit.distance * kDistanceBoundScale / triangle_ray.length, tri_hit)) {
+    return false;
+  }
+  float distance = tri_hit.t * triangle_ray.length;
+  if (!IsCloserHit(distance, this, part, hit)) {
+    return false;
+  }
+  hit.distance = distance;
+  hit.t = tri_hit.t;
+  hit.weights = tri_hit.weights;
+  hit.primitive = this;
+  hit.part = part;
+  hit.instance = nullptr;
+  return true;
+}
+
+inline bool Sphere::IntersectSphere(const Ray &ray, float t_min, float t_max,
+                                    float &t) const {
+  // A sphere can be conceptualized as:
+  //   (P - C) • (P - C) = r^2
+  // where P is a point on the sphere, C is the center of the sphere, and r is
+  // the radius.
+  //
+  // Given a ray `P = P_0 + P_1*t`, where P_0 is the origin and P_1 is the
+  // direction, we can substitute it into the sphere equation in place of the
+  // point P:
+  //   (P_0 + P_1*t - C) • (P_0 + P_1*t - C) - r^2 = 0
+  //
+  // The only unknown is the distance along the ray, t. Expanding it, we can
+  // see that it is a quadratic equation of the standard form `ax^2 + bx + c =
+  // 0`, where x = t:
+  //   (P_1 • P_1) * t^2 + 2 * (P_1 • (P_0 - C)) * t + (P_0 - C) • (P_0 - C) -
+  //   r^2 = 0
+  //
+  // Now we need to solve for t using the standard formula:
+  //   t = (-b +- sqrt(b^2 - 4ac)) / 2a
+  //
+  // The `a` component involves a dot product between two identical unit
+  // vectors, which is 1, so we can ignore it:
+  //   t = (-b +- sqrt(b^2 - 4c)) / 2
+  //
+  // Expanding it out, we notice that we can factor out a coefficient of 2 from
+  // both `b` and the sqrt, which then cancels with the divisor, finally
+  // leaving us with:
+  //   t = -b' +- sqrt(b'^2 - c)
+  // where
+  //   b' = (P_1 • (P_0 - C)), and
+  //   c = (P_0 - C) • (P_0 - C) - r^2
+  //
+  // Expanding it all out, we can now solve for t:
+  //   t = -(P_1 • (P_0 - C)) +- sqrt((P_1 • (P_0 - C))^2 - ((P_0 - C) • (P_0 -
+  //   C) - r^2))
+
+  glm::vec3 dir_to_center = ray.origin() - pos_;
+  float b_prime = glm::dot(ray.direction(), dir_to_center);
+  float c = glm::dot(dir_to_center, dir_to_center) - radius_ * radius_;
+
+  // First check the discriminant.
+  float discriminant = b_prime * b_prime - c;
+  if (discriminant < 0) {
+    // No hits.
+    return false;
+  }
+
+  // At this point, we know there is an intersection!
+  // Calculate the roots.
+  float sqrt_d = glm::sqrt(discriminant);
+  float root_0 = -b_prime + sqrt_d;
+  float root_1 = -b_prime - sqrt_d;
+
+  // We pick the smallest (i.e. closest) root that isn't before the start of
+  // the range, corresponding to the surface we hit. If only the larger root
+  // is, then e.g. the ray started inside the sphere. Note that root_1 <=
+  // root_0, and that a root exactly at t_min hides the larger one.
+  t = root_1 >= t_min ? root_1 : root_0;
+  return t > t_min && t < t_max;
+}
+
+inline bool Sphere::IntersectClosest(acceleration::Workspace *workspace,
+                                     const Ray &ray, uint32_t part,
+                                     HitRecord &hit) {
+  float distance_scale;
+  Ray object_ray = ToObjectSpace(ray, distance_scale);
+  float t;
+  return IntersectSphere(object_ray, 0.0f,
+                         ObjectSpaceBound(hit.distance, distance_scale), t) &&
+         RecordObjectSpaceHit(ray, object_ray, t, part, hit);
+}
+
 }  // namespace muon
 
 #endif
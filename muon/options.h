@@ -4,6 +4,7 @@
 #include <string>
 
 #include "muon/acceleration_type.h"
+#include "muon/import_steps.h"
 
 namespace muon {
 
@@ -16,10 +17,36 @@ struct Options {
   AccelerationType acceleration;
   // The strategy to use when partitioning primitives in a BVH.
   PartitionStrategy partition_strategy;
-  // The number of parallel threads to use when rendering.
+  // Whether BVH construction should consider SAH splits along all axes.
+  bool sah_all_axes;
+  // The SAH costs of traversing a BVH node and intersecting a primitive.
+  float sah_traversal_cost;
+  float sah_intersection_cost;
+  // The maximum number of primitives in each BVH leaf.
+  uint32_t max_leaf_primitives;
+  // The fraction of additional primitive references that SBVH spatial splits
+  // may create.
+  float sbvh_duplication_budget;
+  // The factor by which refitting a BVH between frames may increase its SAH
+  // cost before it's rebuilt instead.
+  float refit_rebuild_threshold;
+  // Whether to pre-transform tris into world coordinates.
+  bool pretransform_tris;
+  // The number of camera rays to trace together as a packet, up to
+  // kMaxRayPacketSize. 1 traces each ray individually.
+  uint32_t ray_packet_size;
+  // The number of parallel threads to use when building the acceleration
+  // structure and rendering.
   uint32_t parallelism;
+  // The post-processing steps run on models imported by `load` commands.
+  ImportSteps import_steps;
   // Whether or not to show stats.
   bool show_stats;
+  // Whether to show a report on the quality of the BVH after building it.
+  bool bvh_report;
+  // The directory in which to cache loaded meshes and built acceleration
+  // structures between runs. Caching is disabled if empty.
+  std::string scene_cache_dir;
 };
 
 }  // namespace muon
@@ -0,0 +1,104 @@
+#ifndef MUON_PARALLEL_H_
+#define MUON_PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "absl/memory/memory.h"
+
+namespace muon {
+
+// Splits the range [0, n) into `num_chunks` contiguous chunks of roughly equal
+// size, and calls `fn(chunk, start, end)` for each one. The first chunk is
+// processed on the calling thread, and the rest on their own threads. Returns
+// once all chunks are done.
+template <typename Fn>
+void ParallelForChunks(size_t n, int num_chunks, Fn fn) {
+  num_chunks = std::max(num_chunks, 1);
+  size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+  std::vector<std::thread> threads;
+  threads.reserve(num_chunks - 1);
+  for (int chunk = 1; chunk < num_chunks; ++chunk) {
+    size_t start = std::min(n, chunk * chunk_size);
+    size_t end = std::min(n, start + chunk_size);
+    threads.emplace_back([&fn, chunk, start, end] { fn(chunk, start, end); });
+  }
+  fn(0, 0, std::min(n, chunk_size));
+  for (std::thread &t : threads) {
+    t.join();
+  }
+}
+
+// Runs a list of tasks ahead of time on background threads, in order, so that
+// their results are ready by the time they're needed. A result that's needed
+// before a background thread has started on its task is computed on the
+// calling thread instead of waiting, so with no background threads, each task
+// simply runs when its result is taken.
+template <typename T>
+class BackgroundTasks {
+ public:
+  BackgroundTasks(std::vector<std::function<T()>> fns, int num_threads) {
+    tasks_.reserve(fns.size());
+    for (auto &fn : fns) {
+      tasks_.push_back(absl::make_unique<Task>());
+      tasks_.back()->fn = std::move(fn);
+      tasks_.back()->result = tasks_.back()->promise.get_future();
+    }
+    num_threads = std::min<int>(num_threads, tasks_.size());
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this] {
+        for (size_t i = next_++; i < tasks_.size(); i = next_++) {
+          Run(*tasks_[i]);
+        }
+      });
+    }
+  }
+  BackgroundTasks(const BackgroundTasks &) = delete;
+  BackgroundTasks &operator=(const BackgroundTasks &) = delete;
+
+  // Waits for the tasks already started; the rest are skipped.
+  ~BackgroundTasks() {
+    next_ = tasks_.size();
+    for (std::thread &t : threads_) {
+      t.join();
+    }
+  }
+
+  // Returns the result of the i-th task. Each result may only be taken once.
+  T Take(size_t i) {
+    Task &task = *tasks_[i];
+    if (!task.started.exchange(true)) {
+      return task.fn();
+    }
+    return task.result.get();
+  }
+
+ private:
+  struct Task {
+    std::function<T()> fn;
+    std::atomic<bool> started{false};
+    std::promise<T> promise;
+    std::future<T> result;
+  };
+
+  static void Run(Task &task) {
+    if (!task.started.exchange(true)) {
+      task.promise.set_value(task.fn());
+    }
+  }
+
+  std::vector<std::unique_ptr<Task>> tasks_;
+  // The next task for a background thread to start on.
+  std::atomic<size_t> next_{0};
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace muon
+
+#endif
@@ -1,24 +1,29 @@
 #include "muon/parser.h"
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/memory/memory.h"
-#include "assimp/Importer.hpp"
-#include "assimp/postprocess.h"
-#include "assimp/scene.h"
 #include "glog/logging.h"
 #include "muon/acceleration.h"
 #include "muon/brdf_type.h"
 #include "muon/defaults.h"
+#include "muon/importer.h"
 #include "muon/lighting.h"
+#include "muon/mesh_file.h"
 #include "muon/objects.h"
+#include "muon/parallel.h"
 #include "muon/random.h"
+#include "muon/scene_cache.h"
 #include "muon/strings.h"
+#include "muon/wide_bvh.h"
 #include "third_party/glm/glm.hpp"
 #include "third_party/glm/gtx/norm.hpp"
 #include "third_party/glm/gtx/transform.hpp"
@@ -34,6 +39,7 @@ enum class ParseCmd {
   kMaxDepth,
   kOutput,
   kGamma,
+  kFrames,
   // Integrator commands.
   kIntegrator,
   kPixelSamples,
@@ -42,6 +48,7 @@ enum class ParseCmd {
   kNextEventEstimation,
   kRussianRoulette,
   kImportanceSampling,
+  kHeatmapScale,
   // Camera commands.
   kCamera,
   // External commands.
@@ -59,6 +66,8 @@ enum class ParseCmd {
   kTranslate,
   kRotate,
   kScale,
+  kTranslatePerFrame,
+  kRotatePerFrame,
   kPushTransform,
   kPopTransform,
   // Light commands.
@@ -76,6 +85,13 @@ enum class ParseCmd {
   kEmission,
 };
 
+// Returns the path of a file referenced by the scene file.
+std::string LoadPath(const std::string &scene_file,
+                     const std::string &filename) {
+  std::filesystem::path p = scene_file;
+  return (p.parent_path() / filename).string();
+}
+
 std::map<std::string, ParseCmd> command_map = {
     {"random_seed", ParseCmd::kRandomSeed},
     {"film_size", ParseCmd::kFilmSize},
@@ -83,6 +99,7 @@ std::map<std::string, ParseCmd> command_map = {
     {"max_depth", ParseCmd::kMaxDepth},
     {"output", ParseCmd::kOutput},
     {"gamma", ParseCmd::kGamma},
+    {"frames", ParseCmd::kFrames},
     {"integrator", ParseCmd::kIntegrator},
     {"pixel_samples", ParseCmd::kPixelSamples},
     {"light_samples", ParseCmd::kLightSamples},
@@ -90,6 +107,7 @@ std::map<std::string, ParseCmd> command_map = {
     {"next_event_estimation", ParseCmd::kNextEventEstimation},
     {"russian_roulette", ParseCmd::kRussianRoulette},
     {"importance_sampling", ParseCmd::kImportanceSampling},
+    {"heatmap_scale", ParseCmd::kHeatmapScale},
     {"camera", ParseCmd::kCamera},
     {"load", ParseCmd::kLoad},
     {"compute_vertex_normals", ParseCmd::kComputeVertexNormals},
@@ -103,6 +121,8 @@ std::map<std::string, ParseCmd> command_map = {
     {"translate", ParseCmd::kTranslate},
     {"rotate", ParseCmd::kRotate},
     {"scale", ParseCmd::kScale},
+    {"translate_per_frame", ParseCmd::kTranslatePerFrame},
+    {"rotate_per_frame", ParseCmd::kRotatePerFrame},
     {"push_transform", ParseCmd::kPushTransform},
     {"pop_transform", ParseCmd::kPopTransform},
     {"directional_light", ParseCmd::kDirectionalLight},
@@ -119,22 +139,29 @@ std::map<std::string, ParseCmd> command_map = {
 };
 
 void ParsingWorkspace::MultiplyTransform(const glm::mat4 &m) {
-  transforms_.back() = std::make_shared<glm::mat4>(*transforms_.back() * m);
-  UpdateCachedTransforms();
-  VLOG(3) << "  Current transform: \n" << pprint(*transforms_.back());
+  SetTransform(transforms_.back()->Multiply(m));
+}
+
+void ParsingWorkspace::MultiplyTranslationPerFrame(
+    const glm::vec3 &translation) {
+  SetTransform(transforms_.back()->MultiplyTranslationPerFrame(translation));
+}
+
+void ParsingWorkspace::MultiplyRotationPerFrame(const glm::vec3 &axis,
+                                                float degrees) {
+  SetTransform(transforms_.back()->MultiplyRotationPerFrame(axis, degrees));
 }
 
 void ParsingWorkspace::PushTransform() {
   // TODO: Add checks for these transform methods.
   transforms_.push_back(transforms_.back());
-  UpdateCachedTransforms();
   VLOG(3) << "  Transform stack size: " << transforms_.size();
-  VLOG(3) << "  Current transform: \n" << pprint(*transforms_.back());
+  VLOG(3) << "  Current transform: \n"
+          << pprint(*transforms_.back()->transform);
 }
 
 void ParsingWorkspace::PopTransform() {
   transforms_.pop_back();
-  UpdateCachedTransforms();
   VLOG(3) << "  Transform stack size: " << transforms_.size();
 }
 
@@ -146,16 +173,69 @@ void ParsingWorkspace::GenMaterial() {
 void ParsingWorkspace::UpdatePrimitive(Primitive &obj) {
   obj.material = material;
 
-  obj.transform = transforms_.back();
-  obj.inv_transform = inv_transform_;
-  obj.inv_transpose_transform = inv_transpose_transform_;
+  const AnimatedTransform &transform = *transforms_.back();
+  obj.transform = transform.transform;
+  obj.inv_transform = transform.inv_transform;
+  obj.inv_transpose_transform = transform.inv_transpose_transform;
+}
+
+void ParsingWorkspace::AddPrimitive(std::unique_ptr<Primitive> obj) {
+  mesh_ = nullptr;
+  accel->AddPrimitive(std::move(obj));
 }
 
-void ParsingWorkspace::UpdateCachedTransforms() {
-  inv_transform_ =
-      std::make_shared<glm::mat4>(glm::inverse(*transforms_.back()));
-  inv_transpose_transform_ =
-      std::make_shared<glm::mat4>(glm::transpose(*inv_transform_));
+void ParsingWorkspace::AddInstance(
+    std::unique_ptr<acceleration::Instance> instance) {
+  mesh_ = nullptr;
+  accel->AddInstance(std::move(instance));
+}
+
+Mesh &ParsingWorkspace::CurrentMesh() {
+  if (mesh_ != nullptr && mesh_->vertices() == scene->vertices() &&
+      mesh_->use_vertex_normals() == scene->compute_vertex_normals &&
+      mesh_->material == material &&
+      mesh_->transform == transforms_.back()->transform) {
+    return *mesh_;
+  }
+  auto mesh = absl::make_unique<Mesh>(scene->vertices(),
+                                      scene->compute_vertex_normals);
+  UpdatePrimitive(*mesh);
+  Mesh *current = mesh.get();
+  AddPrimitive(std::move(mesh));
+  mesh_ = current;
+  meshes_.push_back(current);
+  return *mesh_;
+}
+
+void ParsingWorkspace::CompactMeshVertices() {
+  // A new mesh is started whenever e.g. the material or transform changes, but
+  // the scene's vertices stay shared between them.
+  std::map<const MeshVertices *, int> num_meshes;
+  for (const Mesh *mesh : meshes_) {
+    ++num_meshes[mesh->vertices().get()];
+  }
+  std::vector<std::shared_ptr<MeshVertices>> shared;
+  for (Mesh *mesh : meshes_) {
+    if (num_meshes[mesh->vertices().get()] > 1) {
+      shared.push_back(mesh->vertices());
+      mesh->CompactVertices();
+    }
+  }
+  // The scene still refers to the shared vertices, but nothing reads them
+  // anymore.
+  for (const auto &vertices : shared) {
+    *vertices = MeshVertices();
+  }
+}
+
+void ParsingWorkspace::SetTransform(
+    std::shared_ptr<AnimatedTransform> transform) {
+  if (transform->animated()) {
+    animated_transforms.push_back(transform);
+  }
+  transforms_.back() = std::move(transform);
+  VLOG(3) << "  Current transform: \n"
+          << pprint(*transforms_.back()->transform);
 }
 
 void logBadLine(std::string line) {
@@ -200,6 +280,7 @@ void Parser::ApplyDefaults(ParsingWorkspace &ws) const {
   ws.scene->max_depth = defaults::kMaxDepth;
   ws.scene->output = defaults::kOutput;
   ws.scene->gamma = defaults::kGamma;
+  ws.scene->frames = defaults::kFrames;
   ws.scene->compute_vertex_normals = defaults::kComputeVertexNormals;
   ws.scene->pixel_samples = defaults::kPixelSamples;
   ws.scene->light_samples = defaults::kLightSamples;
@@ -207,23 +288,258 @@ void Parser::ApplyDefaults(ParsingWorkspace &ws) const {
   ws.scene->next_event_estimation = defaults::kNextEventEstimation;
   ws.scene->russian_roulette = defaults::kRussianRoulette;
   ws.scene->importance_sampling = defaults::kImportanceSampling;
+  ws.scene->heatmap_scale = defaults::kHeatmapScale;
   ws.scene->attenuation = defaults::kAttenuation;
 }
 
 std::unique_ptr<acceleration::Structure> Parser::CreateAccelerationStructure()
     const {
   std::unique_ptr<acceleration::Structure> accel;
+  acceleration::BVHBuildOptions bvh_options = {
+      .parallelism = options_.parallelism,
+      .sah_all_axes = options_.sah_all_axes,
+      .traversal_cost = options_.sah_traversal_cost,
+      .intersection_cost = options_.sah_intersection_cost,
+      .max_leaf_primitives = std::min<size_t>(
+          std::max<uint32_t>(options_.max_leaf_primitives, 1),
+          acceleration::kMaxLeafPrimitives),
+      .sbvh_duplication_budget = options_.sbvh_duplication_budget,
+      .refit_rebuild_threshold = options_.refit_rebuild_threshold,
+  };
   switch (options_.acceleration) {
     case AccelerationType::kLinear:
       accel = absl::make_unique<acceleration::Linear>();
       break;
     case AccelerationType::kBVH:
-      accel = absl::make_unique<acceleration::BVH>(options_.partition_strategy);
+      accel = absl::make_unique<acceleration::BVH>(options_.partition_strategy,
+                                                   bvh_options);
+      break;
+    case AccelerationType::kBVH4:
+      accel = absl::make_unique<acceleration::BVH4>(
+          options_.partition_strategy, bvh_options);
+      break;
+    case AccelerationType::kBVH8:
+      accel = absl::make_unique<acceleration::BVH8>(
+          options_.partition_strategy, bvh_options);
+      break;
+    case AccelerationType::kCompressedBVH4:
+      accel = absl::make_unique<acceleration::CompressedBVH4>(
+          options_.partition_strategy, bvh_options);
+      break;
+    case AccelerationType::kCompressedBVH8:
+      accel = absl::make_unique<acceleration::CompressedBVH8>(
+          options_.partition_strategy, bvh_options);
       break;
   }
   return accel;
 }
 
+void Parser::AddBuildOptionsToKey(CacheKey &key) const {
+  key.Add(options_.acceleration);
+  key.Add(options_.partition_strategy);
+  key.Add(options_.sah_all_axes);
+  key.Add(options_.sah_traversal_cost);
+  key.Add(options_.sah_intersection_cost);
+  key.Add(options_.max_leaf_primitives);
+  key.Add(options_.sbvh_duplication_budget);
+  key.Add(options_.pretransform_tris);
+}
+
+std::string Parser::CachePath(const CacheKey &key,
+                              const std::string &extension) const {
+  std::filesystem::path dir = options_.scene_cache_dir;
+  return (dir / (key.ToString() + "." + extension)).string();
+}
+
+std::string Parser::LoadKey(const LoadRequest &request) {
+  return request.path + (request.compute_vertex_normals ? ":normals" : "");
+}
+
+std::vector<std::pair<std::string, Parser::LoadRequest>> Parser::ScanLoads(
+    const ParsingWorkspace &ws) const {
+  std::vector<std::pair<std::string, LoadRequest>> loads;
+  bool compute_vertex_normals = ws.scene->compute_vertex_normals;
+  std::ifstream infile(scene_file_);
+  std::string line;
+  std::istringstream iss;
+  while (std::getline(infile, line)) {
+    trim(line);
+    if (line.size() == 0 || line[0] == '#') {
+      continue;
+    }
+    iss.clear();
+    iss.str(line);
+    std::string cmd, arg;
+    iss >> cmd >> arg;
+    if (iss.fail()) {
+      continue;
+    }
+    // Only the commands that affect loading are followed; Parse() reports any
+    // errors in them.
+    if (cmd == "compute_vertex_normals") {
+      if (arg == "on") {
+        compute_vertex_normals = true;
+      } else if (arg == "off") {
+        compute_vertex_normals = false;
+      }
+    } else if (cmd == "load") {
+      LoadRequest request = {LoadPath(scene_file_, arg),
+                             compute_vertex_normals, ws.material};
+      loads.emplace_back(LoadKey(request), std::move(request));
+    }
+  }
+  return loads;
+}
+
+std::vector<std::shared_ptr<const acceleration::Structure>>
+Parser::LoadMeshes(const LoadRequest &request) const {
+  const std::string &path = request.path;
+  std::vector<std::shared_ptr<const acceleration::Structure>> meshes;
+  // Native mesh files are mapped rather than imported. Their geometry is used
+  // in place, so the cache only holds their structures.
+  bool native = IsMeshFile(path);
+  std::vector<MeshData> geometry;
+  if (native && !ReadMeshFile(path, geometry)) {
+    return meshes;
+  }
+  // Cached meshes are keyed by the contents of the file and everything that
+  // affects how their tris and structures are built.
+  CacheKey key;
+  std::string cache_path;
+  bool cached = !options_.scene_cache_dir.empty() && key.AddFile(path);
+  if (cached) {
+    key.Add(request.compute_vertex_normals);
+    key.Add(options_.import_steps.flags);
+    AddBuildOptionsToKey(key);
+    cache_path = CachePath(key, "mesh");
+    if (auto reader = CacheReader::Open(cache_path, key)) {
+      uint64_t num_meshes = 0;
+      bool ok = reader->Read(num_meshes) &&
+                (!native || num_meshes == geometry.size());
+      for (uint64_t i = 0; ok && i < num_meshes; ++i) {
+        MeshData mesh;
+        if (native) {
+          mesh = std::move(geometry[i]);
+        } else {
+          std::vector<glm::vec3> positions;
+          std::vector<uint32_t> indices;
+          ok = reader->ReadVector(positions) && reader->ReadVector(indices);
+          for (uint32_t index : indices) {
+            ok = ok && index < positions.size();
+          }
+          mesh.positions = std::move(positions);
+          mesh.indices = std::move(indices);
+        }
+        if (!ok) {
+          break;
+        }
+        std::shared_ptr<acceleration::Structure> mesh_accel =
+            CreateMesh(request, std::move(mesh));
+        ok = mesh_accel->LoadFromCache(*reader);
+        meshes.push_back(std::move(mesh_accel));
+      }
+      if (ok && reader->AtEnd()) {
+        VLOG(1) << "Loaded " << path << " from the scene cache";
+        return meshes;
+      }
+      LOG(WARNING) << "Ignoring corrupt cache file: " << cache_path;
+      meshes.clear();
+      // The mapped geometry may have been moved into the discarded meshes.
+      if (native && !ReadMeshFile(path, geometry)) {
+        return meshes;
+      }
+    }
+  }
+
+  // The geometry is moved into the meshes, so it's written to the cache as it
+  // goes.
+  if (!native) {
+    geometry = ImportMeshes(path, options_.import_steps);
+  }
+  CacheWriter writer(key);
+  writer.Write(uint64_t(geometry.size()));
+  bool saved = cached;
+  for (MeshData &mesh : geometry) {
+    if (saved && !native) {
+      writer.WriteArray(mesh.positions.data(), mesh.positions.size());
+      writer.WriteArray(mesh.indices.data(), mesh.indices.size());
+    }
+    std::shared_ptr<acceleration::Structure> mesh_accel =
+        CreateMesh(request, std::move(mesh));
+    mesh_accel->Init();
+    saved = saved && mesh_accel->SaveToCache(writer);
+    meshes.push_back(std::move(mesh_accel));
+  }
+  if (saved) {
+    writer.Commit(cache_path);
+  }
+  return meshes;
+}
+
+std::unique_ptr<acceleration::Structure> Parser::CreateMesh(
+    const LoadRequest &request, MeshData mesh) const {
+  std::unique_ptr<acceleration::Structure> mesh_accel =
+      CreateAccelerationStructure();
+  auto vertices = std::make_shared<MeshVertices>();
+  vertices->positions = std::move(mesh.positions);
+  // Unless the mesh comes with vertex normals, they're accumulated from the
+  // tris' face normals as the tris are added.
+  bool accumulate_normals =
+      request.compute_vertex_normals && mesh.normals.empty();
+  if (accumulate_normals) {
+    vertices->normals.assign(vertices->positions.size(), glm::vec3(0.0f));
+  } else if (request.compute_vertex_normals) {
+    vertices->normals = std::move(mesh.normals);
+  }
+  auto tris = absl::make_unique<Mesh>(std::move(vertices),
+                                      request.compute_vertex_normals);
+  // The geometry is in the mesh's object coordinates, so it's given an
+  // identity transform; instances of the mesh apply the actual transform.
+  tris->material = request.material;
+  auto identity = std::make_shared<glm::mat4>(1.0f);
+  tris->transform = identity;
+  tris->inv_transform = identity;
+  tris->inv_transpose_transform = identity;
+  if (accumulate_normals) {
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+      tris->AddTriangle(mesh.indices[i], mesh.indices[i + 1],
+                        mesh.indices[i + 2]);
+    }
+  } else {
+    tris->SetTriangles(std::move(mesh.indices));
+  }
+  mesh_accel->AddPrimitive(std::move(tris));
+  if (options_.pretransform_tris) {
+    mesh_accel->PreTransformPrimitives();
+  }
+  return mesh_accel;
+}
+
+void Parser::InitTopLevel(ParsingWorkspace &ws) const {
+  if (options_.scene_cache_dir.empty()) {
+    ws.accel->Init();
+    return;
+  }
+  // The top-level structure is keyed by its primitives rather than the scene
+  // file, so that it's reused when only e.g. the camera or sampling changes.
+  CacheKey key;
+  AddBuildOptionsToKey(key);
+  ws.accel->AddToCacheKey(key);
+  std::string cache_path = CachePath(key, "accel");
+  if (auto reader = CacheReader::Open(cache_path, key)) {
+    if (ws.accel->LoadFromCache(*reader) && reader->AtEnd()) {
+      VLOG(1) << "Loaded the acceleration structure from the scene cache";
+      return;
+    }
+    LOG(WARNING) << "Ignoring corrupt cache file: " << cache_path;
+  }
+  ws.accel->Init();
+  CacheWriter writer(key);
+  if (ws.accel->SaveToCache(writer)) {
+    writer.Commit(cache_path);
+  }
+}
+
 // TODO: Instead of constructing the scene in-line, we should pull this into an
 // intermediate format and build the scene from that. That way future supported
 // file types don't need duplicate construction logic (only parsing logic).
@@ -235,8 +551,34 @@ SceneConfig Parser::Parse() {
 
   VLOG(1) << "Reading from input: " << scene_file_;
 
+  // With several threads, the files of `load` commands are loaded in the
+  // background while the scene file is parsed, in the order that they're
+  // needed. Each `load` then takes its file's meshes, so that instances are
+  // still created in order, with the working properties of their command.
+  std::map<std::string, size_t> load_tasks;
+  std::unique_ptr<BackgroundTasks<
+      std::vector<std::shared_ptr<const acceleration::Structure>>>>
+      loads;
+  if (options_.parallelism > 1) {
+    std::vector<std::function<
+        std::vector<std::shared_ptr<const acceleration::Structure>>()>>
+        fns;
+    for (auto &[key, request] : ScanLoads(ws)) {
+      if (load_tasks.emplace(key, fns.size()).second) {
+        fns.push_back([this, request = std::move(request)] {
+          return LoadMeshes(request);
+        });
+      }
+    }
+    loads = absl::make_unique<BackgroundTasks<
+        std::vector<std::shared_ptr<const acceleration::Structure>>>>(
+        std::move(fns), options_.parallelism - 1);
+  }
+
   std::ifstream infile(scene_file_);
   std::string line;
+  // Reused for each line, so that its buffer is only allocated once.
+  std::istringstream iss;
   while (std::getline(infile, line)) {
     trim(line);
 
@@ -246,7 +588,8 @@ SceneConfig Parser::Parse() {
     }
 
     VLOG(3) << "Read line: " << line;
-    std::istringstream iss(line);
+    iss.clear();
+    iss.str(line);
 
     // Extract command.
     std::string cmd;
@@ -325,6 +668,16 @@ SceneConfig Parser::Parse() {
         }
         ws.scene->gamma = gamma;
         break;
+      }
+      case ParseCmd::kFrames: {
+        int frames;
+        iss >> frames;
+        if (iss.fail() || frames < 1) {
+          logBadLine(line);
+          break;
+        }
+        ws.scene->frames = frames;
+        break;
       }
         // Integrator commands.
       case ParseCmd::kIntegrator: {
@@ -340,6 +693,8 @@ SceneConfig Parser::Parse() {
           ws.integrator = absl::make_unique<AlbedoTracer>(*ws.scene);
         } else if (type == "depth") {
           ws.integrator = absl::make_unique<DepthTracer>(*ws.scene);
+        } else if (type == "heatmap") {
+          ws.integrator = absl::make_unique<HeatmapTracer>(*ws.scene);
         } else if (type == "raytracer") {
           ws.integrator = absl::make_unique<Raytracer>(*ws.scene);
         } else if (type == "analyticdirect") {
@@ -347,6 +702,9 @@ SceneConfig Parser::Parse() {
         } else if (type == "pathtracer") {
           ws.integrator =
               absl::make_unique<PathTracer>(*ws.scene, ws.seedgen->Next());
+        } else if (type == "wavefront") {
+          ws.integrator = absl::make_unique<WavefrontPathTracer>(
+              *ws.scene, ws.seedgen->Next());
         } else {
           logBadLine(line);
           break;
@@ -444,6 +802,16 @@ SceneConfig Parser::Parse() {
           break;
         }
         break;
+      }
+      case ParseCmd::kHeatmapScale: {
+        float heatmap_scale;
+        iss >> heatmap_scale;
+        if (iss.fail() || heatmap_scale <= 0.0f) {
+          logBadLine(line);
+          break;
+        }
+        ws.scene->heatmap_scale = heatmap_scale;
+        break;
       }
         // Camera commands.
       case ParseCmd::kCamera: {
@@ -469,93 +837,28 @@ SceneConfig Parser::Parse() {
           logBadLine(line);
           break;
         }
-        // Attempt to load file.
-        // TODO: Move this to a separate importer library.
+        // Attempt to load file, unless it's already been loaded. Meshes are
+        // loaded into their own bottom-level structures, which are shared
+        // between all instances of the file.
         VLOG(3) << "Loading external file: " << filename;
-        std::filesystem::path p = scene_file_;
-        Assimp::Importer importer;
-        const aiScene *scene =
-            importer.ReadFile(p.parent_path() / filename,
-                              aiProcessPreset_TargetRealtime_MaxQuality);
-        if (!scene) {
-          LOG(WARNING) << "Error during load: " << importer.GetErrorString();
-          break;
-        }
-        // TODO: Instead of just loading meshes without a transform, load the
-        // assimp scene's hierarchical nodes.
-        if (scene->mRootNode != nullptr) {
-          VLOG(3) << "Root node contains " << scene->mRootNode->mNumChildren
-                  << " children";
-          auto &trans = scene->mRootNode->mTransformation;
-          // clang-format off
-          VLOG(3) << "Root node transform: \n"
-            << trans.a1 << " " << trans.a2 << " " << trans.a3 << " " << trans.a4 << "\n"
-            << trans.b1 << " " << trans.b2 << " " << trans.b3 << " " << trans.b4 << "\n"
-            << trans.c1 << " " << trans.c2 << " " << trans.c3 << " " << trans.c4 << "\n"
-            << trans.d1 << " " << trans.d2 << " " << trans.d3 << " " << trans.d4 << "\n";
-          // clang-format on
-        }
-        if (scene->HasMeshes()) {
-          VLOG(3) << "  Contains " << scene->mNumMeshes << " meshes";
-          for (unsigned int mesh_idx = 0; mesh_idx < scene->mNumMeshes;
-               ++mesh_idx) {
-            const aiMesh *mesh = scene->mMeshes[mesh_idx];
-            if (mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE) {
-              LOG(WARNING)
-                  << " Skipping mesh #" << mesh_idx
-                  << " (name: " << mesh->mName.C_Str()
-                  << "), which contains non-triangular primitive types: "
-                  << mesh->mPrimitiveTypes;
-              continue;
-            }
-            if (!mesh->HasFaces()) {
-              VLOG(3) << " Skipping mesh #" << mesh_idx << " ("
-                      << mesh->mName.C_Str() << "), which contains no faces";
-              continue;
-            }
-            VLOG(3) << "  Mesh #" << mesh_idx << " with " << mesh->mNumVertices
-                    << " vertices and " << mesh->mNumFaces << " faces";
-
-            // Create the vertices.
-            // TODO: Switch this to use the actual mesh logic.
-            std::vector<std::reference_wrapper<Vertex>> vertex_refs;
-            const aiVector3D *vertices = mesh->mVertices;
-            for (unsigned int vertex_idx = 0; vertex_idx < mesh->mNumVertices;
-                 ++vertex_idx) {
-              Vertex &v = ws.scene->GenVertex();
-              v.pos.x = vertices[vertex_idx].x;
-              v.pos.y = vertices[vertex_idx].y;
-              v.pos.z = vertices[vertex_idx].z;
-              vertex_refs.push_back(v);
-            }
-
-            // Create the tris.
-            for (unsigned int tri_idx = 0; tri_idx < mesh->mNumFaces;
-                 ++tri_idx) {
-              const aiFace &face = mesh->mFaces[tri_idx];
-              if (face.mNumIndices != 3) {
-                LOG(WARNING) << "  Encountered a non-triangle face!";
-                break;
-              }
-              const unsigned int v0 = face.mIndices[0];
-              const unsigned int v1 = face.mIndices[1];
-              const unsigned int v2 = face.mIndices[2];
-
-              auto tri = absl::make_unique<Tri>(
-                  vertex_refs[v0].get(), vertex_refs[v1].get(),
-                  vertex_refs[v2].get(), ws.scene->compute_vertex_normals);
-              ws.UpdatePrimitive(*tri);
-              if (ws.scene->compute_vertex_normals) {
-                // Compute vertex normals additively. We will later need to
-                // normalize these.
-                auto normal = tri->Normal();
-                vertex_refs[v0].get().normal += normal;
-                vertex_refs[v1].get().normal += normal;
-                vertex_refs[v2].get().normal += normal;
-              }
-              ws.accel->AddPrimitive(std::move(tri));
-            }
-          }
+        LoadRequest request = {LoadPath(scene_file_, filename),
+                               ws.scene->compute_vertex_normals, ws.material};
+        std::string key = LoadKey(request);
+        auto loaded = ws.loaded_meshes.find(key);
+        if (loaded == ws.loaded_meshes.end()) {
+          auto task = load_tasks.find(key);
+          loaded = ws.loaded_meshes
+                       .emplace(key, task != load_tasks.end()
+                                         ? loads->Take(task->second)
+                                         : LoadMeshes(request))
+                       .first;
+        } else {
+          VLOG(3) << "  Instancing previously loaded meshes";
+        }
+        for (const auto &mesh : loaded->second) {
+          auto instance = absl::make_unique<acceleration::Instance>(mesh);
+          ws.UpdatePrimitive(*instance);
+          ws.AddInstance(std::move(instance));
         }
         break;
       }
@@ -586,7 +889,7 @@ SceneConfig Parser::Parse() {
         }
         auto sphere = absl::make_unique<Sphere>(glm::vec3(x, y, z), radius);
         ws.UpdatePrimitive(*sphere);
-        ws.accel->AddPrimitive(std::move(sphere));
+        ws.AddPrimitive(std::move(sphere));
         break;
       }
       case ParseCmd::kStartMesh: {
@@ -604,11 +907,8 @@ SceneConfig Parser::Parse() {
           logBadLine(line);
           break;
         }
-        Vertex vert;
-        vert.pos = glm::vec3(x, y, z);
         // We initialize the normals later.
-        vert.normal = glm::vec3(0.0f);
-        ws.scene->AddVertex(vert);
+        ws.scene->AddVertex(glm::vec3(x, y, z));
         break;
       }
       case ParseCmd::kVertexNormal: {
@@ -622,20 +922,15 @@ SceneConfig Parser::Parse() {
           logBadLine(line);
           break;
         }
-        auto &vertices = ws.scene->vertices();
-        auto tri =
-            absl::make_unique<Tri>(vertices[v0], vertices[v1], vertices[v2],
-                                   ws.scene->compute_vertex_normals);
-        ws.UpdatePrimitive(*tri);
-        if (ws.scene->compute_vertex_normals) {
-          // Compute vertex normals additively. We will later need to normalize
-          // these.
-          auto normal = tri->Normal();
-          vertices[v0].normal += normal;
-          vertices[v1].normal += normal;
-          vertices[v2].normal += normal;
+        int num_vertices = ws.scene->vertices()->positions.size();
+        if (std::min({v0, v1, v2}) < 0 ||
+            std::max({v0, v1, v2}) >= num_vertices) {
+          logBadLine(line);
+          break;
         }
-        ws.accel->AddPrimitive(std::move(tri));
+        // With vertex normals, this computes them additively. We will later
+        // need to normalize these.
+        ws.CurrentMesh().AddTriangle(v0, v1, v2);
         break;
       }
       case ParseCmd::kTriNormal: {
@@ -674,6 +969,26 @@ SceneConfig Parser::Parse() {
         ws.MultiplyTransform(glm::scale(glm::vec3(x, y, z)));
         break;
       }
+      case ParseCmd::kTranslatePerFrame: {
+        float x, y, z;
+        iss >> x >> y >> z;
+        if (iss.fail()) {
+          logBadLine(line);
+          break;
+        }
+        ws.MultiplyTranslationPerFrame(glm::vec3(x, y, z));
+        break;
+      }
+      case ParseCmd::kRotatePerFrame: {
+        float x, y, z, angle;
+        iss >> x >> y >> z >> angle;
+        if (iss.fail()) {
+          logBadLine(line);
+          break;
+        }
+        ws.MultiplyRotationPerFrame(glm::vec3(x, y, z), angle);
+        break;
+      }
       case ParseCmd::kPushTransform: {
         ws.PushTransform();
         break;
@@ -733,34 +1048,24 @@ SceneConfig Parser::Parse() {
         auto light = absl::make_unique<QuadLight>(color, corner, edge0, edge1);
 
         // Also create two tris to represent the area light itself.
-        Vertex &va = ws.scene->GenVertex();
-        Vertex &vb = ws.scene->GenVertex();
-        Vertex &vc = ws.scene->GenVertex();
-        Vertex &vd = ws.scene->GenVertex();
-        va.pos = corner;
-        vb.pos = corner + edge0;
-        vc.pos = corner + edge1;
-        vd.pos = corner + edge0 + edge1;
-
-        // TODO: This is pretty gross. Can we improve this?
-        auto tri0 = absl::make_unique<Tri>(va, vc, vb, false);
-        auto tri1 = absl::make_unique<Tri>(vb, vc, vd, false);
+        auto vertices = std::make_shared<MeshVertices>();
+        vertices->Add(corner);
+        vertices->Add(corner + edge0);
+        vertices->Add(corner + edge1);
+        vertices->Add(corner + edge0 + edge1);
+        auto tris = absl::make_unique<Mesh>(std::move(vertices), false);
+        tris->AddTriangle(0, 2, 1);
+        tris->AddTriangle(1, 2, 3);
         auto material = std::make_shared<Material>();
         material->SetBRDF(CreateBRDF(defaults::kBRDF));
         material->emission = color;  // Emit based on color.
         std::shared_ptr<glm::mat4> identity = std::make_shared<glm::mat4>(1.0f);
-        tri0->material = material;
-        tri0->light = light.get();
-        tri0->transform = identity;
-        tri0->inv_transform = identity;
-        tri0->inv_transpose_transform = identity;
-        tri1->material = material;
-        tri1->light = light.get();
-        tri1->transform = identity;
-        tri1->inv_transform = identity;
-        tri1->inv_transpose_transform = identity;
-        ws.accel->AddPrimitive(std::move(tri0));
-        ws.accel->AddPrimitive(std::move(tri1));
+        tris->material = material;
+        tris->light = light.get();
+        tris->transform = identity;
+        tris->inv_transform = identity;
+        tris->inv_transpose_transform = identity;
+        ws.AddPrimitive(std::move(tris));
 
         ws.scene->AddLight(std::move(light));
         break;
@@ -862,15 +1167,22 @@ SceneConfig Parser::Parse() {
   if (ws.scene->compute_vertex_normals) {
     // Normalize vertex normals for all meshes.
     for (auto &mesh : ws.scene->meshes()) {
-      for (auto &vertex : mesh) {
-        if (glm::length2(vertex.normal) > 0.0f) {
-          vertex.normal = glm::normalize(vertex.normal);
+      glm::vec3 *normals = mesh->normals.mutable_data();
+      for (size_t i = 0; i < mesh->normals.size(); ++i) {
+        if (glm::length2(normals[i]) > 0.0f) {
+          normals[i] = glm::normalize(normals[i]);
         }
       }
     }
   }
 
-  ws.accel->Init();
+  ws.CompactMeshVertices();
+
+  if (options_.pretransform_tris) {
+    ws.accel->PreTransformPrimitives();
+  }
+  InitTopLevel(ws);
+  ws.scene->animated_transforms = std::move(ws.animated_transforms);
   ws.scene->seedgen = std::move(ws.seedgen);
   ws.scene->root = std::move(ws.accel);
   return {
@@ -1,16 +1,23 @@
 #ifndef MUON_PARSER_H_
 #define MUON_PARSER_H_
 
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "muon/acceleration.h"
 #include "muon/acceleration_type.h"
+#include "muon/animation.h"
+#include "muon/importer.h"
 #include "muon/integration.h"
 #include "muon/materials.h"
 #include "muon/options.h"
 #include "muon/random.h"
 #include "muon/scene.h"
+#include "muon/scene_cache.h"
+#include "third_party/glm/glm.hpp"
 
 namespace muon {
 
@@ -34,6 +41,10 @@ class ParsingWorkspace {
 
   // Multiplies the top of the stack with the given transform matrix.
   void MultiplyTransform(const glm::mat4 &m);
+  // Multiplies the top of the stack with a translation or rotation that's
+  // repeated every frame (see AnimatedTransform).
+  void MultiplyTranslationPerFrame(const glm::vec3 &translation);
+  void MultiplyRotationPerFrame(const glm::vec3 &axis, float degrees);
   // Pushes the current transform on to the stack.
   void PushTransform();
   // Pops the current transform from the stack.
@@ -45,16 +56,43 @@ class ParsingWorkspace {
   // Applies current working properties to the given primitive.
   void UpdatePrimitive(Primitive &obj);
 
+  // Adds a primitive or an instance to the acceleration structure. Tris added
+  // afterwards go into a new mesh, so that primitives stay in the order they
+  // were specified.
+  void AddPrimitive(std::unique_ptr<Primitive> obj);
+  void AddInstance(std::unique_ptr<acceleration::Instance> instance);
+  // Returns the mesh that tris specified in the scene file are added to. It
+  // uses the current vertices and working properties; consecutive tris share
+  // a mesh as long as those don't change.
+  Mesh &CurrentMesh();
+  // Gives each mesh returned by CurrentMesh() that shares its vertices with
+  // others a copy of only the vertices it uses (see Mesh::CompactVertices()),
+  // and then releases the shared vertices. Must be called once the vertex
+  // normals are final.
+  void CompactMeshVertices();
+
+  // The bottom-level structures for the meshes of each loaded file, so that
+  // files which are loaded several times share their geometry.
+  std::map<std::string,
+           std::vector<std::shared_ptr<const acceleration::Structure>>>
+      loaded_meshes;
+
+  // The transforms that change between frames.
+  std::vector<std::shared_ptr<AnimatedTransform>> animated_transforms;
+
  private:
-  void UpdateCachedTransforms();
-
-  // Transform stack.
-  std::vector<std::shared_ptr<glm::mat4>> transforms_ = {
-      std::make_shared<glm::mat4>(1.0f)};
-  // Cached transforms.
-  std::shared_ptr<glm::mat4> inv_transform_ = std::make_shared<glm::mat4>(1.0f);
-  std::shared_ptr<glm::mat4> inv_transpose_transform_ =
-      std::make_shared<glm::mat4>(1.0f);
+  // Replaces the top of the stack.
+  void SetTransform(std::shared_ptr<AnimatedTransform> transform);
+
+  // Transform stack. Primitives share the matrices of the transform they were
+  // created with.
+  std::vector<std::shared_ptr<AnimatedTransform>> transforms_ = {
+      std::make_shared<AnimatedTransform>()};
+  // The mesh returned by CurrentMesh(), which is owned by the acceleration
+  // structure, or null if a new one is needed.
+  Mesh *mesh_ = nullptr;
+  // All of the meshes that CurrentMesh() has created, in order.
+  std::vector<Mesh *> meshes_;
 };
 
 // Represents a configuration of a scene along with its supporting structures.
@@ -80,8 +118,46 @@ class Parser {
   std::string scene_file_;
   const Options &options_;
 
+  // A file to load meshes from, along with the working properties that they
+  // depend on, so that it can be loaded off of the parsing thread.
+  struct LoadRequest {
+    std::string path;
+    bool compute_vertex_normals;
+    // The material given to the meshes. It's only a placeholder, since their
+    // instances have materials of their own.
+    std::shared_ptr<Material> material;
+  };
+
   void ApplyDefaults(ParsingWorkspace &workspace) const;
   std::unique_ptr<acceleration::Structure> CreateAccelerationStructure() const;
+  // Returns the key of a loaded file in ParsingWorkspace::loaded_meshes. Since
+  // whether vertex normals are used affects the triangles themselves, it's part
+  // of the key.
+  static std::string LoadKey(const LoadRequest &request);
+  // Returns the files loaded by the scene file's `load` commands, in order,
+  // along with their keys in ParsingWorkspace::loaded_meshes.
+  std::vector<std::pair<std::string, LoadRequest>> ScanLoads(
+      const ParsingWorkspace &ws) const;
+  // Loads the meshes in the given file, which is either a native mesh file or
+  // any model that Assimp can import, and returns an initialized bottom-level
+  // structure for each one. With a scene cache, the meshes and their structures
+  // are loaded from the cache if the file has been loaded before. Thread safe.
+  std::vector<std::shared_ptr<const acceleration::Structure>> LoadMeshes(
+      const LoadRequest &request) const;
+  // Creates a mesh primitive out of the given geometry, and returns an
+  // uninitialized bottom-level structure containing it.
+  std::unique_ptr<acceleration::Structure> CreateMesh(
+      const LoadRequest &request, MeshData mesh) const;
+  // Initializes the top-level structure, loading it from the scene cache
+  // instead if it was built over the same primitives before.
+  void InitTopLevel(ParsingWorkspace &ws) const;
+
+  // Adds the options that affect how acceleration structures are built to a
+  // cache key.
+  void AddBuildOptionsToKey(CacheKey &key) const;
+  // Returns the path of the file in the scene cache with the given key.
+  std::string CachePath(const CacheKey &key,
+                        const std::string &extension) const;
 };
 
 }  // namespace muon
@@ -1,5 +1,8 @@
 #include "muon/ray.h"
 
+#include <cmath>
+#include <limits>
+
 #include "muon/transform.h"
 
 namespace muon {
@@ -12,4 +15,20 @@ Ray Ray::Transform(const glm::mat4 &transform) const {
 
 glm::vec3 Ray::At(float t) const { return origin_ + direction_ * t; }
 
+TraversalRay::TraversalRay(const Ray &ray)
+    : origin(ray.origin()), direction(ray.direction()) {
+  for (int axis = 0; axis < 3; ++axis) {
+    // Avoid dividing by zero (which would trap when floating point exceptions
+    // are enabled); an infinite inverse makes the slab test for the axis either
+    // always or never pass, depending on the origin.
+    inv_direction[axis] =
+        direction[axis] == 0.0f
+            ? std::copysign(std::numeric_limits<float>::infinity(),
+                            direction[axis])
+            : 1.0f / direction[axis];
+    // Use the sign bit so that -0 matches its negative infinite inverse.
+    dir_is_negative[axis] = std::signbit(direction[axis]);
+  }
+}
+
 }  // namespace muon
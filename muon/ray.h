@@ -24,6 +24,20 @@ class Ray {
   glm::vec3 direction_;
 };
 
+// A ray with additional values precomputed once per ray, which speed up the
+// many ray-box tests performed while traversing acceleration structures.
+struct TraversalRay {
+  explicit TraversalRay(const Ray &ray);
+
+  glm::vec3 origin;
+  glm::vec3 direction;
+  // The component-wise inverse of the direction. Components for which the
+  // direction is zero are signed infinities.
+  glm::vec3 inv_direction;
+  // Whether the direction is negative along each axis (i.e. the sign bits).
+  int dir_is_negative[3];
+};
+
 }  // namespace muon
 
 #endif
@@ -0,0 +1,174 @@
+#include "muon/ray_packet.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace muon {
+
+namespace {
+
+// Returns the smallest and largest of the products of a value in [a0, a1] and
+// one in [b0, b1], which are attained at the corners of the ranges. Since
+// rounding is monotonic, they also bound the rounded products.
+float MinProduct(float a0, float a1, float b0, float b1) {
+  return std::min(std::min(a0 * b0, a0 * b1), std::min(a1 * b0, a1 * b1));
+}
+
+float MaxProduct(float a0, float a1, float b0, float b1) {
+  return std::max(std::max(a0 * b0, a0 * b1), std::max(a1 * b0, a1 * b1));
+}
+
+#if defined(__AVX__)
+// Tests eight consecutive rays of a packet, starting at `lane`, against a box.
+// Returns a bitmask of the rays that hit it. This performs the same operations
+// in the same order as Bounds::HasIntersection(), so the results match.
+uint32_t IntersectEightLanes(const Bounds &bounds, const RayPacket &packet,
+                             int lane, const float *max_distance) {
+  const __m256 error_scale = _mm256_set1_ps(kSlabErrorScale);
+  __m256 t_min = _mm256_setzero_ps();
+  __m256 t_max = _mm256_loadu_ps(max_distance + lane);
+  for (int axis = 2; axis >= 0; --axis) {
+    int near = packet.dir_is_negative[axis];
+    __m256 near_plane =
+        _mm256_set1_ps(near ? bounds.max_pos[axis] : bounds.min_pos[axis]);
+    __m256 far_plane =
+        _mm256_set1_ps(near ? bounds.min_pos[axis] : bounds.max_pos[axis]);
+    __m256 origin = _mm256_load_ps(&packet.origin[axis][lane]);
+    __m256 inv_direction = _mm256_load_ps(&packet.inv_direction[axis][lane]);
+    __m256 t_near =
+        _mm256_mul_ps(_mm256_sub_ps(near_plane, origin), inv_direction);
+    __m256 t_far =
+        _mm256_mul_ps(_mm256_sub_ps(far_plane, origin), inv_direction);
+    // As with SlabMax() and SlabMin(), these return their second operand if
+    // either operand is NaN.
+    t_min = _mm256_max_ps(t_near, t_min);
+    t_max = _mm256_min_ps(_mm256_mul_ps(t_far, error_scale), t_max);
+  }
+  return _mm256_movemask_ps(_mm256_cmp_ps(t_min, t_max, _CMP_LE_OQ));
+}
+#elif defined(__SSE2__)
+// Tests four consecutive rays of a packet. See IntersectEightLanes() above.
+uint32_t IntersectFourLanes(const Bounds &bounds, const RayPacket &packet,
+                            int lane, const float *max_distance) {
+  const __m128 error_scale = _mm_set1_ps(kSlabErrorScale);
+  __m128 t_min = _mm_setzero_ps();
+  __m128 t_max = _mm_loadu_ps(max_distance + lane);
+  for (int axis = 2; axis >= 0; --axis) {
+    int near = packet.dir_is_negative[axis];
+    __m128 near_plane =
+        _mm_set1_ps(near ? bounds.max_pos[axis] : bounds.min_pos[axis]);
+    __m128 far_plane =
+        _mm_set1_ps(near ? bounds.min_pos[axis] : bounds.max_pos[axis]);
+    __m128 origin = _mm_load_ps(&packet.origin[axis][lane]);
+    __m128 inv_direction = _mm_load_ps(&packet.inv_direction[axis][lane]);
+    __m128 t_near = _mm_mul_ps(_mm_sub_ps(near_plane, origin), inv_direction);
+    __m128 t_far = _mm_mul_ps(_mm_sub_ps(far_plane, origin), inv_direction);
+    t_min = _mm_max_ps(t_near, t_min);
+    t_max = _mm_min_ps(_mm_mul_ps(t_far, error_scale), t_max);
+  }
+  return _mm_movemask_ps(_mm_cmple_ps(t_min, t_max));
+}
+#endif
+
+}  // namespace
+
+RayPacket::RayPacket(const Ray *rays, int num_rays)
+    : num_rays(num_rays), coherent(true), has_intervals(true) {
+  assert(num_rays > 0 && num_rays <= kMaxRayPacketSize);
+  for (int i = 0; i < kMaxRayPacketSize; ++i) {
+    TraversalRay ray(rays[i < num_rays ? i : 0]);
+    for (int axis = 0; axis < 3; ++axis) {
+      origin[axis][i] = ray.origin[axis];
+      inv_direction[axis][i] = ray.inv_direction[axis];
+      if (i == 0) {
+        dir_is_negative[axis] = ray.dir_is_negative[axis];
+        min_origin[axis] = max_origin[axis] = ray.origin[axis];
+        min_inv_direction[axis] = max_inv_direction[axis] =
+            ray.inv_direction[axis];
+      }
+      coherent &= ray.dir_is_negative[axis] == dir_is_negative[axis];
+      has_intervals &= std::isfinite(ray.inv_direction[axis]);
+      min_origin[axis] = std::min(min_origin[axis], ray.origin[axis]);
+      max_origin[axis] = std::max(max_origin[axis], ray.origin[axis]);
+      min_inv_direction[axis] =
+          std::min(min_inv_direction[axis], ray.inv_direction[axis]);
+      max_inv_direction[axis] =
+          std::max(max_inv_direction[axis], ray.inv_direction[axis]);
+    }
+  }
+  has_intervals &= coherent;
+}
+
+bool PacketMissesBounds(const Bounds &bounds, const RayPacket &packet,
+                        float max_distance) {
+  if (!packet.has_intervals) {
+    return false;
+  }
+  // Bound the slab distances of all rays at once: the smallest distance to the
+  // near plane and the largest distance to the far plane on each axis. If even
+  // these leave an empty window, every ray's window is empty.
+  float t_min = 0.0f;
+  float t_max = max_distance;
+  for (int axis = 0; axis < 3; ++axis) {
+    int near = packet.dir_is_negative[axis];
+    float near_plane = near ? bounds.max_pos[axis] : bounds.min_pos[axis];
+    float far_plane = near ? bounds.min_pos[axis] : bounds.max_pos[axis];
+    float t_near = MinProduct(near_plane - packet.max_origin[axis],
+                              near_plane - packet.min_origin[axis],
+                              packet.min_inv_direction[axis],
+                              packet.max_inv_direction[axis]);
+    float t_far = MaxProduct(far_plane - packet.max_origin[axis],
+                             far_plane - packet.min_origin[axis],
+                             packet.min_inv_direction[axis],
+                             packet.max_inv_direction[axis]);
+    t_min = SlabMax(t_near, t_min);
+    t_max = SlabMin(t_far * kSlabErrorScale, t_max);
+  }
+  return t_min > t_max;
+}
+
+uint32_t IntersectPacketBounds(const Bounds &bounds, const RayPacket &packet,
+                               const float *max_distance, uint32_t active) {
+  assert(packet.coherent);
+  uint32_t mask = 0;
+#if defined(__AVX__)
+  for (int lane = 0; lane < packet.num_rays; lane += 8) {
+    if ((active >> lane) & 0xff) {
+      mask |= IntersectEightLanes(bounds, packet, lane, max_distance) << lane;
+    }
+  }
+#elif defined(__SSE2__)
+  for (int lane = 0; lane < packet.num_rays; lane += 4) {
+    if ((active >> lane) & 0xf) {
+      mask |= IntersectFourLanes(bounds, packet, lane, max_distance) << lane;
+    }
+  }
+#else
+  for (int lane = 0; lane < packet.num_rays; ++lane) {
+    if (!(active & (1u << lane))) {
+      continue;
+    }
+    float t_min = 0.0f;
+    float t_max = max_distance[lane];
+    for (int axis = 2; axis >= 0; --axis) {
+      int near = packet.dir_is_negative[axis];
+      float near_plane = near ? bounds.max_pos[axis] : bounds.min_pos[axis];
+      float far_plane = near ? bounds.min_pos[axis] : bounds.max_pos[axis];
+      float origin = packet.origin[axis][lane];
+      float inv_direction = packet.inv_direction[axis][lane];
+      t_min = SlabMax((near_plane - origin) * inv_direction, t_min);
+      t_max = SlabMin((far_plane - origin) * inv_direction * kSlabErrorScale,
+                      t_max);
+    }
+    mask |= static_cast<uint32_t>(t_min <= t_max) << lane;
+  }
+#endif
+  return mask & active;
+}
+
+}  // namespace muon
@@ -0,0 +1,64 @@
+#ifndef MUON_RAY_PACKET_H_
+#define MUON_RAY_PACKET_H_
+
+#include <cstdint>
+
+#include "muon/bounds.h"
+#include "muon/ray.h"
+#include "third_party/glm/glm.hpp"
+
+namespace muon {
+
+// The maximum number of rays in a RayPacket. Packets of 4, 8 or 16 rays line up
+// with the SIMD width used for the bounds tests.
+constexpr int kMaxRayPacketSize = 16;
+
+// A group of rays stored in structure-of-arrays layout, so that they can be
+// tested against the same bounding box at once with SIMD instructions. This is
+// meant for coherent rays, such as camera rays through neighbouring pixels,
+// which tend to visit the same nodes of an acceleration structure.
+struct alignas(32) RayPacket {
+  // Packs the given rays, of which there may be at most kMaxRayPacketSize.
+  RayPacket(const Ray *rays, int num_rays);
+
+  // The ray origins and component-wise inverse directions (see TraversalRay),
+  // indexed by [axis][ray]. Lanes past num_rays repeat the first ray.
+  float origin[3][kMaxRayPacketSize];
+  float inv_direction[3][kMaxRayPacketSize];
+  int num_rays;
+
+  // Whether all rays have the same direction signs, in which case they share
+  // the near and far planes of every box. The bounds tests below require it.
+  bool coherent;
+  int dir_is_negative[3];
+
+  // The range of origins and inverse directions over all rays, used to cull
+  // boxes that every ray misses with a single interval arithmetic test. Only
+  // valid if has_intervals is set, which requires a coherent packet with no
+  // zero direction components.
+  bool has_intervals;
+  glm::vec3 min_origin;
+  glm::vec3 max_origin;
+  glm::vec3 min_inv_direction;
+  glm::vec3 max_inv_direction;
+};
+
+// Returns whether none of the rays in a coherent packet can intersect the box
+// within the distance range [0, max_distance], based on the packet's interval
+// bounds. This is conservative: it may return false even if every ray misses,
+// but never returns true if any of them hits, as judged by
+// IntersectPacketBounds() or Bounds::HasIntersection().
+bool PacketMissesBounds(const Bounds &bounds, const RayPacket &packet,
+                        float max_distance);
+
+// Tests the rays of a coherent packet whose bits are set in `active` against a
+// box, each within the distance range [0, max_distance[i]]. Returns the bitmask
+// of the rays that hit it. Each ray's result exactly matches
+// Bounds::HasIntersection(). `max_distance` must have kMaxRayPacketSize
+// entries, since the rays are tested in groups of the SIMD width.
+uint32_t IntersectPacketBounds(const Bounds &bounds, const RayPacket &packet,
+                               const float *max_distance, uint32_t active);
+
+}  // namespace muon
+
+#endif
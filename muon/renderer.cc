@@ -1,14 +1,18 @@
 #include "muon/renderer.h"
 
+#include <algorithm>
+#include <filesystem>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <vector>
 
+#include "absl/strings/str_format.h"
 #include "glog/logging.h"
 #include "muon/film.h"
 #include "muon/integration.h"
 #include "muon/parser.h"
+#include "muon/ray_packet.h"
 #include "muon/sampling.h"
 #include "muon/scene.h"
 #include "muon/stats.h"
@@ -22,9 +26,45 @@ void Renderer::Render() const {
   Parser parser(scene_file_, options_);
   SceneConfig sc = parser.Parse();
   stats.BuildComplete();
+  stats.SetBuildStats(sc.scene->root->build_stats());
+  if (options_.bvh_report) {
+    std::cerr << sc.scene->root->build_stats();
+  }
 
   const std::string& output =
       options_.output != "" ? options_.output : sc.scene->output;
+  Scene& scene = *sc.scene;
+  for (int frame = 0; frame < scene.frames; ++frame) {
+    if (frame > 0) {
+      // Move the animated primitives, and refit the acceleration structure
+      // around them rather than parsing and building the scene again.
+      scene.SetFrame(frame);
+      if (options_.pretransform_tris) {
+        scene.root->PreTransformPrimitives();
+      }
+      scene.root->Refit();
+    }
+    RenderFrame(sc, scene.frames > 1 ? FrameOutput(output, frame) : output,
+                stats);
+  }
+  stats.SetBuildStats(scene.root->build_stats());
+  stats.Stop();
+
+  if (options_.show_stats) {
+    std::cerr << stats;
+  }
+}
+
+std::string Renderer::FrameOutput(const std::string& output, int frame) {
+  std::filesystem::path path = output;
+  std::string stem = path.stem().string();
+  path.replace_filename(absl::StrFormat("%s_%04d%s", stem, frame,
+                                        path.extension().string()));
+  return path.string();
+}
+
+void Renderer::RenderFrame(const SceneConfig& sc, const std::string& output,
+                           Stats& stats) const {
   Film film(sc.scene->width, sc.scene->height, sc.scene->pixel_samples,
             sc.scene->gamma, output);
 
@@ -36,30 +76,54 @@ void Renderer::Render() const {
   TileQueue tiles(TileImage(sc.scene->width, sc.scene->height, num_tiles,
                             *sc.scene->seedgen));
 
+  // Camera rays are traced in packets of up to this many rays, which are
+  // consecutive samples within a tile. Integrators may ask for larger batches
+  // (see Integrator::BatchSize()).
+  const size_t packet_size = std::min<size_t>(
+      std::max<uint32_t>(options_.ray_packet_size, 1), kMaxRayPacketSize);
+
   // Launch render threads.
   std::vector<std::thread> threads;
   for (uint32_t thread_i = 0; thread_i < options_.parallelism; ++thread_i) {
-    std::thread t([&sc, &tiles, &film, &stats] {
+    std::thread t([&sc, &tiles, &film, &stats, packet_size] {
       // Clone the uninitialized integrator for this thread, and initialize it.
       std::unique_ptr<Integrator> integrator = sc.integrator_prototype->Clone();
       integrator->Init();
+      const size_t batch_size = integrator->BatchSize(packet_size);
 
       absl::optional<Tile> tile;
       while ((tile = tiles.TryDequeue())) {
         Sampler sampler(tile.value(), sc.scene->pixel_samples);
 
+        std::vector<Ray> rays;
+        std::vector<glm::vec2> samples;
+        std::vector<glm::vec3> colors(batch_size);
+        auto trace_batch = [&] {
+          if (rays.empty()) {
+            return;
+          }
+          integrator->TracePacket(rays.data(), rays.size(), colors.data());
+          for (size_t i = 0; i < samples.size(); ++i) {
+            int px_x = samples[i].x;
+            int px_y = samples[i].y;
+            film.SetPixel(px_x, px_y, colors[i]);
+          }
+          rays.clear();
+          samples.clear();
+        };
+
         float x, y;
         while (sampler.NextSample(x, y)) {
           // TODO: Feed progress into a progress system.
           // float progress = sampler.Progress();
 
-          Ray r = sc.scene->camera->CastRay(x, y);
-          glm::vec3 c = integrator->Trace(r);
-
-          int px_x = x;
-          int px_y = y;
-          film.SetPixel(px_x, px_y, c);
+          rays.push_back(sc.scene->camera->CastRay(x, y));
+          samples.push_back(glm::vec2(x, y));
+          if (rays.size() == batch_size) {
+            trace_batch();
+          }
         }
+        trace_batch();
 
         VLOG(2) << "Tile #" << tile->idx
                 << " complete; remaining tiles: " << tiles.size();
@@ -74,14 +138,9 @@ void Renderer::Render() const {
   for (std::thread& t : threads) {
     t.join();
   }
-  stats.Stop();
 
   VLOG(2) << "Render threads done; writing output";
   film.WriteOutput();
-
-  if (options_.show_stats) {
-    std::cerr << stats;
-  }
 }
 
 }  // namespace muon
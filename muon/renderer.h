@@ -5,6 +5,8 @@
 
 #include "muon/debug.h"
 #include "muon/options.h"
+#include "muon/parser.h"
+#include "muon/stats.h"
 
 namespace muon {
 
@@ -15,10 +17,18 @@ class Renderer {
     debug::MaybeEnableFloatingPointExceptions();
   }
 
-  // Runs the ray tracer based on the renderer's configuration.
+  // Runs the ray tracer based on the renderer's configuration. If the scene
+  // has several frames, each one is rendered to its own output file.
   void Render() const;
 
  private:
+  // Returns the output path of the given frame, e.g. "out_0001.png" for frame
+  // 1 of "out.png".
+  static std::string FrameOutput(const std::string& output, int frame);
+  // Renders the scene's current frame to the given output path.
+  void RenderFrame(const SceneConfig& sc, const std::string& output,
+                   Stats& stats) const;
+
   std::string scene_file_;
   const Options& options_;
 };
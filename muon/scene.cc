@@ -4,13 +4,14 @@
 
 namespace muon {
 
-void Scene::AddVertex(Vertex vert) { meshes_[cur_mesh_idx_].push_back(vert); }
+void Scene::AddVertex(const glm::vec3 &pos) {
+  meshes_[cur_mesh_idx_]->Add(pos);
+}
 
-Vertex& Scene::GenVertex() {
-  // Create an empty vertex and push it back.
-  auto v = absl::make_unique<Vertex>();
-  gen_vertices_.push_back(std::move(v));
-  return *gen_vertices_.back();
+void Scene::SetFrame(int frame) {
+  for (const auto &transform : animated_transforms) {
+    transform->SetFrame(frame);
+  }
 }
 
 void Scene::AddLight(std::unique_ptr<Light> light) {
@@ -18,7 +19,7 @@ void Scene::AddLight(std::unique_ptr<Light> light) {
 }
 
 void Scene::StartMesh() {
-  meshes_.push_back(std::vector<Vertex>());
+  meshes_.push_back(std::make_shared<MeshVertices>());
   cur_mesh_idx_ = meshes_.size() - 1;
 }
 
@@ -7,6 +7,7 @@
 
 #include "absl/types/optional.h"
 #include "muon/acceleration.h"
+#include "muon/animation.h"
 #include "muon/camera.h"
 #include "muon/importance_sampling.h"
 #include "muon/lighting.h"
@@ -36,6 +37,9 @@ class Scene {
   std::string output;
   float gamma;
   bool compute_vertex_normals;
+  // The number of frames to render. The frames differ in the animated
+  // transforms of their primitives.
+  int frames;
 
   // Integrator properties.
   // TODO: Move these into a separate struct.
@@ -45,6 +49,8 @@ class Scene {
   NEE next_event_estimation;
   bool russian_roulette;
   ImportanceSampling importance_sampling;
+  // The cost that maps to full intensity for the heatmap integrator.
+  float heatmap_scale;
 
   // Global lighting properties.
   glm::vec3 attenuation;
@@ -55,11 +61,15 @@ class Scene {
   // All tracing starts at this object.
   std::unique_ptr<acceleration::Structure> root;
 
-  // Adds a vertex to the current mesh.
-  void AddVertex(Vertex vert);
+  // The transforms of primitives that change between frames.
+  std::vector<std::shared_ptr<AnimatedTransform>> animated_transforms;
+
+  // Moves the animated primitives to the given frame. The root structure must
+  // be refit afterwards.
+  void SetFrame(int frame);
 
-  // Adds a vertex to the set of "internal", generated vertices.
-  Vertex &GenVertex();
+  // Adds a vertex to the current mesh.
+  void AddVertex(const glm::vec3 &pos);
 
   using Lights = std::vector<std::unique_ptr<Light>>;
 
@@ -72,25 +82,26 @@ class Scene {
   // Ends the current mesh and defaults back to the global one.
   void EndMesh();
 
-  // Returns the set of all meshes.
-  inline std::vector<std::vector<Vertex>> &meshes() { return meshes_; }
+  // Returns the vertices of all meshes.
+  inline std::vector<std::shared_ptr<MeshVertices>> &meshes() {
+    return meshes_;
+  }
 
   // Returns the vertices for the current mesh.
-  inline std::vector<Vertex> &vertices() { return meshes_[cur_mesh_idx_]; }
+  inline const std::shared_ptr<MeshVertices> &vertices() {
+    return meshes_[cur_mesh_idx_];
+  }
 
   // Returns the set of all lights.
   inline Lights &lights() { return lights_; }
 
  private:
-  // The set of meshes comprising the current scene. Initially just a single
-  // global mesh.
-  std::vector<std::vector<Vertex>> meshes_ = {{}};
+  // The vertices of the meshes comprising the current scene. Initially just a
+  // single global mesh. Loaded meshes have their own vertices.
+  std::vector<std::shared_ptr<MeshVertices>> meshes_ = {
+      std::make_shared<MeshVertices>()};
   int cur_mesh_idx_ = 0;
 
-  // Vertices that are generated (for e.g. things like lights), as opposed to
-  // specified in the scene file.
-  // TODO: Is there a better way to do this?
-  std::vector<std::unique_ptr<Vertex>> gen_vertices_;
   Lights lights_;
 };
 
@@ -0,0 +1,161 @@
+#include "muon/scene_cache.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_format.h"
+#include "glog/logging.h"
+
+namespace muon {
+namespace {
+
+// Identifies muon cache files ("MUONCACH").
+constexpr uint64_t kMagic = 0x484341434e4f554dull;
+// The alignment of cached arrays within the file. This is enough for any of the
+// cached structs, e.g. 32-byte aligned BVH nodes and triangle packets.
+constexpr size_t kAlignment = 64;
+
+// The header at the start of each cache file.
+struct Header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t padding;
+  uint64_t key;
+};
+
+}  // namespace
+
+void CacheKey::Add(const void *data, size_t size) {
+  // Consume whole words where possible, since this is used to hash entire model
+  // files.
+  const char *bytes = static_cast<const char *>(data);
+  while (size >= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    AddWord(word);
+    bytes += sizeof(word);
+    size -= sizeof(word);
+  }
+  if (size > 0) {
+    uint64_t word = 0;
+    std::memcpy(&word, bytes, size);
+    AddWord(word ^ (uint64_t(size) << 56));
+  }
+}
+
+bool CacheKey::AddFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::vector<char> buffer(1 << 20);
+  uint64_t total = 0;
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    Add(buffer.data(), file.gcount());
+    total += file.gcount();
+  }
+  Add(total);
+  return file.eof();
+}
+
+std::string CacheKey::ToString() const {
+  return absl::StrFormat("%016x", hash_);
+}
+
+void CacheKey::AddWord(uint64_t word) {
+  // FNV-1a over 64-bit words, followed by a xorshift so that the high bits of
+  // each word also affect the low bits of the hash.
+  hash_ = (hash_ ^ word) * 0x100000001b3ull;
+  hash_ ^= hash_ >> 29;
+}
+
+CacheWriter::CacheWriter(const CacheKey &key) {
+  Write(Header{kMagic, kSceneCacheVersion, 0, key.hash()});
+}
+
+bool CacheWriter::Commit(const std::string &path) const {
+  std::error_code error;
+  std::filesystem::path p = path;
+  if (p.has_parent_path()) {
+    std::filesystem::create_directories(p.parent_path(), error);
+  }
+  // Files with the same contents may be written by several threads at once, so
+  // the temporary file is unique to this commit.
+  static std::atomic<uint64_t> num_commits{0};
+  std::string tmp_path =
+      absl::StrFormat("%s.%d.%d.tmp", path, getpid(), num_commits++);
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    file.write(data_.data(), data_.size());
+    if (!file) {
+      LOG(WARNING) << "Failed to write cache file: " << tmp_path;
+      std::filesystem::remove(tmp_path, error);
+      return false;
+    }
+  }
+  std::filesystem::rename(tmp_path, path, error);
+  if (error) {
+    LOG(WARNING) << "Failed to write cache file: " << path << ": "
+                 << error.message();
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+  return true;
+}
+
+void CacheWriter::Append(const void *data, size_t size) {
+  data_.append(static_cast<const char *>(data), size);
+}
+
+void CacheWriter::Align() {
+  data_.resize((data_.size() + kAlignment - 1) / kAlignment * kAlignment);
+}
+
+std::unique_ptr<CacheReader> CacheReader::Open(const std::string &path,
+                                               const CacheKey &key) {
+  std::shared_ptr<const MappedFile> file = MappedFile::Open(path);
+  if (file == nullptr) {
+    std::error_code error;
+    if (std::filesystem::exists(path, error)) {
+      LOG(WARNING) << "Ignoring unreadable cache file: " << path;
+    }
+    return nullptr;
+  }
+  auto reader = absl::WrapUnique(new CacheReader(std::move(file)));
+  Header header;
+  if (!reader->Read(header) || header.magic != kMagic ||
+      header.version != kSceneCacheVersion || header.key != key.hash()) {
+    LOG(WARNING) << "Ignoring stale cache file: " << path;
+    return nullptr;
+  }
+  return reader;
+}
+
+bool CacheReader::Consume(void *out, size_t size) {
+  if (size > size_ - offset_) {
+    offset_ = size_;
+    return false;
+  }
+  std::memcpy(out, data_ + offset_, size);
+  offset_ += size;
+  return true;
+}
+
+bool CacheReader::Align() {
+  size_t aligned = (offset_ + kAlignment - 1) / kAlignment * kAlignment;
+  if (aligned > size_) {
+    offset_ = size_;
+    return false;
+  }
+  offset_ = aligned;
+  return true;
+}
+
+}  // namespace muon
@@ -0,0 +1,155 @@
+#ifndef MUON_SCENE_CACHE_H_
+#define MUON_SCENE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "muon/mapped_file.h"
+
+namespace muon {
+
+// The version of the cache file format. Bump this whenever the layout of the
+// cached data changes (including the layout of any structs that are cached
+// verbatim, e.g. BVH nodes), so that stale cache files are ignored.
+constexpr uint32_t kSceneCacheVersion = 4;
+
+// Builds the key of a cache entry by hashing everything that its contents
+// depend on. The hash is stable across runs and platforms of the same
+// endianness, so it can be used to name files in the cache directory.
+class CacheKey {
+ public:
+  CacheKey() { Add(kSceneCacheVersion); }
+
+  // Adds raw bytes to the key.
+  void Add(const void *data, size_t size);
+  // Adds a trivially copyable value to the key.
+  template <typename T>
+  void Add(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be hashed");
+    Add(&value, sizeof(T));
+  }
+  // Adds a string to the key, along with its size so that adjacent strings
+  // can't be confused.
+  void AddString(absl::string_view s) {
+    Add(uint64_t(s.size()));
+    Add(s.data(), s.size());
+  }
+  // Adds the contents of the file at the given path to the key. Returns false
+  // if the file couldn't be read.
+  bool AddFile(const std::string &path);
+
+  uint64_t hash() const { return hash_; }
+  // Returns the hash as a 16 digit hex string.
+  std::string ToString() const;
+
+ private:
+  // Mixes one 64-bit word into the hash.
+  void AddWord(uint64_t word);
+
+  uint64_t hash_ = 0xcbf29ce484222325ull;
+};
+
+// Serializes data into a cache file. Arrays are aligned within the file, so
+// that they can be copied straight out of the mapped file when it's read.
+class CacheWriter {
+ public:
+  // Starts a cache file for the entry with the given key.
+  explicit CacheWriter(const CacheKey &key);
+
+  // Appends a trivially copyable value.
+  template <typename T>
+  void Write(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be cached");
+    Append(&value, sizeof(T));
+  }
+  // Appends an array of trivially copyable values, preceded by its size.
+  template <typename T>
+  void WriteArray(const T *values, size_t size) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be cached");
+    Write(uint64_t(size));
+    Align();
+    Append(values, size * sizeof(T));
+  }
+  template <typename T>
+  void WriteVector(const std::vector<T> &values) {
+    WriteArray(values.data(), values.size());
+  }
+
+  // Writes the file to the given path, replacing any existing file atomically
+  // so that concurrent readers never see a partial file. Creates the parent
+  // directory if needed. Returns false on failure.
+  bool Commit(const std::string &path) const;
+
+ private:
+  void Append(const void *data, size_t size);
+  // Pads the data to the alignment of cached arrays.
+  void Align();
+
+  std::string data_;
+};
+
+// Reads a cache file written by CacheWriter. The file is memory-mapped, so
+// opening it is cheap and only the parts that are read get paged in. All reads
+// are bounds checked, and fail (returning false) once the file is exhausted.
+class CacheReader {
+ public:
+  // Opens the cache file at the given path, and checks that it belongs to the
+  // entry with the given key and is of the current version. Returns null if
+  // the file doesn't exist or doesn't match.
+  static std::unique_ptr<CacheReader> Open(const std::string &path,
+                                           const CacheKey &key);
+
+  CacheReader(const CacheReader &) = delete;
+  CacheReader &operator=(const CacheReader &) = delete;
+
+  // Reads a trivially copyable value.
+  template <typename T>
+  bool Read(T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be cached");
+    return Consume(&value, sizeof(T));
+  }
+  // Reads an array written by CacheWriter::WriteArray() or WriteVector().
+  template <typename T>
+  bool ReadVector(std::vector<T> &values) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be cached");
+    uint64_t size;
+    if (!Read(size) || !Align() || size > (size_ - offset_) / sizeof(T)) {
+      return false;
+    }
+    values.resize(size);
+    return Consume(values.data(), size * sizeof(T));
+  }
+
+  // Returns whether the whole file has been read. A file with data left over
+  // after everything its writer wrote was read is corrupt.
+  bool AtEnd() const { return offset_ == size_; }
+
+ private:
+  explicit CacheReader(std::shared_ptr<const MappedFile> file)
+      : file_(std::move(file)), data_(file_->data()), size_(file_->size()) {}
+
+  bool Consume(void *out, size_t size);
+  // Skips the padding before a cached array.
+  bool Align();
+
+  std::shared_ptr<const MappedFile> file_;
+  const char *data_;
+  size_t size_;
+  size_t offset_ = 0;
+};
+
+}  // namespace muon
+
+#endif
@@ -1,6 +1,7 @@
 #include "muon/stats.h"
 
 #include <cmath>
+#include <functional>
 #include <iomanip>
 #include <ostream>
 
@@ -26,6 +27,11 @@ void Stats::AddTraceStats(const TraceStats& ts) {
   trace_ += ts;
 }
 
+void Stats::SetBuildStats(const BuildStats& bs) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  build_ = bs;
+}
+
 constexpr int kLabelWidth = 18;
 constexpr int kFieldWidth = 12;
 constexpr int kLineWidth = kLabelWidth + kFieldWidth + 12;
@@ -38,6 +44,53 @@ std::ostream& Field(std::ostream& os) {
   return os << std::setw(kFieldWidth) << std::right;
 }
 
+namespace {
+
+// Writes one row per bucket of a histogram, with the bucket's share of the
+// total.
+void WriteHistogram(std::ostream& os, const std::vector<uint64_t>& counts,
+                    const std::function<std::string(size_t)>& bucket_label) {
+  uint64_t total = 0;
+  for (uint64_t count : counts) {
+    total += count;
+  }
+  for (size_t i = 0; i < counts.size(); ++i) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    os << Label << bucket_label(i) << " : " << Field << counts[i] << " ("
+       << std::fixed << std::setprecision(2) << counts[i] * 100.0 / total
+       << " %)" << std::endl;
+  }
+}
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, const BuildStats& stats) {
+  os << std::setw(kLineWidth) << std::setfill('-') << ">>" << std::setfill(' ')
+     << std::endl;
+  os << Label << "SAH cost"
+     << " : " << Field << std::fixed << std::setprecision(2)
+     << stats.sah_cost() << std::endl;
+  os << Label << "Node overlap"
+     << " : " << Field << std::fixed << std::setprecision(2)
+     << stats.node_overlap() * 100.0 << " %" << std::endl;
+  os << "Leaves by depth:" << std::endl;
+  WriteHistogram(os, stats.leaf_depths(), [](size_t depth) {
+    return "  " + std::to_string(depth);
+  });
+  os << "Leaves by size:" << std::endl;
+  WriteHistogram(os, stats.leaf_sizes(), [](size_t bucket) {
+    uint64_t min_size = uint64_t{1} << bucket;
+    uint64_t max_size = (min_size << 1) - 1;
+    return "  " + std::to_string(min_size) +
+           (max_size > min_size ? "-" + std::to_string(max_size) : "");
+  });
+  os << std::setw(kLineWidth) << std::setfill('-') << ">>" << std::setfill(' ')
+     << std::endl;
+  return os;
+}
+
 std::ostream& operator<<(std::ostream& os, const Stats& stats) {
   const std::lock_guard<std::mutex> lock(stats.mutex_);
   std::chrono::duration<float> duration = stats.end_time_ - stats.start_time_;
@@ -51,8 +104,14 @@ std::ostream& operator<<(std::ostream& os, const Stats& stats) {
   double bounds_hit_rate = (stats.trace_.bounds_hits() /
                             static_cast<double>(stats.trace_.bounds_tests())) *
                            100.0f;
+  double occluder_cache_hit_rate =
+      (stats.trace_.occluder_cache_hits() /
+       static_cast<double>(stats.trace_.occlusion_tests())) *
+      100.0f;
   object_hit_rate = std::isnan(object_hit_rate) ? 0 : object_hit_rate;
   bounds_hit_rate = std::isnan(bounds_hit_rate) ? 0 : bounds_hit_rate;
+  occluder_cache_hit_rate =
+      std::isnan(occluder_cache_hit_rate) ? 0 : occluder_cache_hit_rate;
 
   os << std::setw(kLineWidth) << std::setfill('-') << ">>" << std::setfill(' ')
      << std::endl;
@@ -62,11 +121,94 @@ std::ostream& operator<<(std::ostream& os, const Stats& stats) {
   os << Label << "Build time"
      << " : " << Field << std::fixed << std::setprecision(2)
      << build_duration.count() << " (sec)" << std::endl;
+  os << Label << "Accel build time"
+     << " : " << Field << std::fixed << std::setprecision(2)
+     << stats.build_.build_time().count() << " (sec)" << std::endl;
   os << Label << "Render time"
      << " : " << Field << std::fixed << std::setprecision(2)
      << render_duration.count() << " (sec)" << std::endl;
+  os << Label << "Primitives"
+     << " : " << Field << stats.build_.num_primitives() << std::endl;
+  if (stats.build_.num_nodes() > 0) {
+    os << Label << "BVH nodes"
+       << " : " << Field << stats.build_.num_nodes() << std::endl;
+    os << Label << "BVH leaves"
+       << " : " << Field << stats.build_.num_leaves() << std::endl;
+    os << Label << "Leaf references"
+       << " : " << Field << stats.build_.leaf_references() << std::endl;
+    os << Label << "Avg leaf size"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.average_leaf_size() << " (prims)" << std::endl;
+    os << Label << "Avg leaf depth"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.average_leaf_depth() << std::endl;
+    os << Label << "Max depth"
+       << " : " << Field << stats.build_.max_depth() << std::endl;
+    if (stats.build_.sah_cost() > 0) {
+      os << Label << "SAH cost"
+         << " : " << Field << std::fixed << std::setprecision(2)
+         << stats.build_.sah_cost() << std::endl;
+      os << Label << "Node overlap"
+         << " : " << Field << std::fixed << std::setprecision(2)
+         << stats.build_.node_overlap() * 100.0 << " %" << std::endl;
+    }
+    os << Label << "Tree node memory"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.tree_node_bytes() / 1024.0 << " (KiB)" << std::endl;
+    os << Label << "Node allocations"
+       << " : " << Field << stats.build_.build_node_allocations() << " ("
+       << stats.build_.build_heap_allocations() << " from heap)" << std::endl;
+    os << Label << "Flat node memory"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.linear_node_bytes() / 1024.0 << " (KiB)" << std::endl;
+    os << Label << "Leaf data memory"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.leaf_data_bytes() / 1024.0 << " (KiB)" << std::endl;
+    os << Label << "Bytes/primitive"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.bytes_per_primitive() << std::endl;
+  }
+  if (stats.build_.num_triangle_packets() > 0) {
+    os << Label << "Triangle packets"
+       << " : " << Field << stats.build_.num_triangle_packets() << std::endl;
+    os << Label << "Avg packet fill"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.average_packet_fill() << " (tris)" << std::endl;
+  }
+  if (stats.build_.num_instances() > 0) {
+    os << Label << "Instances"
+       << " : " << Field << stats.build_.num_instances() << std::endl;
+    os << Label << "Unique meshes"
+       << " : " << Field << stats.build_.num_bottom_levels() << std::endl;
+    os << Label << "Mesh primitives"
+       << " : " << Field << stats.build_.bottom_level_primitives()
+       << std::endl;
+    os << Label << "Mesh BVH nodes"
+       << " : " << Field << stats.build_.bottom_level_nodes() << std::endl;
+    os << Label << "Mesh build time"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.bottom_level_build_time().count() << " (sec)"
+       << std::endl;
+  }
+  if (stats.build_.num_refits() > 0) {
+    os << Label << "Refits"
+       << " : " << Field << stats.build_.num_refits() << " ("
+       << stats.build_.num_rebuilds() << " rebuilt)" << std::endl;
+    os << Label << "Refit time"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.build_.refit_time().count() << " (sec)" << std::endl;
+  }
   os << Label << "Primary rays"
      << " : " << Field << stats.trace_.primary_rays() << std::endl;
+  if (stats.trace_.primary_trace_time().count() > 0) {
+    // The time is summed over all render threads, so this is the throughput of
+    // a single thread.
+    os << Label << "Primary rays/s"
+       << " : " << Field << std::fixed << std::setprecision(2)
+       << stats.trace_.primary_rays() /
+              stats.trace_.primary_trace_time().count() / 1e6
+       << " (Mrays/s per thread)" << std::endl;
+  }
   os << Label << "Secondary rays"
      << " : " << Field << stats.trace_.secondary_rays() << std::endl;
   os << Label << "Ray-object tests"
@@ -83,6 +225,13 @@ std::ostream& operator<<(std::ostream& os, const Stats& stats) {
   os << Label << "Bounds hit rate"
      << " : " << Field << std::fixed << std::setprecision(2) << bounds_hit_rate
      << " %" << std::endl;
+  os << Label << "Occlusion tests"
+     << " : " << Field << stats.trace_.occlusion_tests() << std::endl;
+  os << Label << "Cached occluders"
+     << " : " << Field << stats.trace_.occluder_cache_hits() << std::endl;
+  os << Label << "Occluder hit rate"
+     << " : " << Field << std::fixed << std::setprecision(2)
+     << occluder_cache_hit_rate << " %" << std::endl;
   os << std::setw(kLineWidth) << std::setfill('-') << ">>" << std::setfill(' ')
      << std::endl;
   return os;
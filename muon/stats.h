@@ -1,48 +1,275 @@
 #ifndef MUON_STATS_H_
 #define MUON_STATS_H_
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <mutex>
+#include <ostream>
 #include <string>
+#include <vector>
 
 namespace muon {
 
 class TraceStats {
  public:
   void IncrementPrimaryRays() { ++primary_rays_; }
-  void IncrementSecondaryRays() { ++secondary_rays_; }
-  void IncrementObjectTests() { ++object_tests_; }
+  // Records primary rays that were intersected with the scene (but not shaded)
+  // in the given time.
+  void AddPrimaryRays(uint64_t n, std::chrono::duration<double> trace_time) {
+    primary_rays_ += n;
+    primary_trace_time_ += trace_time;
+  }
+  void IncrementSecondaryRays(uint64_t n = 1) { secondary_rays_ += n; }
+  void IncrementObjectTests(uint64_t n = 1) { object_tests_ += n; }
   void IncrementObjectHits() { ++object_hits_; }
-  void IncrementBoundsTests() { ++bounds_tests_; }
-  void IncrementBoundsHits() { ++bounds_hits_; }
+  void IncrementBoundsTests(uint64_t n = 1) { bounds_tests_ += n; }
+  void IncrementBoundsHits(uint64_t n = 1) { bounds_hits_ += n; }
+  void IncrementOcclusionTests() { ++occlusion_tests_; }
+  void IncrementOccluderCacheHits() { ++occluder_cache_hits_; }
 
   uint64_t primary_rays() const { return primary_rays_; }
+  // The time spent intersecting the primary rays recorded by AddPrimaryRays().
+  std::chrono::duration<double> primary_trace_time() const {
+    return primary_trace_time_;
+  }
   uint64_t secondary_rays() const { return secondary_rays_; }
   uint64_t object_tests() const { return object_tests_; }
   uint64_t object_hits() const { return object_hits_; }
   uint64_t bounds_tests() const { return bounds_tests_; }
   uint64_t bounds_hits() const { return bounds_hits_; }
+  // The number of any-hit (e.g. shadow ray) queries, and how many of them were
+  // answered by the cached occluder of the previous query.
+  uint64_t occlusion_tests() const { return occlusion_tests_; }
+  uint64_t occluder_cache_hits() const { return occluder_cache_hits_; }
 
   TraceStats &operator+=(const TraceStats &rhs) {
     primary_rays_ += rhs.primary_rays_;
+    primary_trace_time_ += rhs.primary_trace_time_;
     secondary_rays_ += rhs.secondary_rays_;
     object_tests_ += rhs.object_tests_;
     object_hits_ += rhs.object_hits_;
     bounds_tests_ += rhs.bounds_tests_;
     bounds_hits_ += rhs.bounds_hits_;
+    occlusion_tests_ += rhs.occlusion_tests_;
+    occluder_cache_hits_ += rhs.occluder_cache_hits_;
     return *this;
   }
 
  private:
   uint64_t primary_rays_ = 0;
+  std::chrono::duration<double> primary_trace_time_ =
+      std::chrono::duration<double>(0);
   uint64_t secondary_rays_ = 0;
   uint64_t object_tests_ = 0;
   uint64_t object_hits_ = 0;
   uint64_t bounds_tests_ = 0;
   uint64_t bounds_hits_ = 0;
+  uint64_t occlusion_tests_ = 0;
+  uint64_t occluder_cache_hits_ = 0;
+};
+
+// Statistics about the construction of an acceleration structure.
+class BuildStats {
+ public:
+  // Returns the bucket of leaf_sizes() for a leaf with the given number of
+  // primitives.
+  static size_t LeafSizeBucket(uint64_t num_primitives) {
+    size_t bucket = 0;
+    while (num_primitives >>= 1) {
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  void SetNumPrimitives(uint64_t n) { num_primitives_ = n; }
+  void SetNumNodes(uint64_t n) { num_nodes_ = n; }
+  void SetTreeNodeBytes(uint64_t n) { tree_node_bytes_ = n; }
+  void SetLinearNodeBytes(uint64_t n) { linear_node_bytes_ = n; }
+  void SetLeafDataBytes(uint64_t n) { leaf_data_bytes_ = n; }
+  // Records the number of nodes allocated while building the tree, and the
+  // number of heap allocations they were served from (see Arena).
+  void SetBuildAllocations(uint64_t num_nodes, uint64_t num_heap) {
+    build_node_allocations_ = num_nodes;
+    build_heap_allocations_ = num_heap;
+  }
+  void SetBuildTime(std::chrono::duration<float> t) { build_time_ = t; }
+  // Records the number of triangle packets built for the leaves, and the
+  // number of triangles packed into them.
+  void SetTrianglePackets(uint64_t num_packets, uint64_t num_triangles) {
+    num_triangle_packets_ = num_packets;
+    packed_triangles_ = num_triangles;
+  }
+  // Records a leaf node with the given number of primitives, at the given
+  // depth in the tree (where the root has depth 0).
+  void AddLeaf(uint64_t num_primitives, uint32_t depth) {
+    ++num_leaves_;
+    leaf_primitives_ += num_primitives;
+    leaf_depth_sum_ += depth;
+    max_depth_ = std::max(max_depth_, depth);
+    if (leaf_depths_.size() <= depth) {
+      leaf_depths_.resize(depth + 1);
+    }
+    ++leaf_depths_[depth];
+    size_t bucket = LeafSizeBucket(num_primitives);
+    if (leaf_sizes_.size() <= bucket) {
+      leaf_sizes_.resize(bucket + 1);
+    }
+    ++leaf_sizes_[bucket];
+  }
+  // Clears the leaves recorded by AddLeaf(), before rebuilding the tree.
+  void ClearLeaves() {
+    num_leaves_ = 0;
+    leaf_primitives_ = 0;
+    leaf_depth_sum_ = 0;
+    max_depth_ = 0;
+    leaf_depths_.clear();
+    leaf_sizes_.clear();
+  }
+  // Records an update of the structure after its primitives moved, which took
+  // the given time, and whether it was rebuilt rather than refitted.
+  void AddRefit(std::chrono::duration<float> t, bool rebuilt) {
+    ++num_refits_;
+    if (rebuilt) {
+      ++num_rebuilds_;
+    }
+    refit_time_ += t;
+  }
+  // Records the quality of the built tree: its expected cost per ray according
+  // to the surface area heuristic, and the average ratio of the surface area
+  // where sibling nodes overlap to that of their parent.
+  void SetTreeQuality(double sah_cost, double node_overlap) {
+    sah_cost_ = sah_cost;
+    node_overlap_ = node_overlap;
+  }
+  // Records an instance of a bottom-level structure with the given stats.
+  // Only the first instance of each structure counts towards the totals for
+  // bottom-level structures, since the structure is shared between them.
+  void AddInstance(const BuildStats &bottom_level, bool first_instance) {
+    ++num_instances_;
+    if (first_instance) {
+      ++num_bottom_levels_;
+      bottom_level_primitives_ += bottom_level.num_primitives_;
+      bottom_level_nodes_ += bottom_level.num_nodes_;
+      bottom_level_bytes_ += bottom_level.structure_bytes();
+      bottom_level_build_time_ += bottom_level.build_time_;
+      bottom_level_node_allocations_ += bottom_level.build_node_allocations_;
+      bottom_level_heap_allocations_ += bottom_level.build_heap_allocations_;
+    }
+  }
+
+  uint64_t num_primitives() const { return num_primitives_; }
+  uint64_t num_nodes() const { return num_nodes_; }
+  // The memory footprint of the nodes as constructed, i.e. as a pointer-based
+  // tree.
+  uint64_t tree_node_bytes() const { return tree_node_bytes_; }
+  // The memory footprint of the nodes after flattening into a linear layout.
+  uint64_t linear_node_bytes() const { return linear_node_bytes_; }
+  // The memory footprint of the data referenced by the leaves, i.e. the
+  // primitive references and any packed triangles.
+  uint64_t leaf_data_bytes() const { return leaf_data_bytes_; }
+  // The number of nodes allocated while building the tree, and the number of
+  // heap allocations made for them, including those of bottom-level
+  // structures.
+  uint64_t build_node_allocations() const {
+    return build_node_allocations_ + bottom_level_node_allocations_;
+  }
+  uint64_t build_heap_allocations() const {
+    return build_heap_allocations_ + bottom_level_heap_allocations_;
+  }
+  // The memory footprint of the structure as used during traversal, including
+  // any bottom-level structures.
+  uint64_t structure_bytes() const {
+    return linear_node_bytes_ + leaf_data_bytes_ + bottom_level_bytes_;
+  }
+  // The structure's memory footprint per primitive, where the primitives of
+  // bottom-level structures count instead of the instances referencing them.
+  double bytes_per_primitive() const {
+    uint64_t n = num_primitives_ - num_instances_ + bottom_level_primitives_;
+    return n == 0 ? 0 : structure_bytes() / double(n);
+  }
+  // The time spent building the acceleration structure itself, excluding
+  // scene parsing and loading.
+  std::chrono::duration<float> build_time() const { return build_time_; }
+  uint64_t num_leaves() const { return num_leaves_; }
+  // The total number of primitive references across all leaves. This exceeds
+  // the number of primitives when primitives are referenced by several leaves
+  // (e.g. due to spatial splits).
+  uint64_t leaf_references() const { return leaf_primitives_; }
+  // The average number of primitives in each leaf.
+  double average_leaf_size() const {
+    return num_leaves_ == 0 ? 0 : leaf_primitives_ / double(num_leaves_);
+  }
+  // The average depth of the leaves in the tree.
+  double average_leaf_depth() const {
+    return num_leaves_ == 0 ? 0 : leaf_depth_sum_ / double(num_leaves_);
+  }
+  uint32_t max_depth() const { return max_depth_; }
+  // The number of leaves at each depth.
+  const std::vector<uint64_t> &leaf_depths() const { return leaf_depths_; }
+  // The number of leaves by size, where bucket i counts the leaves with
+  // [2^i, 2^(i+1)) primitives.
+  const std::vector<uint64_t> &leaf_sizes() const { return leaf_sizes_; }
+  double sah_cost() const { return sah_cost_; }
+  double node_overlap() const { return node_overlap_; }
+  uint64_t num_triangle_packets() const { return num_triangle_packets_; }
+  // The average number of triangles in each triangle packet.
+  double average_packet_fill() const {
+    return num_triangle_packets_ == 0
+               ? 0
+               : packed_triangles_ / double(num_triangle_packets_);
+  }
+  uint64_t num_instances() const { return num_instances_; }
+  // The number of distinct bottom-level structures referenced by instances.
+  uint64_t num_bottom_levels() const { return num_bottom_levels_; }
+  uint64_t bottom_level_primitives() const { return bottom_level_primitives_; }
+  uint64_t bottom_level_nodes() const { return bottom_level_nodes_; }
+  std::chrono::duration<float> bottom_level_build_time() const {
+    return bottom_level_build_time_;
+  }
+  // The number of updates after primitives moved, of which num_rebuilds()
+  // rebuilt the structure rather than refitting it, and their total time.
+  uint64_t num_refits() const { return num_refits_; }
+  uint64_t num_rebuilds() const { return num_rebuilds_; }
+  std::chrono::duration<float> refit_time() const { return refit_time_; }
+
+ private:
+  uint64_t num_primitives_ = 0;
+  uint64_t num_nodes_ = 0;
+  uint64_t tree_node_bytes_ = 0;
+  uint64_t linear_node_bytes_ = 0;
+  uint64_t leaf_data_bytes_ = 0;
+  uint64_t build_node_allocations_ = 0;
+  uint64_t build_heap_allocations_ = 0;
+  std::chrono::duration<float> build_time_ = std::chrono::duration<float>(0);
+  uint64_t num_leaves_ = 0;
+  uint64_t leaf_primitives_ = 0;
+  uint64_t leaf_depth_sum_ = 0;
+  uint32_t max_depth_ = 0;
+  std::vector<uint64_t> leaf_depths_;
+  std::vector<uint64_t> leaf_sizes_;
+  double sah_cost_ = 0;
+  double node_overlap_ = 0;
+  uint64_t num_triangle_packets_ = 0;
+  uint64_t packed_triangles_ = 0;
+  uint64_t num_instances_ = 0;
+  uint64_t num_bottom_levels_ = 0;
+  uint64_t bottom_level_primitives_ = 0;
+  uint64_t bottom_level_nodes_ = 0;
+  uint64_t bottom_level_bytes_ = 0;
+  uint64_t bottom_level_node_allocations_ = 0;
+  uint64_t bottom_level_heap_allocations_ = 0;
+  std::chrono::duration<float> bottom_level_build_time_ =
+      std::chrono::duration<float>(0);
+  uint64_t num_refits_ = 0;
+  uint64_t num_rebuilds_ = 0;
+  std::chrono::duration<float> refit_time_ = std::chrono::duration<float>(0);
 };
 
+// Writes a report on the quality of a BVH: its SAH cost, node overlap, and
+// histograms of leaf depths and sizes.
+std::ostream &operator<<(std::ostream &os, const BuildStats &stats);
+
 // Records statistics about the tracer. Thread safe.
 class Stats {
  public:
@@ -50,9 +277,11 @@ class Stats {
   void BuildComplete();
   void Stop();
   void AddTraceStats(const TraceStats &ts);
+  void SetBuildStats(const BuildStats &bs);
 
  private:
   TraceStats trace_;
+  BuildStats build_;
 
   std::chrono::steady_clock::time_point start_time_;
   std::chrono::steady_clock::time_point build_complete_time_;
@@ -0,0 +1,273 @@
+#include "muon/triangle.h"
+
+#include <utility>
+
+#include "muon/types.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace muon {
+
+namespace {
+
+// Returns a lane's triangle vertex from a packet.
+glm::vec3 PacketVertex(const TrianglePacket &packet, int vertex, int lane) {
+  return glm::vec3(packet.pos[vertex][0][lane], packet.pos[vertex][1][lane],
+                   packet.pos[vertex][2][lane]);
+}
+
+// Computes the distance along the ray to the plane of the triangle with
+// vertices a, b and c, as the plane-then-edges test did. Returns false if the
+// ray is (nearly) parallel to the plane, which that test treated as a miss.
+bool PlaneDistance(const TriangleRay &ray, const glm::vec3 &a,
+                   const glm::vec3 &b, const glm::vec3 &c, float &t) {
+  const glm::vec3 normal = glm::cross(b - a, c - a);
+  const float dir_along_normal = glm::dot(normal, ray.direction);
+  if (dir_along_normal > -kEpsilon && dir_along_normal < kEpsilon) {
+    return false;
+  }
+  t = (glm::dot(a, normal) - glm::dot(ray.origin, normal)) / dir_along_normal;
+  return true;
+}
+
+// The per-lane results of testing a packet.
+struct PacketResults {
+  float weights[3][kTrianglePacketWidth];
+  // The lanes whose triangles the ray passes through, at any distance.
+  int hit_mask;
+  // The lanes where an edge function was exactly zero. These are retested
+  // with the scalar test, which falls back to double precision in that case
+  // to remain watertight.
+  int retest_mask;
+};
+
+#if defined(__SSE2__) && !defined(__AVX__)
+// Tests all four lanes of a packet at once.
+void IntersectFourLanes(const TriangleRay &ray, const TrianglePacket &packet,
+                        PacketResults &results) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 sx = _mm_set1_ps(ray.sx);
+  const __m128 sy = _mm_set1_ps(ray.sy);
+  const int axes[3] = {ray.kx, ray.ky, ray.kz};
+  // The sheared vertices, relative to the ray's origin.
+  __m128 x[3], y[3];
+  for (int vertex = 0; vertex < 3; ++vertex) {
+    __m128 p[3];
+    for (int i = 0; i < 3; ++i) {
+      p[i] = _mm_sub_ps(_mm_load_ps(packet.pos[vertex][axes[i]]),
+                        _mm_set1_ps(ray.origin[axes[i]]));
+    }
+    x[vertex] = _mm_sub_ps(p[0], _mm_mul_ps(sx, p[2]));
+    y[vertex] = _mm_sub_ps(p[1], _mm_mul_ps(sy, p[2]));
+  }
+
+  // The edge functions, each of which weighs the vertex opposite its edge.
+  __m128 u = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+  __m128 v = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+  __m128 w = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+  __m128 any_zero = _mm_or_ps(
+      _mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)),
+      _mm_cmpeq_ps(w, zero));
+  // The ray misses if the edge functions have differing signs.
+  __m128 any_negative =
+      _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+                _mm_cmplt_ps(w, zero));
+  __m128 any_positive =
+      _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)),
+                _mm_cmpgt_ps(w, zero));
+  __m128 outside = _mm_and_ps(any_negative, any_positive);
+
+  // A zero determinant means the ray is parallel to the triangle.
+  __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+  __m128 hit = _mm_andnot_ps(outside, _mm_cmpneq_ps(det, zero));
+
+  __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+  _mm_storeu_ps(results.weights[0], _mm_mul_ps(u, inv_det));
+  _mm_storeu_ps(results.weights[1], _mm_mul_ps(v, inv_det));
+  _mm_storeu_ps(results.weights[2], _mm_mul_ps(w, inv_det));
+  results.hit_mask = _mm_movemask_ps(hit);
+  results.retest_mask = _mm_movemask_ps(any_zero);
+}
+#endif
+
+#if defined(__AVX__)
+// Tests all eight lanes of a packet at once.
+void IntersectEightLanes(const TriangleRay &ray, const TrianglePacket &packet,
+                         PacketResults &results) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 sx = _mm256_set1_ps(ray.sx);
+  const __m256 sy = _mm256_set1_ps(ray.sy);
+  const int axes[3] = {ray.kx, ray.ky, ray.kz};
+  __m256 x[3], y[3];
+  for (int vertex = 0; vertex < 3; ++vertex) {
+    __m256 p[3];
+    for (int i = 0; i < 3; ++i) {
+      p[i] = _mm256_sub_ps(_mm256_load_ps(packet.pos[vertex][axes[i]]),
+                           _mm256_set1_ps(ray.origin[axes[i]]));
+    }
+    x[vertex] = _mm256_sub_ps(p[0], _mm256_mul_ps(sx, p[2]));
+    y[vertex] = _mm256_sub_ps(p[1], _mm256_mul_ps(sy, p[2]));
+  }
+
+  __m256 u =
+      _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+  __m256 v =
+      _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+  __m256 w =
+      _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+  __m256 any_zero =
+      _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ),
+                                _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                   _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+  __m256 any_negative =
+      _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ),
+                                _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                   _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+  __m256 any_positive =
+      _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ),
+                                _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                   _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+  __m256 outside = _mm256_and_ps(any_negative, any_positive);
+
+  __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+  __m256 hit = _mm256_andnot_ps(outside, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+
+  __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+  _mm256_storeu_ps(results.weights[0], _mm256_mul_ps(u, inv_det));
+  _mm256_storeu_ps(results.weights[1], _mm256_mul_ps(v, inv_det));
+  _mm256_storeu_ps(results.weights[2], _mm256_mul_ps(w, inv_det));
+  results.hit_mask = _mm256_movemask_ps(hit);
+  results.retest_mask = _mm256_movemask_ps(any_zero);
+}
+#endif
+
+}  // namespace
+
+TriangleRay::TriangleRay(const Ray &ray)
+    : origin(ray.origin()), direction(ray.direction()) {
+  glm::vec3 abs_direction = glm::abs(direction);
+  kz = abs_direction.x > abs_direction.y
+           ? (abs_direction.x > abs_direction.z ? 0 : 2)
+           : (abs_direction.y > abs_direction.z ? 1 : 2);
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  if (direction[kz] < 0.0f) {
+    std::swap(kx, ky);
+  }
+  sx = direction[kx] / direction[kz];
+  sy = direction[ky] / direction[kz];
+  length = glm::length(direction);
+}
+
+bool IntersectTriangle(const TriangleRay &ray, const glm::vec3 &a,
+                       const glm::vec3 &b, const glm::vec3 &c, float t_min,
+                       float t_max, TriangleHit &hit) {
+  // Translate the vertices relative to the ray's origin, then shear them so
+  // that the ray points along +z.
+  const glm::vec3 a_rel = a - ray.origin;
+  const glm::vec3 b_rel = b - ray.origin;
+  const glm::vec3 c_rel = c - ray.origin;
+  const float ax = a_rel[ray.kx] - ray.sx * a_rel[ray.kz];
+  const float ay = a_rel[ray.ky] - ray.sy * a_rel[ray.kz];
+  const float bx = b_rel[ray.kx] - ray.sx * b_rel[ray.kz];
+  const float by = b_rel[ray.ky] - ray.sy * b_rel[ray.kz];
+  const float cx = c_rel[ray.kx] - ray.sx * c_rel[ray.kz];
+  const float cy = c_rel[ray.ky] - ray.sy * c_rel[ray.kz];
+
+  // Compute the 2D edge functions, each of which weighs the vertex opposite its
+  // edge. If any is exactly zero, the ray passes (nearly) through an edge or
+  // vertex, so recompute them in double precision to make sure the ray hits
+  // exactly one of the triangles that share it.
+  float u = cx * by - cy * bx;
+  float v = ax * cy - ay * cx;
+  float w = bx * ay - by * ax;
+  if (u == 0.0f || v == 0.0f || w == 0.0f) {
+    u = static_cast<float>(static_cast<double>(cx) * by -
+                           static_cast<double>(cy) * bx);
+    v = static_cast<float>(static_cast<double>(ax) * cy -
+                           static_cast<double>(ay) * cx);
+    w = static_cast<float>(static_cast<double>(bx) * ay -
+                           static_cast<double>(by) * ax);
+  }
+  // The ray misses if the edge functions have differing signs. Both windings
+  // are accepted.
+  if ((u < 0.0f || v < 0.0f || w < 0.0f) &&
+      (u > 0.0f || v > 0.0f || w > 0.0f)) {
+    return false;
+  }
+  const float det = u + v + w;
+  if (det == 0.0f) {
+    return false;
+  }
+
+  // Only now that the ray is known to pass through the triangle, compute the
+  // distance to it and normalize the weights.
+  float t;
+  if (!PlaneDistance(ray, a, b, c, t) || !(t > t_min && t < t_max)) {
+    return false;
+  }
+  hit.t = t;
+  hit.weights = glm::vec3(u, v, w) * (1.0f / det);
+  return true;
+}
+
+int IntersectTrianglePacket(const TriangleRay &ray,
+                            const TrianglePacket &packet, float t_max,
+                            TriangleHit &hit) {
+  // A lone triangle isn't worth a full packet test.
+  if (packet.num_triangles == 1) {
+    return IntersectTriangle(ray, PacketVertex(packet, 0, 0),
+                             PacketVertex(packet, 1, 0),
+                             PacketVertex(packet, 2, 0), 0.0f, t_max, hit)
+               ? 0
+               : -1;
+  }
+  PacketResults results;
+#if defined(__AVX__)
+  IntersectEightLanes(ray, packet, results);
+#elif defined(__SSE2__)
+  IntersectFourLanes(ray, packet, results);
+#else
+  results.hit_mask = 0;
+  results.retest_mask = (1 << kTrianglePacketWidth) - 1;
+#endif
+  const int lanes = (1 << packet.num_triangles) - 1;
+  int hit_mask = results.hit_mask & lanes;
+  int retest_mask = results.retest_mask & lanes;
+
+  int closest = -1;
+  float closest_t = t_max;
+  for (int lane = 0; lane < packet.num_triangles; ++lane) {
+    if (retest_mask & (1 << lane)) {
+      TriangleHit lane_hit;
+      if (IntersectTriangle(ray, PacketVertex(packet, 0, lane),
+                            PacketVertex(packet, 1, lane),
+                            PacketVertex(packet, 2, lane), 0.0f, closest_t,
+                            lane_hit)) {
+        closest = lane;
+        closest_t = lane_hit.t;
+        hit = lane_hit;
+      }
+      continue;
+    }
+    // Ties keep the earlier lane, as the distance must be strictly closer.
+    float t;
+    if ((hit_mask & (1 << lane)) &&
+        PlaneDistance(ray, PacketVertex(packet, 0, lane),
+                      PacketVertex(packet, 1, lane),
+                      PacketVertex(packet, 2, lane), t) &&
+        t > 0.0f && t < closest_t) {
+      closest = lane;
+      closest_t = t;
+      hit.t = t;
+      hit.weights =
+          glm::vec3(results.weights[0][lane], results.weights[1][lane],
+                    results.weights[2][lane]);
+    }
+  }
+  return closest;
+}
+
+}  // namespace muon
@@ -0,0 +1,80 @@
+#ifndef MUON_TRIANGLE_H_
+#define MUON_TRIANGLE_H_
+
+#include "muon/ray.h"
+#include "third_party/glm/glm.hpp"
+
+namespace muon {
+
+// Ray-triangle intersection kernels, based on "Watertight Ray/Triangle
+// Intersection" (Woop et al., 2013). The ray is transformed so that it starts
+// at the origin and points along +z, after which the triangle test reduces to
+// 2D edge functions. Unlike the plane-then-edges test this replaces, rays can't
+// slip between triangles that share an edge, and nothing beyond the edge
+// functions is computed until the ray is known to pass through the triangle.
+// The hit distance is then computed from the triangle's plane, exactly as the
+// plane-then-edges test did, so that distances (and so which of several close
+// hits is nearest, and where secondary rays start) round the same way.
+
+// A ray with the values needed by the triangle tests precomputed. Construct it
+// once per ray and reuse it for every triangle.
+struct TriangleRay {
+  TriangleRay() = default;
+  explicit TriangleRay(const Ray &ray);
+
+  glm::vec3 origin;
+  glm::vec3 direction;
+  // The axis along which the direction is largest, which becomes the z axis,
+  // and the other two axes. kx and ky are swapped when the direction is
+  // negative along kz, which preserves the winding of the triangles.
+  int kx, ky, kz;
+  // The shear that maps the direction onto the z axis.
+  float sx, sy;
+  // The length of the ray's direction, which converts the distances along the
+  // ray used by the tests into world distances.
+  float length;
+};
+
+// The result of a triangle test.
+struct TriangleHit {
+  // The distance along the ray, in units of its direction's length.
+  float t;
+  // The barycentric weights of the triangle's vertices at the hit.
+  glm::vec3 weights;
+};
+
+// Intersects a ray with the triangle with vertices a, b and c. Returns whether
+// there's a hit with a distance in the range (t_min, t_max), where t_min is
+// at least 0, and if so, outputs it.
+bool IntersectTriangle(const TriangleRay &ray, const glm::vec3 &a,
+                       const glm::vec3 &b, const glm::vec3 &c, float t_min,
+                       float t_max, TriangleHit &hit);
+
+// The number of triangles in a TrianglePacket: 8 when AVX is available, and 4
+// otherwise.
+#if defined(__AVX__)
+constexpr int kTrianglePacketWidth = 8;
+#else
+constexpr int kTrianglePacketWidth = 4;
+#endif
+
+// A group of triangles stored in structure-of-arrays layout, so that a ray can
+// be tested against all of them at once with SIMD instructions. Triangles are
+// packed into the first `num_triangles` lanes.
+struct alignas(32) TrianglePacket {
+  // Vertex positions, indexed by [vertex][axis][lane].
+  float pos[3][3][kTrianglePacketWidth];
+  int num_triangles;
+};
+
+// Intersects a ray with all triangles in the packet. Returns the lane of the
+// closest hit with a distance in the range (0, t_max) and outputs it, or
+// returns -1 if there's no such hit. Of several equally close hits, the first
+// lane's is returned.
+int IntersectTrianglePacket(const TriangleRay &ray,
+                            const TrianglePacket &packet, float t_max,
+                            TriangleHit &hit);
+
+}  // namespace muon
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef MUON_TYPES_H_
 #define MUON_TYPES_H_
 
+#include <cstdint>
+#include <limits>
+
 #include "third_party/glm/glm.hpp"
 
 namespace muon {
@@ -12,6 +15,16 @@ namespace muon {
 // http://www.pbr-book.org/3ed-2018/Shapes/Managing_Rounding_Error.html).
 constexpr float kEpsilon = 0.0001;
 
+// Intersection tests in object coordinates are given world distance bounds
+// scaled into object space distances, but only to reject farther hits early;
+// whether a hit is within the bound is decided by its world distance. The
+// scaled bounds are widened by this factor so that rounding in the scaling
+// never rejects a hit that's within the bound. Acceleration structures likewise
+// only cull bounding boxes that the ray enters beyond the closest hit so far,
+// widened by this factor, so that rounding in the slab tests never culls a box
+// containing a hit that's as close (see IsCloserHit()).
+constexpr float kDistanceBoundScale = 1.0f + kEpsilon;
+
 // TODO: Remove this header in favor of more specific headers.
 class Primitive;
 
@@ -27,6 +40,29 @@ struct Intersection {
   Primitive *obj;
 };
 
+// A compact record of the closest hit found so far while intersecting a ray
+// with many primitives. Primitives update it in place, and only the closest
+// hit is resolved into a full Intersection at the end, via
+// Primitive::ResolveHit(), which is where positions and normals are computed.
+struct HitRecord {
+  // The world distance to the hit. Primitives only record hits that are closer
+  // than this, so it starts out as the farthest distance of interest. Equally
+  // close hits are ordered by primitive and part (see IsCloserHit()).
+  float distance = std::numeric_limits<float>::infinity();
+  // The distance along the ray as tested by the primitive, which may be in the
+  // primitive's object coordinates.
+  float t = 0.0f;
+  // The barycentric weights of the hit, for tris.
+  glm::vec3 weights = glm::vec3(0.0f);
+  // The primitive that was hit, or null if nothing was hit.
+  Primitive *primitive = nullptr;
+  // The part of the primitive that was hit, e.g. the tri of a mesh (see
+  // Primitive::num_parts()).
+  uint32_t part = 0;
+  // The instance containing the primitive, if it was hit via one.
+  Primitive *instance = nullptr;
+};
+
 }  // namespace muon
 
 #endif
@@ -1,13 +1,96 @@
 #ifndef MUON_VERTEX_H_
 #define MUON_VERTEX_H_
 
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
 #include "third_party/glm/glm.hpp"
 
 namespace muon {
 
-struct Vertex {
-  glm::vec3 pos;
-  glm::vec3 normal;
+// A flat array of mesh data. It either owns its elements, in which case they
+// can be modified and added to, or refers to elements owned by something else,
+// e.g. a memory-mapped mesh file, which it keeps alive. The latter are read
+// only, and let meshes use their data in place rather than copying it.
+template <typename T>
+class MeshArray {
+ public:
+  MeshArray() = default;
+  // Takes ownership of the given elements.
+  MeshArray(std::vector<T> values) : values_(std::move(values)) { Update(); }
+  // Refers to `size` elements at `data`, which stay valid as long as `owner`
+  // is alive.
+  MeshArray(const T *data, size_t size, std::shared_ptr<const void> owner)
+      : data_(data), size_(size), owner_(std::move(owner)) {}
+
+  // Moving a vector keeps its elements in place, so the moved array stays
+  // valid; copying it wouldn't.
+  MeshArray(MeshArray &&other) { *this = std::move(other); }
+  MeshArray &operator=(MeshArray &&other) {
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+    values_ = std::move(other.values_);
+    owner_ = std::move(other.owner_);
+    return *this;
+  }
+  MeshArray(const MeshArray &) = delete;
+  MeshArray &operator=(const MeshArray &) = delete;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T *data() const { return data_; }
+  const T &operator[](size_t i) const { return data_[i]; }
+  const T *begin() const { return data_; }
+  const T *end() const { return data_ + size_; }
+
+  // Whether the elements are owned, and so can be modified.
+  bool owned() const { return owner_ == nullptr; }
+  // Returns the elements for modification. Only valid for owned arrays.
+  T *mutable_data() {
+    DCHECK(owned());
+    return values_.data();
+  }
+  void push_back(const T &value) {
+    DCHECK(owned());
+    values_.push_back(value);
+    Update();
+  }
+  void assign(size_t size, const T &value) {
+    DCHECK(owned());
+    values_.assign(size, value);
+    Update();
+  }
+
+ private:
+  // Points the array at the owned elements, after they've changed.
+  void Update() {
+    data_ = values_.data();
+    size_ = values_.size();
+  }
+
+  const T *data_ = nullptr;
+  size_t size_ = 0;
+  std::vector<T> values_;
+  std::shared_ptr<const void> owner_;
+};
+
+// The vertices of a mesh, stored as a structure of arrays. They may be shared
+// between several meshes, e.g. tris with different materials that reference
+// the same vertices.
+struct MeshVertices {
+  // Adds a vertex at the given position, with a zero normal.
+  void Add(const glm::vec3 &pos) {
+    positions.push_back(pos);
+    normals.push_back(glm::vec3(0.0f));
+  }
+
+  MeshArray<glm::vec3> positions;
+  // The vertex normals, in the same order. These may be left empty if the
+  // meshes don't use vertex normals.
+  MeshArray<glm::vec3> normals;
 };
 
 }  // namespace muon
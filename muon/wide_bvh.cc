@@ -0,0 +1,580 @@
+#include "muon/wide_bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "muon/types.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace muon {
+namespace acceleration {
+
+namespace {
+
+// Returns the plane of a child box (0 for its min, 1 for its max) along an
+// axis, for a single lane.
+template <int N>
+float ChildPlane(const WideBVHNode<N> &node, int plane, int axis, int lane) {
+  return node.bounds[plane][axis][lane];
+}
+
+template <int N>
+float ChildPlane(const QuantizedWideBVHNode<N> &node, int plane, int axis,
+                 int lane) {
+  return node.origin[axis] +
+         static_cast<float>(node.bounds[plane][axis][lane]) * node.scale[axis];
+}
+
+#if defined(__SSE2__)
+// Returns the planes of four consecutive child boxes, starting at `lane`. For
+// quantized nodes, these are decoded with the same operations as
+// ChildPlane().
+template <int N>
+__m128 LoadFourPlanes(const WideBVHNode<N> &node, int plane, int axis,
+                      int lane) {
+  return _mm_load_ps(&node.bounds[plane][axis][lane]);
+}
+
+template <int N>
+__m128 LoadFourPlanes(const QuantizedWideBVHNode<N> &node, int plane, int axis,
+                      int lane) {
+  int32_t packed;
+  std::memcpy(&packed, &node.bounds[plane][axis][lane], sizeof(packed));
+  // Zero-extend the bytes to 32-bit integers.
+  __m128i zero = _mm_setzero_si128();
+  __m128i ints = _mm_unpacklo_epi16(
+      _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+  return _mm_add_ps(_mm_set1_ps(node.origin[axis]),
+                    _mm_mul_ps(_mm_cvtepi32_ps(ints),
+                               _mm_set1_ps(node.scale[axis])));
+}
+
+// Tests four consecutive child boxes of a node, starting at `lane`, within the
+// distance range [0, t_max]. Returns a bitmask of the boxes that were hit, and
+// outputs the distance at which the ray enters each box.
+template <typename Node>
+int IntersectFourLanes(const Node &node, int lane, const TraversalRay &r,
+                       float t_max, float *t_enter) {
+  __m128 t0 = _mm_setzero_ps();
+  __m128 t1 = _mm_set1_ps(t_max);
+  for (int axis = 0; axis < 3; ++axis) {
+    __m128 origin = _mm_set1_ps(r.origin[axis]);
+    __m128 inv_direction = _mm_set1_ps(r.inv_direction[axis]);
+    // Select the near and far planes based on the direction's sign, which
+    // avoids having to swap the slab distances.
+    int near = r.dir_is_negative[axis];
+    __m128 t_near = _mm_mul_ps(
+        _mm_sub_ps(LoadFourPlanes(node, near, axis, lane), origin),
+        inv_direction);
+    // The far distances are scaled like Bounds::HasIntersection()'s, so that
+    // grazing rays hit the same boxes.
+    __m128 t_far = _mm_mul_ps(
+        _mm_mul_ps(
+            _mm_sub_ps(LoadFourPlanes(node, 1 - near, axis, lane), origin),
+            inv_direction),
+        _mm_set1_ps(kSlabErrorScale));
+    // Note, min and max return their second operand if either operand is NaN
+    // (which can happen when the origin lies on a plane of a box with a zero
+    // direction component), so the running window is kept in that case.
+    t0 = _mm_max_ps(t_near, t0);
+    t1 = _mm_min_ps(t_far, t1);
+  }
+  _mm_storeu_ps(t_enter, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(__AVX__)
+// Returns the planes of all eight child boxes. See LoadFourPlanes().
+__m256 LoadEightPlanes(const WideBVHNode<8> &node, int plane, int axis) {
+  return _mm256_load_ps(node.bounds[plane][axis]);
+}
+
+__m256 LoadEightPlanes(const QuantizedWideBVHNode<8> &node, int plane,
+                       int axis) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i shorts = _mm_unpacklo_epi8(
+      _mm_loadl_epi64(
+          reinterpret_cast<const __m128i *>(node.bounds[plane][axis])),
+      zero);
+  __m256i ints =
+      _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(
+                                  shorts, zero)),
+                              _mm_unpackhi_epi16(shorts, zero), 1);
+  return _mm256_add_ps(_mm256_set1_ps(node.origin[axis]),
+                       _mm256_mul_ps(_mm256_cvtepi32_ps(ints),
+                                     _mm256_set1_ps(node.scale[axis])));
+}
+
+// Tests all eight child boxes of a node at once. See IntersectFourLanes().
+template <typename Node>
+int IntersectEightLanes(const Node &node, const TraversalRay &r, float t_max,
+                        float *t_enter) {
+  __m256 t0 = _mm256_setzero_ps();
+  __m256 t1 = _mm256_set1_ps(t_max);
+  for (int axis = 0; axis < 3; ++axis) {
+    __m256 origin = _mm256_set1_ps(r.origin[axis]);
+    __m256 inv_direction = _mm256_set1_ps(r.inv_direction[axis]);
+    int near = r.dir_is_negative[axis];
+    __m256 t_near = _mm256_mul_ps(
+        _mm256_sub_ps(LoadEightPlanes(node, near, axis), origin),
+        inv_direction);
+    __m256 t_far = _mm256_mul_ps(
+        _mm256_mul_ps(
+            _mm256_sub_ps(LoadEightPlanes(node, 1 - near, axis), origin),
+            inv_direction),
+        _mm256_set1_ps(kSlabErrorScale));
+    t0 = _mm256_max_ps(t_near, t0);
+    t1 = _mm256_min_ps(t_far, t1);
+  }
+  _mm256_storeu_ps(t_enter, t0);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// Tests all child boxes of a node within the distance range [0, t_max], like
+// Bounds::HasIntersection(). Returns a bitmask of the valid children that were
+// hit, and outputs the distance at which the ray enters each box. Uses SIMD
+// instructions where available, and falls back to a scalar loop otherwise.
+template <typename Node>
+int IntersectChildren(const Node &node, const TraversalRay &r, float t_max,
+                      float *t_enter) {
+  constexpr int N = Node::kWidth;
+  int mask = 0;
+#if defined(__AVX__)
+  if constexpr (N == 8) {
+    mask = IntersectEightLanes(node, r, t_max, t_enter);
+  } else {
+    mask = IntersectFourLanes(node, 0, r, t_max, t_enter);
+  }
+#elif defined(__SSE2__)
+  for (int lane = 0; lane < N; lane += 4) {
+    mask |= IntersectFourLanes(node, lane, r, t_max, t_enter + lane) << lane;
+  }
+#else
+  for (int lane = 0; lane < N; ++lane) {
+    float t0 = 0.0f;
+    float t1 = t_max;
+    for (int axis = 0; axis < 3; ++axis) {
+      int near = r.dir_is_negative[axis];
+      float t_near = (ChildPlane(node, near, axis, lane) - r.origin[axis]) *
+                     r.inv_direction[axis];
+      float t_far = (ChildPlane(node, 1 - near, axis, lane) - r.origin[axis]) *
+                    r.inv_direction[axis] * kSlabErrorScale;
+      // Written so that NaN values leave the window untouched.
+      t0 = t_near > t0 ? t_near : t0;
+      t1 = t_far < t1 ? t_far : t1;
+    }
+    t_enter[lane] = t0;
+    mask |= (t0 <= t1) << lane;
+  }
+#endif
+  return mask & ((1 << node.num_children) - 1);
+}
+
+// Stores the bounds of the given children in a node's lanes. Unused lanes get
+// inverted bounds, which never intersect.
+template <int N>
+void SetChildBounds(WideBVHNode<N> &node, const Bounds *children,
+                    int num_children) {
+  for (int lane = 0; lane < N; ++lane) {
+    for (int axis = 0; axis < 3; ++axis) {
+      node.bounds[0][axis][lane] =
+          lane < num_children ? children[lane].min_pos[axis]
+                              : std::numeric_limits<float>::infinity();
+      node.bounds[1][axis][lane] =
+          lane < num_children ? children[lane].max_pos[axis]
+                              : -std::numeric_limits<float>::infinity();
+    }
+  }
+}
+
+// Quantizes the bounds of the given children onto a grid of 255 cells per axis
+// that spans their union. The quantized boxes are rounded outwards, and then
+// checked against ChildPlane() so that they contain the original boxes
+// despite any rounding while decoding. Unused lanes are masked out during
+// traversal, so their bounds are left as an empty box.
+template <int N>
+void SetChildBounds(QuantizedWideBVHNode<N> &node, const Bounds *children,
+                    int num_children) {
+  constexpr int kMaxCell = std::numeric_limits<uint8_t>::max();
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo = std::numeric_limits<float>::infinity();
+    float hi = -std::numeric_limits<float>::infinity();
+    for (int lane = 0; lane < num_children; ++lane) {
+      lo = std::min(lo, children[lane].min_pos[axis]);
+      hi = std::max(hi, children[lane].max_pos[axis]);
+    }
+    assert(std::isfinite(lo) && std::isfinite(hi));
+    // Decodes a quantized coordinate exactly like ChildPlane().
+    auto decode = [&node, axis](int q) {
+      return node.origin[axis] + static_cast<float>(q) * node.scale[axis];
+    };
+    node.origin[axis] = lo;
+    node.scale[axis] = (hi - lo) / kMaxCell;
+    while (decode(kMaxCell) < hi) {
+      // Rounding left the grid short of the upper bound.
+      node.scale[axis] = std::nextafter(node.scale[axis],
+                                        std::numeric_limits<float>::max());
+    }
+
+    for (int lane = 0; lane < N; ++lane) {
+      uint8_t &q_min = node.bounds[0][axis][lane];
+      uint8_t &q_max = node.bounds[1][axis][lane];
+      if (lane >= num_children) {
+        q_min = kMaxCell;
+        q_max = 0;
+        continue;
+      }
+      if (node.scale[axis] == 0.0f) {
+        // All children are flat on this axis, and decode to the origin.
+        q_min = q_max = 0;
+        continue;
+      }
+      const Bounds &bounds = children[lane];
+      float min_cell =
+          std::floor((bounds.min_pos[axis] - lo) / node.scale[axis]);
+      float max_cell =
+          std::ceil((bounds.max_pos[axis] - lo) / node.scale[axis]);
+      q_min = std::clamp<float>(min_cell, 0, kMaxCell);
+      q_max = std::clamp<float>(max_cell, 0, kMaxCell);
+      while (q_min > 0 && decode(q_min) > bounds.min_pos[axis]) {
+        --q_min;
+      }
+      while (q_max < kMaxCell && decode(q_max) < bounds.max_pos[axis]) {
+        ++q_max;
+      }
+    }
+  }
+}
+
+}  // namespace
+
+template <int N, bool kQuantized>
+void WideBVH<N, kQuantized>::Init() {
+  std::vector<PrimitiveRef> refs = GatherPrimitiveRefs();
+  build_stats_.SetNumPrimitives(refs.size());
+  if (refs.empty()) {
+    return;
+  }
+  auto start_time = std::chrono::steady_clock::now();
+
+  Arena arena;
+  size_t num_binary_nodes = 0;
+  BVHNode *root = BuildTree(refs, arena, num_binary_nodes);
+  RecordTreeQuality(*root);
+  PackTriangles(*root);
+  nodes_.clear();
+  build_stats_.ClearLeaves();
+  Collapse(*root, 0);
+  built_cost_ = RefitNodes(/*update=*/false);
+
+  build_stats_.SetNumNodes(nodes_.size());
+  build_stats_.SetTreeNodeBytes(num_binary_nodes * sizeof(BVHNode));
+  build_stats_.SetLinearNodeBytes(nodes_.size() * sizeof(Node));
+  build_stats_.SetBuildAllocations(arena.num_allocations(),
+                                   arena.num_blocks());
+  build_stats_.SetBuildTime(std::chrono::steady_clock::now() - start_time);
+}
+
+template <int N, bool kQuantized>
+double WideBVH<N, kQuantized>::RefitNodes(bool update) {
+  // Children always come after their parents, so a reverse pass visits them
+  // first. The cost counts a visit to each wide node as a single traversal
+  // step.
+  std::vector<Bounds> node_bounds(nodes_.size());
+  double cost = 0.0;
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    Node &node = nodes_[i];
+    Bounds child_bounds[N];
+    for (int lane = 0; lane < node.num_children; ++lane) {
+      if (node.num_primitives[lane] > 0) {
+        uint32_t start = node.child[lane];
+        for (uint32_t j = start; j < start + node.num_primitives[lane]; ++j) {
+          child_bounds[lane] = Bounds::Union(
+              child_bounds[lane], leaf_primitives_[j].WorldBounds());
+        }
+        cost += child_bounds[lane].SurfaceArea() *
+                options().intersection_cost * node.num_primitives[lane];
+      } else {
+        child_bounds[lane] = node_bounds[node.child[lane]];
+      }
+      node_bounds[i] = Bounds::Union(node_bounds[i], child_bounds[lane]);
+    }
+    cost += node_bounds[i].SurfaceArea() * options().traversal_cost;
+    if (update) {
+      SetChildBounds(node, child_bounds, node.num_children);
+    }
+  }
+  float root_area = node_bounds.empty() ? 0.0f : node_bounds[0].SurfaceArea();
+  return root_area > 0.0f ? cost / root_area : 0.0;
+}
+
+template <int N, bool kQuantized>
+bool WideBVH<N, kQuantized>::SaveToCache(CacheWriter &writer) const {
+  writer.Write(uint32_t(sizeof(Node)));
+  writer.WriteVector(nodes_);
+  SaveLeafData(writer);
+  return true;
+}
+
+template <int N, bool kQuantized>
+bool WideBVH<N, kQuantized>::LoadFromCache(CacheReader &reader) {
+  auto start_time = std::chrono::steady_clock::now();
+  uint32_t node_size;
+  std::vector<Node> nodes;
+  if (!reader.Read(node_size) || node_size != sizeof(Node) ||
+      !reader.ReadVector(nodes) || !LoadLeafData(reader)) {
+    return false;
+  }
+  // As with the binary BVH, children always come after their parent.
+  for (uint32_t index = 0; index < nodes.size(); ++index) {
+    const Node &node = nodes[index];
+    if (node.num_children > N) {
+      return false;
+    }
+    for (int lane = 0; lane < node.num_children; ++lane) {
+      if (node.num_primitives[lane] > 0) {
+        if (!IsValidCachedLeaf(node.child[lane], node.num_primitives[lane])) {
+          return false;
+        }
+      } else if (node.child[lane] <= index ||
+                 node.child[lane] >= nodes.size()) {
+        return false;
+      }
+    }
+  }
+  nodes_ = std::move(nodes);
+
+  // Recover the leaf stats by walking the collapsed tree.
+  std::vector<std::pair<uint32_t, uint32_t>> stack;
+  if (!nodes_.empty()) {
+    stack.emplace_back(0, 0);
+  }
+  while (!stack.empty()) {
+    uint32_t index = stack.back().first;
+    uint32_t depth = stack.back().second;
+    stack.pop_back();
+    const Node &node = nodes_[index];
+    for (int lane = 0; lane < node.num_children; ++lane) {
+      if (node.num_primitives[lane] > 0) {
+        build_stats_.AddLeaf(node.num_primitives[lane], depth + 1);
+      } else {
+        stack.emplace_back(node.child[lane], depth + 1);
+      }
+    }
+  }
+
+  built_cost_ = RefitNodes(/*update=*/false);
+
+  build_stats_.SetNumNodes(nodes_.size());
+  build_stats_.SetLinearNodeBytes(nodes_.size() * sizeof(Node));
+  build_stats_.SetBuildTime(std::chrono::steady_clock::now() - start_time);
+  return true;
+}
+
+template <int N, bool kQuantized>
+uint32_t WideBVH<N, kQuantized>::Collapse(const BVHNode &node,
+                                         uint32_t depth) {
+  // Gather up to N children by repeatedly replacing the internal child with
+  // the largest surface area by its own two children. Opening the largest
+  // children first keeps the collapsed tree close to the SAH-optimized binary
+  // tree. A single leaf (i.e. a tree with only one primitive) becomes the sole
+  // child of the root.
+  const BVHNode *children[N];
+  int num_children = 0;
+  if (node.num_primitives > 0) {
+    children[num_children++] = &node;
+  } else {
+    children[num_children++] = node.children[0];
+    children[num_children++] = node.children[1];
+  }
+  while (num_children < N) {
+    int largest = -1;
+    float largest_area = -1.0f;
+    for (int i = 0; i < num_children; ++i) {
+      if (children[i]->num_primitives > 0) {
+        continue;
+      }
+      float area = children[i]->bounds.SurfaceArea();
+      if (area > largest_area) {
+        largest = i;
+        largest_area = area;
+      }
+    }
+    if (largest == -1) {
+      // All children are leaves.
+      break;
+    }
+    const BVHNode *opened = children[largest];
+    children[largest] = opened->children[0];
+    children[num_children++] = opened->children[1];
+  }
+
+  uint32_t index = nodes_.size();
+  nodes_.emplace_back();
+  Node &wide_node = nodes_.back();
+  Bounds child_bounds[N];
+  for (int lane = 0; lane < num_children; ++lane) {
+    child_bounds[lane] = children[lane]->bounds;
+  }
+  SetChildBounds(wide_node, child_bounds, num_children);
+  for (int lane = 0; lane < N; ++lane) {
+    wide_node.child[lane] = 0;
+    wide_node.num_primitives[lane] = 0;
+  }
+  wide_node.num_children = num_children;
+
+  for (int lane = 0; lane < num_children; ++lane) {
+    const BVHNode &child = *children[lane];
+    if (child.num_primitives > 0) {
+      assert(child.num_primitives <= kMaxLeafPrimitives);
+      wide_node.child[lane] = child.start;
+      wide_node.num_primitives[lane] = child.num_primitives;
+      build_stats_.AddLeaf(child.num_primitives, depth + 1);
+    }
+  }
+
+  // Recurse into internal children. Note that we can't hold on to the
+  // wide_node reference here, since the recursion may cause the nodes vector to
+  // reallocate.
+  for (int lane = 0; lane < num_children; ++lane) {
+    if (children[lane]->num_primitives == 0) {
+      uint32_t child_index = Collapse(*children[lane], depth + 1);
+      nodes_[index].child[lane] = child_index;
+    }
+  }
+  return index;
+}
+
+template <int N, bool kQuantized>
+bool WideBVH<N, kQuantized>::IntersectClosest(Workspace *workspace,
+                                              const Ray &ray,
+                                              HitRecord &hit) const {
+  if (nodes_.empty()) {
+    return false;
+  }
+  std::vector<WideBVHStackEntry> &frontier =
+      static_cast<WideBVHWorkspace *>(workspace)->frontier_;
+  TraversalRay r(ray);
+  TriangleRay triangle_ray(ray);
+
+  const float max_distance = hit.distance;
+  frontier.push_back({0, 0, 0.0f});
+
+  while (!frontier.empty()) {
+    WideBVHStackEntry entry = frontier.back();
+    frontier.pop_back();
+    // Boxes are culled against the closest hit's distance widened by
+    // kDistanceBoundScale, so that they're never culled by rounding when they
+    // contain an equally close hit. Skip any entries that we've found a closer
+    // intersection than since they were pushed.
+    const float cull_distance = hit.distance * kDistanceBoundScale;
+    if (entry.t_enter > cull_distance) {
+      continue;
+    }
+
+    // If this is a leaf, intersect with the primitives directly.
+    if (entry.num_primitives > 0) {
+      IntersectLeaf(workspace, ray, triangle_ray, entry.index,
+                    entry.num_primitives, hit);
+      continue;
+    }
+
+    // Otherwise, test all children at once.
+    const Node &node = nodes_[entry.index];
+    float t_enter[N];
+    workspace->stats.IncrementBoundsTests(node.num_children);
+    int mask = IntersectChildren(node, r, cull_distance, t_enter);
+    if (mask == 0) {
+      continue;
+    }
+
+    // Sort the children that were hit by their entry distance, and push them
+    // farthest first so that the nearest child is visited next.
+    WideBVHStackEntry hits[N];
+    int num_hits = 0;
+    for (int lane = 0; lane < N; ++lane) {
+      if (!(mask & (1 << lane))) {
+        continue;
+      }
+      WideBVHStackEntry child_entry = {node.child[lane],
+                                       node.num_primitives[lane],
+                                       t_enter[lane]};
+      int i = num_hits++;
+      for (; i > 0 && hits[i - 1].t_enter < child_entry.t_enter; --i) {
+        hits[i] = hits[i - 1];
+      }
+      hits[i] = child_entry;
+    }
+    workspace->stats.IncrementBoundsHits(num_hits);
+    frontier.insert(frontier.end(), hits, hits + num_hits);
+  }
+
+  return hit.distance < max_distance;
+}
+
+template <int N, bool kQuantized>
+PrimitiveRef WideBVH<N, kQuantized>::FindOccluder(
+    Workspace *workspace, const Ray &ray, const float max_distance) const {
+  if (nodes_.empty()) {
+    return PrimitiveRef();
+  }
+  std::vector<WideBVHStackEntry> &frontier =
+      static_cast<WideBVHWorkspace *>(workspace)->frontier_;
+  // See IntersectClosest() for details on how the intersection logic works.
+  // Since any intersection will do, we don't bother sorting children here.
+  // Instead, leaf children are tested as soon as their bounds are hit, before
+  // descending into any internal children: they're cheap to test, and may end
+  // the search right away. Only internal nodes are pushed to the frontier.
+  TraversalRay r(ray);
+  TriangleRay triangle_ray(ray);
+  const float cull_distance = max_distance * kDistanceBoundScale;
+  frontier.push_back({0, 0, 0.0f});
+
+  while (!frontier.empty()) {
+    const Node &node = nodes_[frontier.back().index];
+    frontier.pop_back();
+    float t_enter[N];
+    workspace->stats.IncrementBoundsTests(node.num_children);
+    int mask = IntersectChildren(node, r, cull_distance, t_enter);
+    for (int lane = 0; lane < N; ++lane) {
+      if (!(mask & (1 << lane))) {
+        continue;
+      }
+      workspace->stats.IncrementBoundsHits();
+      if (node.num_primitives[lane] == 0) {
+        frontier.push_back({node.child[lane], 0, t_enter[lane]});
+        continue;
+      }
+      PrimitiveRef occluder =
+          FindLeafOccluder(workspace, ray, triangle_ray, node.child[lane],
+                           node.num_primitives[lane], max_distance);
+      if (occluder.primitive != nullptr) {
+        // Clear the frontier since we're exiting before searching it
+        // completely.
+        frontier.clear();
+        return occluder;
+      }
+    }
+  }
+
+  return PrimitiveRef();
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+template class WideBVH<4, /*kQuantized=*/true>;
+template class WideBVH<8, /*kQuantized=*/true>;
+
+}  // namespace acceleration
+}  // namespace muon
@@ -0,0 +1,136 @@
+#ifndef MUON_WIDE_BVH_H_
+#define MUON_WIDE_BVH_H_
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "absl/types/optional.h"
+#include "muon/acceleration.h"
+#include "muon/acceleration_type.h"
+#include "muon/bounds.h"
+#include "muon/objects.h"
+
+namespace muon {
+namespace acceleration {
+
+// A single node of an N-wide BVH. The child bounds are stored in
+// structure-of-arrays layout so that all N child boxes can be tested against a
+// ray at once with SIMD instructions. Children are packed into the first
+// `num_children` lanes; unused lanes have inverted (empty) bounds.
+template <int N>
+struct alignas(32) WideBVHNode {
+  static constexpr int kWidth = N;
+
+  // Child bounds, indexed by [min/max][axis][lane].
+  float bounds[2][3][N];
+  // For internal children, the index of the child node. For leaf children,
+  // the start primitives index.
+  uint32_t child[N];
+  // The number of primitives of each child. If this is greater than 0, then
+  // the child is a leaf; otherwise, it is an internal node.
+  uint16_t num_primitives[N];
+  // The number of valid children in the node.
+  uint8_t num_children;
+};
+
+// A compressed variant of WideBVHNode, whose child bounds are quantized to 8
+// bits on a grid spanning the union of the children. Each quantized coordinate
+// q decodes to `origin + q * scale`, and the encoded bounds always contain the
+// original ones. This more than halves the size of each node (e.g. 128 instead
+// of 256 bytes for N=8), so that more of the tree fits in cache, at the cost of
+// decoding the bounds during traversal and slightly looser boxes.
+template <int N>
+struct alignas(16) QuantizedWideBVHNode {
+  static constexpr int kWidth = N;
+
+  // The origin and cell size of the quantization grid on each axis.
+  float origin[3];
+  float scale[3];
+  // Quantized child bounds, indexed by [min/max][axis][lane].
+  uint8_t bounds[2][3][N];
+  // See WideBVHNode.
+  uint32_t child[N];
+  uint16_t num_primitives[N];
+  uint8_t num_children;
+};
+static_assert(sizeof(QuantizedWideBVHNode<8>) == 128,
+              "QuantizedWideBVHNode<8> should be 128 bytes in size");
+
+// A stack entry used while traversing a WideBVH.
+struct WideBVHStackEntry {
+  // The node index, or the start primitives index for leaves.
+  uint32_t index;
+  // The number of primitives, if this is a leaf. 0 otherwise.
+  uint32_t num_primitives;
+  // The distance at which the ray enters the entry's bounds.
+  float t_enter;
+};
+
+// A reusable stack space for use while checking WideBVH intersection.
+class WideBVHWorkspace : public Workspace {
+ public:
+  WideBVHWorkspace() { frontier_.reserve(kBVHStackSize); }
+
+ private:
+  // A stack of entries to visit while checking intersection. Is empty before
+  // and after intersection.
+  std::vector<WideBVHStackEntry> frontier_;
+
+  template <int N, bool kQuantized>
+  friend class WideBVH;
+};
+
+// A BVH with a branching factor of N (i.e. a QBVH for N=4, or an OBVH for
+// N=8). It is constructed by building a binary BVH and then collapsing it,
+// repeatedly pulling up the grandchildren of the largest internal children
+// until each node has up to N children. This results in a much shallower tree,
+// so each ray visits far fewer nodes, and the child bounds of each node are
+// tested all at once via SSE/AVX when available. If kQuantized is set, the
+// nodes are stored as QuantizedWideBVHNodes and decoded during traversal.
+template <int N, bool kQuantized = false>
+class WideBVH : public BVH {
+ public:
+  static_assert(N == 4 || N == 8, "WideBVH only supports widths of 4 and 8");
+
+  using Node =
+      std::conditional_t<kQuantized, QuantizedWideBVHNode<N>, WideBVHNode<N>>;
+
+  explicit WideBVH(PartitionStrategy strategy,
+                   const BVHBuildOptions &options = BVHBuildOptions())
+      : BVH(strategy, options) {}
+
+  void Init() override;
+  bool SaveToCache(CacheWriter &writer) const override;
+  bool LoadFromCache(CacheReader &reader) override;
+
+  std::unique_ptr<Workspace> CreateWorkspace() const override {
+    return absl::make_unique<WideBVHWorkspace>();
+  }
+
+  bool IntersectClosest(Workspace *workspace, const Ray &ray,
+                        HitRecord &hit) const override;
+  PrimitiveRef FindOccluder(Workspace *workspace, const Ray &ray,
+                            const float max_distance) const override;
+
+ private:
+  // The collapsed tree, with the root node at index 0.
+  std::vector<Node> nodes_;
+
+  double RefitNodes(bool update) override;
+
+  // Recursively collapses the children of the given binary node into a new
+  // wide node at the given depth, and returns its index.
+  uint32_t Collapse(const BVHNode &node, uint32_t depth);
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+using CompressedBVH4 = WideBVH<4, /*kQuantized=*/true>;
+using CompressedBVH8 = WideBVH<8, /*kQuantized=*/true>;
+
+}  // namespace acceleration
+}  // namespace muon
+
+#endif
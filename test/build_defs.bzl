@@ -1,7 +1,23 @@
-def scene_diff_test(name, scene, golden, truth=None, tolerance=None, size="medium"):
-  """Creates a diff test for the given scene files."""
+def scene_diff_test(name, scene, golden, truth=None, tolerance=None, frame=None, flags=None, data=None, scene_cache=False, size="medium"):
+  """Creates a diff test for the given scene files.
+
+  For scenes with several frames, `frame` is the frame to compare, formatted as
+  in the output file names (e.g. "0003"). `flags` is a list of extra flags to
+  render with (e.g. ["--acceleration=bvh8"]). `data` lists any other files the
+  scene uses, e.g. models that it loads. With `scene_cache`, the scene is first
+  rendered once to fill a scene cache, which the compared render then loads.
+  """
   extra_args = []
   extra_data = []
+  env = {}
+  if frame != None:
+    env["FRAME"] = frame
+  if flags != None:
+    env["FLAGS"] = " ".join(flags)
+  if data != None:
+    extra_data.extend(data)
+  if scene_cache:
+    env["SCENE_CACHE"] = "1"
   if truth != None:
     # Nondeterministic test requested.
     if tolerance == None:
@@ -26,4 +42,5 @@ def scene_diff_test(name, scene, golden, truth=None, tolerance=None, size="mediu
       deps = [
           "@bazel_tools//tools/bash/runfiles",
       ],
+      env = env,
   )
@@ -10,6 +10,12 @@
 #
 # Usage for nondeterministic tests:
 #   diff_test.sh <test_scene> <golden_image> <truth_image> <mae_tolerance>
+#
+# For scenes with several frames, set FRAME to the frame to compare (e.g.
+# "0003"), as formatted in the output file names. Set FLAGS to any extra flags
+# to render with (e.g. "--acceleration=bvh8"). Set SCENE_CACHE to render the
+# scene once beforehand with a scene cache, so that the compared render loads
+# its structures from the cache.
 
 # --- begin runfiles.bash initialization v2 ---
 # Copy-pasted from the Bazel Bash runfiles library v2.
@@ -41,6 +47,9 @@ SCENE="$1"
 GOLDEN="$2"
 TRUTH=""
 TOLERANCE=""
+FRAME="${FRAME:-}"
+FLAGS="${FLAGS:-}"
+SCENE_CACHE="${SCENE_CACHE:-}"
 
 if [[ $# -gt 2 ]]; then
   TRUTH="$3"
@@ -64,6 +73,16 @@ if [[ ! -f $GOLDEN_IMAGE ]]; then
   exit 1
 fi
 
+# Returns the path that the frame being compared was written to, given the
+# output path.
+function frame_output {
+  if [[ "$FRAME" != "" ]]; then
+    echo "${1%.png}_$FRAME.png"
+  else
+    echo "$1"
+  fi
+}
+
 # Renders an image via the given scene file and compares the output to the
 # golden.
 function test_diff_equality {
@@ -71,7 +90,8 @@ function test_diff_equality {
   DIFF_FILE="$TEST_UNDECLARED_OUTPUTS_DIR/diff.png"
 
   # Render the image.
-  $MUON --scene="$SCENE_FILE" --output="$OUTPUT_FILE"
+  $MUON --scene="$SCENE_FILE" --output="$OUTPUT_FILE" $FLAGS
+  OUTPUT_FILE="$(frame_output "$OUTPUT_FILE")"
 
   # Generate a diff image.
   abs_error=$(compare -metric AE "$OUTPUT_FILE" "$GOLDEN_IMAGE" "$DIFF_FILE" 2>&1 || :)
@@ -98,7 +118,8 @@ function test_diff_mae {
   fi
 
   # Render the image.
-  $MUON --scene="$SCENE_FILE" --output="$OUTPUT_FILE"
+  $MUON --scene="$SCENE_FILE" --output="$OUTPUT_FILE" $FLAGS
+  OUTPUT_FILE="$(frame_output "$OUTPUT_FILE")"
 
   # Generate a diff image with the truth, and also generate a diff image with
   # the golden.
@@ -113,6 +134,23 @@ function test_diff_mae {
   fi
 }
 
+# Fills a scene cache by rendering the scene once, and has the compared render
+# use it.
+function warm_scene_cache {
+  CACHE_DIR="$TEST_TMPDIR/scene_cache"
+  FLAGS="$FLAGS --scene_cache_dir=$CACHE_DIR"
+
+  $MUON --scene="$SCENE_FILE" --output="$TEST_TMPDIR/cold.png" $FLAGS
+  if [[ -z "$(ls -A "$CACHE_DIR" 2> /dev/null)" ]]; then
+    echo "ERROR: Nothing was written to the scene cache"
+    exit 1
+  fi
+}
+
+if [[ "$SCENE_CACHE" != "" ]]; then
+  warm_scene_cache
+fi
+
 if [[ "$TRUTH" != "" ]]; then
   test_diff_mae
 else